@@ -14,29 +14,31 @@
 #include "rtweekend.h"
 
 
-class aabb {
+template <typename T>
+class aabb_t {
     public:
-        aabb() {}
-        aabb(const point3& a, const point3& b) { minimum = a; maximum = b; }
+        aabb_t() {}
+        aabb_t(const vec3_t<T>& a, const vec3_t<T>& b) { minimum = a; maximum = b; }
 
-        point3 min() const {return minimum; }
-        point3 max() const {return maximum; }
+        vec3_t<T> min() const {return minimum; }
+        vec3_t<T> max() const {return maximum; }
 
-        bool hit(const ray& r, double t_min, double t_max) const {
+        bool hit(const ray_t<T>& r, double t_min, double t_max) const {
+            T lo = t_min, hi = t_max;
             for (int a = 0; a < 3; a++) {
-                auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
-                               (maximum[a] - r.origin()[a]) / r.direction()[a]);
-                auto t1 = fmax((minimum[a] - r.origin()[a]) / r.direction()[a],
-                               (maximum[a] - r.origin()[a]) / r.direction()[a]);
-                t_min = fmax(t0, t_min);
-                t_max = fmin(t1, t_max);
-                if (t_max <= t_min)
+                auto t0 = std::fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
+                                    (maximum[a] - r.origin()[a]) / r.direction()[a]);
+                auto t1 = std::fmax((minimum[a] - r.origin()[a]) / r.direction()[a],
+                                    (maximum[a] - r.origin()[a]) / r.direction()[a]);
+                lo = std::fmax(t0, lo);
+                hi = std::fmin(t1, hi);
+                if (hi <= lo)
                     return false;
             }
             return true;
         }
 
-        double area() const {
+        T area() const {
             auto a = maximum.x() - minimum.x();
             auto b = maximum.y() - minimum.y();
             auto c = maximum.z() - minimum.z();
@@ -56,20 +58,25 @@ class aabb {
         }
 
     public:
-        point3 minimum;
-        point3 maximum;
+        vec3_t<T> minimum;
+        vec3_t<T> maximum;
 };
 
-aabb surrounding_box(aabb box0, aabb box1) {
-    vec3 small(fmin(box0.min().x(), box1.min().x()),
-               fmin(box0.min().y(), box1.min().y()),
-               fmin(box0.min().z(), box1.min().z()));
 
-    vec3 big  (fmax(box0.max().x(), box1.max().x()),
-               fmax(box0.max().y(), box1.max().y()),
-               fmax(box0.max().z(), box1.max().z()));
+using aabb = aabb_t<real>;
 
-    return aabb(small,big);
+
+template <typename T>
+aabb_t<T> surrounding_box(const aabb_t<T>& box0, const aabb_t<T>& box1) {
+    vec3_t<T> small(std::fmin(box0.min().x(), box1.min().x()),
+                    std::fmin(box0.min().y(), box1.min().y()),
+                    std::fmin(box0.min().z(), box1.min().z()));
+
+    vec3_t<T> big  (std::fmax(box0.max().x(), box1.max().x()),
+                    std::fmax(box0.max().y(), box1.max().y()),
+                    std::fmax(box0.max().z(), box1.max().z()));
+
+    return aabb_t<T>(small,big);
 }
 
 
@@ -0,0 +1,271 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+//==============================================================================================
+// Affine transforms stored as a 3x4 matrix: a 3x3 linear part and a translation column.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "vec3.h"
+
+
+class affine {
+    public:
+        affine() {
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 4; j++)
+                    m[i][j] = i == j ? 1 : 0;
+        }
+
+        static affine translation(const vec3& offset) {
+            affine t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = offset[i];
+            return t;
+        }
+
+        static affine scaling(const vec3& factors) {
+            affine t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][i] = factors[i];
+            return t;
+        }
+
+        // Rotation by `angle` degrees around `axis` (0, 1 or 2), counter-clockwise when
+        // looking down the axis; rotation(1, a) matches rotate_y(.., a).
+        static affine rotation(int axis, double angle) {
+            auto radians = degrees_to_radians(angle);
+            auto s = sin(radians), c = cos(radians);
+            int i = (axis + 1) % 3, j = (axis + 2) % 3;
+            affine t;
+            t.m[i][i] = c;  t.m[i][j] = -s;
+            t.m[j][i] = s;  t.m[j][j] = c;
+            return t;
+        }
+
+        // The transform that applies `b` first, then `a`.
+        friend affine operator*(const affine& a, const affine& b) {
+            affine t;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    double sum = j == 3 ? a.m[i][3] : 0;
+                    for (int k = 0; k < 3; k++)
+                        sum += a.m[i][k] * b.m[k][j];
+                    t.m[i][j] = sum;
+                }
+            }
+            return t;
+        }
+
+        double determinant() const {
+            return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                 - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                 + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        }
+
+        // Only meaningful when determinant() != 0.
+        affine inverse() const {
+            affine t;
+            double inv_det = 1 / determinant();
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    // Cofactor of m[j][i], i.e. the adjugate.
+                    int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+                    int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                    t.m[i][j] = (m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0]) * inv_det;
+                }
+            }
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = -(t.m[i][0]*m[0][3] + t.m[i][1]*m[1][3] + t.m[i][2]*m[2][3]);
+            return t;
+        }
+
+        point3 point(const point3& p) const {
+            return point3(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                          m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                          m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                        m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                        m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+
+        // Multiplies by the transposed linear part; applied to an inverse transform this
+        // maps surface normals.
+        vec3 transposed_vector(const vec3& v) const {
+            return vec3(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                        m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                        m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+        }
+
+        // Box around the eight transformed corners of `box`.
+        aabb bounds(const aabb& box) const {
+            point3 lo( infinity,  infinity,  infinity);
+            point3 hi(-infinity, -infinity, -infinity);
+            for (int corner = 0; corner < 8; corner++) {
+                point3 c((corner & 1 ? box.max() : box.min()).x(),
+                         (corner & 2 ? box.max() : box.min()).y(),
+                         (corner & 4 ? box.max() : box.min()).z());
+                point3 p = point(c);
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = std::fmin(lo[a], p[a]);
+                    hi[a] = std::fmax(hi[a], p[a]);
+                }
+            }
+            return aabb(lo, hi);
+        }
+
+    public:
+        double m[3][4];
+};
+
+
+// An affine transform split into translation * rotation * stretch, the polar decomposition of
+// its linear part. Blending keyframes part by part, with the rotation slerped, keeps the
+// in-between transforms rigid up to the stretch, where blending the matrices entry by entry
+// shears them and goes singular at a half turn.
+class affine_parts {
+    public:
+        affine_parts() {}
+
+        explicit affine_parts(const affine& a);
+
+        affine matrix() const;
+
+        // The parts of a transform `t` of the way from `a` to `b`: translation and stretch
+        // move linearly, the rotation turns at a constant rate about a fixed axis.
+        friend affine_parts interpolate(const affine_parts& a, const affine_parts& b, double t);
+
+        // Angle in radians, at most pi, the rotation turns through from `a` to `b`.
+        friend double rotation_angle(const affine_parts& a, const affine_parts& b) {
+            double dot = 0;
+            for (int i = 0; i < 4; i++)
+                dot += a.rotation[i] * b.rotation[i];
+            return 2 * acos(std::fmin(std::fabs(dot), 1.0));
+        }
+
+    public:
+        double translation[3];
+        double rotation[4];     // unit quaternion w, x, y, z
+        double stretch[3][3];   // symmetric; negative determinant for a mirroring transform
+};
+
+
+inline affine_parts::affine_parts(const affine& a) {
+    double m[3][3], r[3][3];
+    for (int i = 0; i < 3; i++) {
+        translation[i] = a.m[i][3];
+        for (int j = 0; j < 3; j++)
+            m[i][j] = r[i][j] = a.m[i][j];
+    }
+
+    // The rotation is the limit of averaging R with its inverse transpose, starting from M,
+    // or -M for a mirroring transform so the limit is a proper rotation.
+    double det = a.determinant();
+    if (std::fabs(det) < 1e-300) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                r[i][j] = i == j ? 1 : 0;
+    } else {
+        if (det < 0)
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    r[i][j] = -r[i][j];
+        for (int iteration = 0; iteration < 64; iteration++) {
+            affine current;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    current.m[i][j] = r[i][j];
+            affine inv = current.inverse();
+            double change = 0;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++) {
+                    double next = 0.5 * (r[i][j] + inv.m[j][i]);
+                    change = std::fmax(change, std::fabs(next - r[i][j]));
+                    r[i][j] = next;
+                }
+            if (change < 1e-14)
+                break;
+        }
+    }
+
+    // S = R^T M.
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            stretch[i][j] = r[0][i]*m[0][j] + r[1][i]*m[1][j] + r[2][i]*m[2][j];
+
+    // Quaternion from the rotation matrix, through its largest component.
+    double trace = r[0][0] + r[1][1] + r[2][2];
+    double* q = rotation;
+    if (trace > 0) {
+        double s = 2 * sqrt(trace + 1);
+        q[0] = s / 4;
+        q[1] = (r[2][1] - r[1][2]) / s;
+        q[2] = (r[0][2] - r[2][0]) / s;
+        q[3] = (r[1][0] - r[0][1]) / s;
+    } else {
+        int i = r[1][1] > r[0][0] ? 1 : 0;
+        if (r[2][2] > r[i][i])
+            i = 2;
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        double s = 2 * sqrt(1 + r[i][i] - r[j][j] - r[k][k]);
+        q[0] = (r[k][j] - r[j][k]) / s;
+        q[1 + i] = s / 4;
+        q[1 + j] = (r[j][i] + r[i][j]) / s;
+        q[1 + k] = (r[k][i] + r[i][k]) / s;
+    }
+}
+
+
+inline affine affine_parts::matrix() const {
+    double w = rotation[0], x = rotation[1], y = rotation[2], z = rotation[3];
+    double r[3][3] = {
+        {1 - 2*(y*y + z*z), 2*(x*y - w*z),     2*(x*z + w*y)},
+        {2*(x*y + w*z),     1 - 2*(x*x + z*z), 2*(y*z - w*x)},
+        {2*(x*z - w*y),     2*(y*z + w*x),     1 - 2*(x*x + y*y)}
+    };
+    affine t;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            t.m[i][j] = r[i][0]*stretch[0][j] + r[i][1]*stretch[1][j] + r[i][2]*stretch[2][j];
+        t.m[i][3] = translation[i];
+    }
+    return t;
+}
+
+
+inline affine_parts interpolate(const affine_parts& a, const affine_parts& b, double t) {
+    affine_parts p;
+    for (int i = 0; i < 3; i++) {
+        p.translation[i] = (1 - t) * a.translation[i] + t * b.translation[i];
+        for (int j = 0; j < 3; j++)
+            p.stretch[i][j] = (1 - t) * a.stretch[i][j] + t * b.stretch[i][j];
+    }
+
+    // Slerp along the shorter arc; nearly equal rotations are blended linearly.
+    double dot = 0;
+    for (int i = 0; i < 4; i++)
+        dot += a.rotation[i] * b.rotation[i];
+    double sign = dot < 0 ? -1 : 1;
+    dot = std::fabs(dot);
+    double wa = 1 - t, wb = t;
+    if (dot < 0.9999) {
+        double angle = acos(dot);
+        wa = sin((1 - t) * angle) / sin(angle);
+        wb = sin(t * angle) / sin(angle);
+    }
+    double norm = 0;
+    for (int i = 0; i < 4; i++) {
+        p.rotation[i] = wa * a.rotation[i] + wb * sign * b.rotation[i];
+        norm += p.rotation[i] * p.rotation[i];
+    }
+    for (int i = 0; i < 4; i++)
+        p.rotation[i] /= sqrt(norm);
+    return p;
+}
+
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef BC1_H
+#define BC1_H
+//==============================================================================================
+// BC1 (DXT1) block compression for RGB8 images.
+//
+// A 4x4 texel block is stored in 8 bytes: two RGB565 endpoint colors and a 2-bit index per
+// texel into the four-color palette spanned by them, i.e. 0.5 bytes per texel against 3 for
+// raw RGB8. The encoder fits the endpoints along the block's principal color axis; the
+// decoder recovers a single texel, so lookups never expand a whole block.
+//==============================================================================================
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+
+const int bc1_block_bytes = 8;
+
+
+namespace bc1_detail {
+    inline uint16_t pack565(const int rgb[3]) {
+        return static_cast<uint16_t>(
+            ((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3));
+    }
+
+    inline void unpack565(uint16_t c, int rgb[3]) {
+        int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        rgb[0] = (r << 3) | (r >> 2);
+        rgb[1] = (g << 2) | (g >> 4);
+        rgb[2] = (b << 3) | (b >> 2);
+    }
+
+    inline void palette(uint16_t c0, uint16_t c1, int colors[4][3]) {
+        unpack565(c0, colors[0]);
+        unpack565(c1, colors[1]);
+        for (int k = 0; k < 3; k++) {
+            if (c0 > c1) {
+                colors[2][k] = (2*colors[0][k] + colors[1][k]) / 3;
+                colors[3][k] = (colors[0][k] + 2*colors[1][k]) / 3;
+            } else {
+                colors[2][k] = (colors[0][k] + colors[1][k]) / 2;
+                colors[3][k] = 0;
+            }
+        }
+    }
+}
+
+
+// Compresses 16 RGB texels (row-major, 3 bytes each) into one block.
+inline void bc1_encode_block(
+    const unsigned char texels[16 * 3], unsigned char out[bc1_block_bytes]
+) {
+    using namespace bc1_detail;
+
+    double mean[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++)
+        for (int k = 0; k < 3; k++)
+            mean[k] += texels[3*i + k] / 16.0;
+
+    double cov[3][3] = {{0}};
+    for (int i = 0; i < 16; i++) {
+        double d[3];
+        for (int k = 0; k < 3; k++)
+            d[k] = texels[3*i + k] - mean[k];
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < 3; b++)
+                cov[a][b] += d[a] * d[b];
+    }
+
+    // Principal axis by power iteration, started on the luminance direction.
+    double axis[3] = {0.3, 0.6, 0.1};
+    for (int iter = 0; iter < 4; iter++) {
+        double next[3];
+        for (int a = 0; a < 3; a++)
+            next[a] = cov[a][0]*axis[0] + cov[a][1]*axis[1] + cov[a][2]*axis[2];
+        double len = fabs(next[0]) + fabs(next[1]) + fabs(next[2]);
+        if (len == 0)
+            break;
+        for (int a = 0; a < 3; a++)
+            axis[a] = next[a] / len;
+    }
+
+    int lo = 0, hi = 0;
+    double lo_t = 1e30, hi_t = -1e30;
+    for (int i = 0; i < 16; i++) {
+        double t = 0;
+        for (int k = 0; k < 3; k++)
+            t += (texels[3*i + k] - mean[k]) * axis[k];
+        if (t < lo_t) { lo_t = t; lo = i; }
+        if (t > hi_t) { hi_t = t; hi = i; }
+    }
+
+    int e0[3], e1[3];
+    for (int k = 0; k < 3; k++) {
+        e0[k] = texels[3*hi + k];
+        e1[k] = texels[3*lo + k];
+    }
+    uint16_t c0 = pack565(e0), c1 = pack565(e1);
+    if (c0 < c1) {
+        uint16_t swap = c0;
+        c0 = c1;
+        c1 = swap;
+    }
+
+    int colors[4][3];
+    palette(c0, c1, colors);
+    // With c0 == c1 the block is in three-color mode, where index 3 is black; any texel
+    // maps to index 0 there anyway.
+    int usable = c0 > c1 ? 4 : 3;
+
+    uint32_t indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, best_error = 1 << 30;
+        for (int c = 0; c < usable; c++) {
+            int error = 0;
+            for (int k = 0; k < 3; k++) {
+                int d = texels[3*i + k] - colors[c][k];
+                error += d * d;
+            }
+            if (error < best_error) {
+                best_error = error;
+                best = c;
+            }
+        }
+        indices |= static_cast<uint32_t>(best) << (2 * i);
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (int b = 0; b < 4; b++)
+        out[4 + b] = (indices >> (8 * b)) & 0xff;
+}
+
+
+// Texel (x, y), 0 <= x, y < 4, of one block.
+inline void bc1_decode_texel(const unsigned char block[bc1_block_bytes], int x, int y,
+                             unsigned char rgb[3]) {
+    using namespace bc1_detail;
+
+    uint16_t c0 = static_cast<uint16_t>(block[0] | (block[1] << 8));
+    uint16_t c1 = static_cast<uint16_t>(block[2] | (block[3] << 8));
+    int index = (block[4 + y] >> (2 * x)) & 3;
+
+    // Palette entry `index` as (w0*c0 + w1*c1) / divisor, without branching on the index.
+    static const int weights[2][4][2] = {
+        {{2, 0}, {0, 2}, {1, 1}, {0, 0}},  // c0 <= c1: three colors and black
+        {{3, 0}, {0, 3}, {2, 1}, {1, 2}},  // c0 > c1: four colors
+    };
+    int four = c0 > c1;
+    int w0 = weights[four][index][0], w1 = weights[four][index][1];
+    int divisor = 2 + four;
+
+    int a[3], b[3];
+    unpack565(c0, a);
+    unpack565(c1, b);
+    for (int k = 0; k < 3; k++)
+        rgb[k] = static_cast<unsigned char>((w0*a[k] + w1*b[k]) / divisor);
+}
+
+
+// Compresses a width x height RGB8 image into ceil(width/4) * ceil(height/4) blocks, row by
+// row. Edge blocks repeat the last row and column.
+inline void bc1_encode_image(
+    const unsigned char* rgb, int width, int height, unsigned char* out
+) {
+    int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+    unsigned char texels[16 * 3];
+    for (int by = 0; by < blocks_y; by++) {
+        for (int bx = 0; bx < blocks_x; bx++) {
+            for (int j = 0; j < 4; j++) {
+                int y = by * 4 + j < height ? by * 4 + j : height - 1;
+                for (int i = 0; i < 4; i++) {
+                    int x = bx * 4 + i < width ? bx * 4 + i : width - 1;
+                    memcpy(texels + 3 * (4*j + i),
+                           rgb + 3 * (static_cast<size_t>(y) * width + x), 3);
+                }
+            }
+            auto block = out + (static_cast<size_t>(by) * blocks_x + bx) * bc1_block_bytes;
+            bc1_encode_block(texels, block);
+        }
+    }
+}
+
+
+#endif
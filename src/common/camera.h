@@ -14,6 +14,14 @@
 #include "rtweekend.h"
 
 
+// The cone of directions a ray stands for: its width at the origin and how much wider it gets
+// per unit of distance. Texture lookups use it to pick a filter width.
+struct ray_cone {
+    double width;
+    double spread;
+};
+
+
 class camera {
     public:
         camera() : camera(point3(0,0,-1), point3(0,0,0), vec3(0,1,0), 40, 1, 0, 10) {}
@@ -43,6 +51,7 @@ class camera {
             vertical = focus_dist * viewport_height * v;
             lower_left_corner = origin - horizontal/2 - vertical/2 - focus_dist*w;
 
+            pixel_viewport_height = viewport_height;
             lens_radius = aperture / 2;
             time0 = _time0;
             time1 = _time1;
@@ -58,6 +67,11 @@ class camera {
             );
         }
 
+        // Cone of a primary ray through one of image_height pixel rows. The lens is ignored.
+        ray_cone pixel_cone(int image_height) const {
+            return ray_cone{0, pixel_viewport_height / image_height};
+        }
+
     private:
         point3 origin;
         point3 lower_left_corner;
@@ -65,6 +79,7 @@ class camera {
         vec3 vertical;
         vec3 u, v, w;
         double lens_radius;
+        double pixel_viewport_height;  // viewport height at unit distance
         double time0, time1;  // shutter open/close times
 };
 
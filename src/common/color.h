@@ -41,7 +41,7 @@ bool operator==(pixel& a, pixel& b){
     return a.height == b.height && a.width == b.width;
 }
 
-void write_color(std::list<pixel>* out, color pixel_color, int samples_per_pixel, int height, int width) {
+void write_color(std::list<pixel>* out, color_accum pixel_color, int samples_per_pixel, int height, int width) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -0,0 +1,270 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+//==============================================================================================
+// Edge-avoiding a-trous wavelet denoiser guided by the first-hit AOVs (Dammertz et al. 2010,
+// with the variance-guided luminance weight of SVGF, Schied et al. 2017).
+//
+// The radiance is first divided by the albedo, so texture detail is kept out of the filter and
+// multiplied back in at the end. Each pass then blurs with a 5x5 B3-spline kernel whose taps
+// are 2^pass pixels apart, so four passes cover a 61-pixel footprint for 25 taps per pixel
+// and pass. A tap's weight drops with the angle between the normals, with depth differences
+// beyond what the local depth slope explains, and with luminance differences large compared
+// with the pixel's noise level; taps on a different material get no weight at all. The
+// variance estimate is filtered along with the color, so later passes smooth less.
+//
+// Planes are SoA floats and every pass is split by rows over a pool of threads.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "render_buffers.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+
+class atrous_denoiser {
+    public:
+        atrous_denoiser()
+            : iterations(4), sigma_luminance(4), sigma_normal(128), sigma_depth(1),
+              nthreads(0) {}
+
+        // Denoised radiance of `in`, which must be resolved, as three planes laid out like
+        // the input's.
+        void run(const render_buffers& in, std::vector<float> out[3]) const;
+
+        // How far, in pixels, the filter looks from the pixel it denoises.
+        int radius() const { return 2 * ((1 << iterations) - 1); }
+
+    public:
+        int iterations;
+        float sigma_luminance;  // larger keeps less of the luminance edges
+        float sigma_normal;     // exponent on the normals' cosine
+        float sigma_depth;      // depth tolerance, in units of the local depth slope
+        int nthreads;           // 0: one per online CPU
+
+    private:
+        struct planes {
+            std::vector<float> c[3];
+            std::vector<float> variance;
+        };
+
+        struct pass_job {
+            const atrous_denoiser* self;
+            const render_buffers* in;
+            const std::vector<float>* depth_slope;
+            const planes* src;
+            planes* dst;
+            const std::vector<float>* blurred_variance;
+            int step;
+            std::atomic<int> next_row;
+        };
+
+        static void* pass_thread(void* arg);
+        void filter_row(const pass_job& job, int y) const;
+        void run_pass(pass_job& job) const;
+};
+
+
+// Albedo below this is treated as black: the radiance is filtered as is.
+const float denoise_albedo_floor = 1e-3f;
+
+
+void* atrous_denoiser::pass_thread(void* arg) {
+    auto& job = *static_cast<pass_job*>(arg);
+    int height = job.in->height;
+    while (true) {
+        int y = job.next_row++;
+        if (y >= height)
+            break;
+        job.self->filter_row(job, y);
+    }
+    return NULL;
+}
+
+
+void atrous_denoiser::run_pass(pass_job& job) const {
+    job.next_row = 0;
+    int n = nthreads > 0 ? nthreads : static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    n = std::max(1, std::min(n, job.in->height));
+
+    // The calling thread is one of the workers.
+    std::vector<pthread_t> threads(n);
+    std::vector<char> started(n, 0);
+    for (int i = 1; i < n; i++)
+        started[i] = pthread_create(&threads[i], NULL, pass_thread, &job) == 0;
+    pass_thread(&job);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+
+void atrous_denoiser::filter_row(const pass_job& job, int y) const {
+    static const float kernel[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+    const auto& in = *job.in;
+    const auto& src = *job.src;
+    auto& dst = *job.dst;
+    int width = in.width, height = in.height, step = job.step;
+
+    for (int x = 0; x < width; x++) {
+        size_t p = in.index(x, y);
+        float lp = luminance(src.c[0][p], src.c[1][p], src.c[2][p]);
+        float np[3] = {in.normal[0][p], in.normal[1][p], in.normal[2][p]};
+        float zp = in.depth[p];
+        int mp = in.material[p];
+        float luminance_scale = 1 / (sigma_luminance * std::sqrt((*job.blurred_variance)[p])
+                                     + 1e-6f);
+        float depth_scale = 1 / (sigma_depth * (*job.depth_slope)[p] * step + 1e-6f);
+
+        float sum[3] = {0, 0, 0}, weight_sum = 0, variance_sum = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height)
+                continue;
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= width)
+                    continue;
+                size_t q = in.index(qx, qy);
+                float h = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                float w = h;
+                if (q != p) {
+                    if (in.material[q] != mp)
+                        continue;
+                    float cosine = np[0]*in.normal[0][q] + np[1]*in.normal[1][q]
+                                 + np[2]*in.normal[2][q];
+                    float lq = luminance(src.c[0][q], src.c[1][q], src.c[2][q]);
+                    float distance = std::sqrt(static_cast<float>(dx*dx + dy*dy));
+                    w *= std::pow(std::max(cosine, 0.0f), sigma_normal)
+                       * std::exp(-std::fabs(zp - in.depth[q]) * depth_scale / distance
+                                  - std::fabs(lp - lq) * luminance_scale);
+                }
+                for (int k = 0; k < 3; k++)
+                    sum[k] += w * src.c[k][q];
+                weight_sum += w;
+                variance_sum += w * w * src.variance[q];
+            }
+        }
+
+        // The center tap always counts, so weight_sum > 0.
+        for (int k = 0; k < 3; k++)
+            dst.c[k][p] = sum[k] / weight_sum;
+        dst.variance[p] = variance_sum / (weight_sum * weight_sum);
+    }
+}
+
+
+void atrous_denoiser::run(const render_buffers& in, std::vector<float> out[3]) const {
+    int width = in.width, height = in.height;
+    size_t n = static_cast<size_t>(width) * height;
+
+    // Demodulate: filter radiance / albedo, with the variance scaled to match.
+    planes a, b;
+    for (int k = 0; k < 3; k++) {
+        a.c[k].resize(n);
+        b.c[k].resize(n);
+    }
+    a.variance.resize(n);
+    b.variance.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        for (int k = 0; k < 3; k++) {
+            float albedo = in.albedo[k][i];
+            a.c[k][i] = albedo > denoise_albedo_floor ? in.radiance[k][i] / albedo
+                                                     : in.radiance[k][i];
+        }
+        float albedo_luminance = luminance(in.albedo[0][i], in.albedo[1][i], in.albedo[2][i]);
+        float scale = albedo_luminance > denoise_albedo_floor ? 1 / albedo_luminance : 1;
+        a.variance[i] = in.variance[i] * scale * scale;
+    }
+
+    // A single sample says nothing about the variance; use the spread over the 3x3
+    // neighbourhood instead.
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t p = in.index(x, y);
+            if (in.samples[p] > 1)
+                continue;
+            float mean = 0, square = 0;
+            int count = 0;
+            for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); qy++)
+                for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); qx++) {
+                    size_t q = in.index(qx, qy);
+                    float l = luminance(a.c[0][q], a.c[1][q], a.c[2][q]);
+                    mean += l;
+                    square += l * l;
+                    count++;
+                }
+            mean /= count;
+            a.variance[p] = std::max(0.0f, square / count - mean * mean);
+        }
+    }
+
+    // Screen-space depth slope, for the depth weight's tolerance.
+    std::vector<float> depth_slope(n);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t p = in.index(x, y);
+            float z = in.depth[p];
+            float gx = std::fabs(in.depth[in.index(std::min(x + 1, width - 1), y)] - z);
+            float gy = std::fabs(in.depth[in.index(x, std::min(y + 1, height - 1))] - z);
+            depth_slope[p] = std::max(gx, gy);
+        }
+    }
+
+    pass_job job;
+    job.self = this;
+    job.in = &in;
+    job.depth_slope = &depth_slope;
+    std::vector<float> blurred_variance(n);
+    planes* src = &a;
+    planes* dst = &b;
+    for (int pass = 0; pass < iterations; pass++) {
+        // 3x3 Gaussian of the variance, which is itself noisy.
+        static const float gauss[2] = {1.0f / 2, 1.0f / 4};
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                float sum = 0, weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    int qy = y + dy;
+                    if (qy < 0 || qy >= height)
+                        continue;
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = x + dx;
+                        if (qx < 0 || qx >= width)
+                            continue;
+                        float w = gauss[std::abs(dx)] * gauss[std::abs(dy)];
+                        sum += w * src->variance[in.index(qx, qy)];
+                        weight += w;
+                    }
+                }
+                blurred_variance[in.index(x, y)] = sum / weight;
+            }
+        }
+
+        job.src = src;
+        job.dst = dst;
+        job.blurred_variance = &blurred_variance;
+        job.step = 1 << pass;
+        run_pass(job);
+        std::swap(src, dst);
+    }
+
+    // Remodulate.
+    for (int k = 0; k < 3; k++) {
+        out[k].resize(n);
+        for (size_t i = 0; i < n; i++) {
+            float albedo = in.albedo[k][i];
+            out[k][i] = albedo > denoise_albedo_floor ? src->c[k][i] * albedo : src->c[k][i];
+        }
+    }
+}
+
+
+#endif
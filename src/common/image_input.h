@@ -0,0 +1,215 @@
+#ifndef IMAGE_INPUT_H
+#define IMAGE_INPUT_H
+//==============================================================================================
+// Reads a finished image back into float RGB planes laid out like render_buffers (rows from
+// the bottom up), so a partial re-render can be pasted into it.
+//
+// PFM and uncompressed float OpenEXR (as image_output.h writes them) come back exactly. 8-bit
+// files (ASCII and binary PPM, PNG, and whatever else stb_image reads) are turned back into
+// linear values by inverting the gamma-2 or sRGB encoding, at the middle of each step, so
+// writing them again gives the same bytes.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "image_output.h"
+#include "rtw_stb_image.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+namespace image_detail {
+    inline float to_linear(int byte, bool srgb) {
+        double v = (byte + 0.5) / 256;
+        if (srgb)
+            v = v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+        else
+            v = v * v;
+        return static_cast<float>(v);
+    }
+
+    inline void resize_planes(std::vector<float>* planes, int width, int height) {
+        for (int k = 0; k < 3; k++)
+            planes[k].assign(static_cast<size_t>(width) * height, 0.0f);
+    }
+
+    inline bool read_file(const std::string& path, std::string& data) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f)
+            return false;
+        char buffer[1 << 16];
+        size_t n;
+        data.clear();
+        while ((n = fread(buffer, 1, sizeof buffer, f)) > 0)
+            data.append(buffer, n);
+        return fclose(f) == 0;
+    }
+
+    inline uint32_t get32(const std::string& data, size_t pos) {
+        uint32_t v = 0;
+        for (int i = 3; i >= 0; i--)
+            v = (v << 8) | static_cast<unsigned char>(data[pos + i]);
+        return v;
+    }
+
+    inline bool read_pfm(const std::string& data, int& width, int& height,
+                         std::vector<float>* planes) {
+        char magic[3];
+        float scale;
+        int consumed = 0;
+        if (sscanf(data.c_str(), "%2s %d %d %f%n", magic, &width, &height, &scale, &consumed)
+                != 4 || strcmp(magic, "PF") != 0 || scale >= 0 || width <= 0 || height <= 0)
+            return false;
+        size_t start = consumed + 1;     // a single whitespace byte ends the header
+        size_t n = static_cast<size_t>(width) * height;
+        if (data.size() < start + 12 * n)
+            return false;
+        resize_planes(planes, width, height);
+        const char* p = data.data() + start;
+        for (size_t i = 0; i < n; i++)
+            for (int k = 0; k < 3; k++, p += 4)
+                memcpy(&planes[k][i], p, 4);
+        return true;
+    }
+
+    // Scanline files with FLOAT R, G and B channels and no compression.
+    inline bool read_exr(const std::string& data, int& width, int& height,
+                         std::vector<float>* planes) {
+        if (data.size() < 8 || get32(data, 0) != 20000630 || (get32(data, 4) & 0xff) != 2
+            || (get32(data, 4) & 0x200))             // tiled
+            return false;
+        std::vector<std::string> channels;
+        int compression = -1;
+        int32_t box[4] = {0, 0, -1, -1};
+        size_t pos = 8;
+        while (pos < data.size() && data[pos] != 0) {
+            std::string name = data.c_str() + pos;
+            pos += name.size() + 1;
+            std::string type = data.c_str() + pos;
+            pos += type.size() + 1;
+            if (pos + 4 > data.size())
+                return false;
+            size_t size = get32(data, pos), value = pos + 4;
+            pos = value + size;
+            if (pos > data.size())
+                return false;
+            if (name == "channels") {
+                // Names, then type, pLinear, reserved and sampling: 16 bytes each.
+                while (value < pos && data[value] != 0) {
+                    std::string channel = data.c_str() + value;
+                    value += channel.size() + 1;
+                    if (get32(data, value) != 2)    // FLOAT
+                        return false;
+                    channels.push_back(channel);
+                    value += 16;
+                }
+            } else if (name == "compression") {
+                compression = static_cast<unsigned char>(data[value]);
+            } else if (name == "dataWindow") {
+                for (int i = 0; i < 4; i++)
+                    box[i] = static_cast<int32_t>(get32(data, value + 4 * i));
+            }
+        }
+        width = box[2] - box[0] + 1;
+        height = box[3] - box[1] + 1;
+        int rgb[3] = {-1, -1, -1};
+        for (size_t c = 0; c < channels.size(); c++) {
+            if (channels[c] == "R") rgb[0] = static_cast<int>(c);
+            if (channels[c] == "G") rgb[1] = static_cast<int>(c);
+            if (channels[c] == "B") rgb[2] = static_cast<int>(c);
+        }
+        if (compression != 0 || width <= 0 || height <= 0 || rgb[0] < 0 || rgb[1] < 0
+            || rgb[2] < 0)
+            return false;
+
+        // Line blocks hold the channels one after the other, in the order listed.
+        size_t table = pos + 1, line_size = 4 * channels.size() * width;
+        if (table + 8 * static_cast<size_t>(height) > data.size())
+            return false;
+        resize_planes(planes, width, height);
+        for (int line = 0; line < height; line++) {
+            uint64_t offset = get32(data, table + 8 * line)
+                            | static_cast<uint64_t>(get32(data, table + 8 * line + 4)) << 32;
+            if (offset + 8 + line_size > data.size())
+                return false;
+            int top = static_cast<int32_t>(get32(data, offset)) - box[1];
+            if (top < 0 || top >= height || get32(data, offset + 4) != line_size)
+                return false;
+            size_t row = static_cast<size_t>(height - 1 - top) * width;
+            for (int k = 0; k < 3; k++) {
+                const char* p = data.data() + offset + 8 + 4 * rgb[k] * width;
+                memcpy(&planes[k][row], p, 4 * width);
+            }
+        }
+        return true;
+    }
+
+    // P3, which stb_image does not read.
+    inline bool read_p3(const std::string& data, int& width, int& height, bool srgb,
+                        std::vector<float>* planes) {
+        const char* p = data.c_str() + 2;
+        char* end;
+        long header[3];
+        for (int i = 0; i < 3; i++, p = end) {
+            header[i] = strtol(p, &end, 10);
+            if (end == p)
+                return false;
+        }
+        width = static_cast<int>(header[0]);
+        height = static_cast<int>(header[1]);
+        if (width <= 0 || height <= 0 || header[2] != 255)
+            return false;
+        resize_planes(planes, width, height);
+        for (int y = height - 1; y >= 0; y--)
+            for (int x = 0; x < width; x++)
+                for (int k = 0; k < 3; k++, p = end) {
+                    long v = strtol(p, &end, 10);
+                    if (end == p || v < 0 || v > 255)
+                        return false;
+                    planes[k][static_cast<size_t>(y) * width + x] = to_linear(v, srgb);
+                }
+        return true;
+    }
+}
+
+
+// Reads the image at `path` into `planes`, sized width x height. `srgb` says how 8-bit
+// files were encoded. Returns false if the file cannot be read or is in no known format.
+inline bool read_image(const std::string& path, int& width, int& height,
+                       std::vector<float>* planes, bool srgb = false) {
+    using namespace image_detail;
+
+    std::string data;
+    if (!read_file(path, data) || data.size() < 8)
+        return false;
+    if (data.compare(0, 2, "PF") == 0)
+        return read_pfm(data, width, height, planes);
+    if (get32(data, 0) == 20000630)
+        return read_exr(data, width, height, planes);
+    if (data.compare(0, 2, "P3") == 0)
+        return read_p3(data, width, height, srgb, planes);
+
+    int channels;
+    unsigned char* pixels = stbi_load_from_memory(
+        reinterpret_cast<const unsigned char*>(data.data()), static_cast<int>(data.size()),
+        &width, &height, &channels, 3);
+    if (!pixels)
+        return false;
+    resize_planes(planes, width, height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int k = 0; k < 3; k++)
+                planes[k][static_cast<size_t>(height - 1 - y) * width + x]
+                    = to_linear(pixels[3 * (static_cast<size_t>(y) * width + x) + k], srgb);
+    stbi_image_free(pixels);
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,600 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+//==============================================================================================
+// Image files written straight from float RGB planes (one plane per channel, rows from the
+// bottom up, as render_buffers keeps them).
+//
+//   p3   ASCII PPM, the renderer's original output
+//   ppm  binary PPM (P6)
+//   png  8-bit RGB PNG; rows are filtered and deflated in strips on several threads
+//   pfm  float RGB, linear
+//   exr  OpenEXR scanline file with 32-bit float B, G, R channels, uncompressed, linear
+//
+// The 8-bit formats are encoded with gamma 2, like write_color(), or with the sRGB curve.
+// Whole images are written through a temporary file renamed over the target, so readers
+// never see a partial file; "-" writes to stdout instead.
+//
+// image_stream writes a ppm, pfm or exr file in place, a row or part of a row at a time, so a
+// render can flush what it has finished while it goes on, and never needs the whole image in
+// memory. Those three formats have no compression, so every pixel has a fixed place in the
+// file.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The bundled stb_image_write provides the deflate compressor and the CRC for PNG.
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "external/stb_image_write.h"
+
+
+enum class image_format { p3, ppm, png, pfm, exr };
+
+
+struct image_options {
+    bool srgb = false;      // 8-bit formats: sRGB curve instead of gamma 2
+    int nthreads = 0;       // PNG encoding; 0: one per online CPU
+};
+
+
+// Parses a format name as used on the command line. Returns false if unknown.
+inline bool parse_image_format(const std::string& name, image_format& format) {
+    static const char* names[] = {"p3", "ppm", "png", "pfm", "exr"};
+    for (int i = 0; i < 5; i++) {
+        if (name == names[i]) {
+            format = static_cast<image_format>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Format named by the file's extension, or binary PPM if there is none it knows.
+inline image_format image_format_for(const std::string& path) {
+    size_t dot = path.rfind('.');
+    image_format format;
+    if (dot == std::string::npos || !parse_image_format(path.substr(dot + 1), format))
+        return image_format::ppm;
+    return format;
+}
+
+
+namespace image_detail {
+    inline unsigned char to_byte(float linear, bool srgb) {
+        double v = linear == linear && linear > 0 ? linear : 0.0;
+        if (srgb)
+            v = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1 / 2.4) - 0.055;
+        else
+            v = sqrt(v);
+        return static_cast<unsigned char>(256 * clamp(v, 0.0, 0.999));
+    }
+
+    // Row y (counted from the top) as 8-bit RGB.
+    inline void row_bytes(const std::vector<float>* planes, int width, int height, int y,
+                          bool srgb, unsigned char* out) {
+        size_t base = static_cast<size_t>(height - 1 - y) * width;
+        for (int x = 0; x < width; x++)
+            for (int k = 0; k < 3; k++)
+                out[3*x + k] = to_byte(planes[k][base + x], srgb);
+    }
+
+    inline void put32(std::string& out, uint32_t v) {
+        for (int i = 0; i < 4; i++)
+            out += static_cast<char>(v >> (8 * i));
+    }
+
+    inline void put32_be(std::string& out, uint32_t v) {
+        for (int i = 3; i >= 0; i--)
+            out += static_cast<char>(v >> (8 * i));
+    }
+
+    inline void putf(std::string& out, float v) {
+        uint32_t bits;
+        memcpy(&bits, &v, 4);
+        put32(out, bits);
+    }
+
+    inline void attribute(std::string& out, const char* name, const char* type, uint32_t size) {
+        out.append(name, strlen(name) + 1);
+        out.append(type, strlen(type) + 1);
+        put32(out, size);
+    }
+
+    // Header and line-offset table of an uncompressed float EXR. Line blocks follow, each
+    // 8 + 12 * width bytes: y, byte count, then the row's B, G and R values.
+    inline std::string exr_header(int width, int height) {
+        std::string h;
+        put32(h, 20000630);     // magic
+        put32(h, 2);            // version 2, single-part scanline
+
+        attribute(h, "channels", "chlist", 3 * 18 + 1);
+        const char* channels[3] = {"B", "G", "R"};
+        for (int c = 0; c < 3; c++) {
+            h.append(channels[c], 2);
+            put32(h, 2);        // FLOAT
+            put32(h, 0);        // pLinear and reserved
+            put32(h, 1);        // x and y sampling
+            put32(h, 1);
+        }
+        h += '\0';
+        attribute(h, "compression", "compression", 1);
+        h += '\0';              // NO_COMPRESSION
+        for (auto name : {"dataWindow", "displayWindow"}) {
+            attribute(h, name, "box2i", 16);
+            put32(h, 0);
+            put32(h, 0);
+            put32(h, width - 1);
+            put32(h, height - 1);
+        }
+        attribute(h, "lineOrder", "lineOrder", 1);
+        h += '\0';              // INCREASING_Y
+        attribute(h, "pixelAspectRatio", "float", 4);
+        putf(h, 1);
+        attribute(h, "screenWindowCenter", "v2f", 8);
+        putf(h, 0);
+        putf(h, 0);
+        attribute(h, "screenWindowWidth", "float", 4);
+        putf(h, 1);
+        h += '\0';
+
+        uint64_t block = 8 + 12 * static_cast<uint64_t>(width);
+        uint64_t first = h.size() + 8 * static_cast<uint64_t>(height);
+        for (int y = 0; y < height; y++) {
+            put32(h, static_cast<uint32_t>(first + y * block));
+            put32(h, static_cast<uint32_t>((first + y * block) >> 32));
+        }
+        return h;
+    }
+
+    // EXR line block for row y (counted from the top).
+    inline void exr_line(const float* rgb, int width, int y, std::string& out) {
+        out.clear();
+        put32(out, y);
+        put32(out, 12 * width);
+        for (int c = 2; c >= 0; c--)
+            for (int x = 0; x < width; x++)
+                putf(out, rgb[3*x + c]);
+    }
+
+    inline std::string header_of(image_format format, int width, int height) {
+        char text[64];
+        switch (format) {
+            case image_format::p3:
+                snprintf(text, sizeof text, "P3\n%d %d\n255\n", width, height);
+                return text;
+            case image_format::ppm:
+                snprintf(text, sizeof text, "P6\n%d %d\n255\n", width, height);
+                return text;
+            case image_format::pfm:
+                snprintf(text, sizeof text, "PF\n%d %d\n-1.0\n", width, height);
+                return text;
+            case image_format::exr:
+                return exr_header(width, height);
+            default:
+                return "";
+        }
+    }
+
+
+    // PNG --------------------------------------------------------------------------------
+
+    inline int paeth(int a, int b, int c) {
+        int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+
+    // Filters one row against the row above (zeros for the first), picking the filter with
+    // the smallest sum of absolute residuals. `out` gets the filter byte and the row.
+    inline void filter_row(const unsigned char* row, const unsigned char* above, int bytes,
+                           unsigned char* out, std::vector<unsigned char>& scratch) {
+        scratch.resize(bytes);
+        long best_sum = -1;
+        for (int type = 0; type < 5; type++) {
+            long sum = 0;
+            for (int i = 0; i < bytes; i++) {
+                int a = i >= 3 ? row[i - 3] : 0, b = above[i], c = i >= 3 ? above[i - 3] : 0;
+                int predicted = type == 0 ? 0 : type == 1 ? a : type == 2 ? b
+                              : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+                scratch[i] = static_cast<unsigned char>(row[i] - predicted);
+                sum += abs(static_cast<signed char>(scratch[i]));
+            }
+            if (best_sum < 0 || sum < best_sum) {
+                best_sum = sum;
+                out[0] = static_cast<unsigned char>(type);
+                memcpy(out + 1, scratch.data(), bytes);
+            }
+        }
+    }
+
+    // stbi_zlib_compress() writes a single fixed-Huffman block. This walks its codes to find
+    // where the block ends, in bits from the start of the deflate data, so blocks compressed
+    // separately can be joined into one stream. Returns 0 if the data is not such a block.
+    inline size_t fixed_block_bits(const unsigned char* data, size_t size) {
+        static const int length_extra[29] = {
+            0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        static const int distance_extra[30] = {
+            0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+        size_t limit = size * 8, pos = 3;
+        auto bit = [&]() {
+            int b = pos < limit ? (data[pos >> 3] >> (pos & 7)) & 1 : 0;
+            pos++;
+            return b;
+        };
+        // Huffman codes are packed from their most significant bit, extra bits from the least.
+        auto code = [&](int n, int value) {
+            while (n--)
+                value = (value << 1) | bit();
+            return value;
+        };
+        auto skip = [&](int n) { pos += n; };
+
+        if (size == 0 || (data[0] & 7) != 3)    // BFINAL=1, BTYPE=01
+            return 0;
+        while (pos < limit) {
+            int c = code(7, 0), symbol;
+            if (c <= 0x17) {
+                symbol = 256 + c;
+            } else {
+                c = code(1, c);
+                if (c >= 0x30 && c <= 0xbf)
+                    symbol = c - 0x30;
+                else if (c >= 0xc0 && c <= 0xc7)
+                    symbol = 280 + c - 0xc0;
+                else
+                    symbol = 144 + code(1, c) - 0x190;
+            }
+            if (symbol == 256)
+                return pos <= limit ? pos : 0;
+            if (symbol > 256) {
+                if (symbol > 285)
+                    return 0;
+                skip(length_extra[symbol - 257]);
+                int d = code(5, 0);
+                if (d > 29)
+                    return 0;
+                skip(distance_extra[d]);
+            }
+        }
+        return 0;
+    }
+
+    struct bit_writer {
+        std::string out;
+        uint32_t buffer = 0;
+        int count = 0;
+
+        void put(uint32_t bits, int n) {
+            buffer |= bits << count;
+            count += n;
+            while (count >= 8) {
+                out += static_cast<char>(buffer & 0xff);
+                buffer >>= 8;
+                count -= 8;
+            }
+        }
+        void flush() {
+            if (count > 0)
+                put(0, 8 - count);
+        }
+    };
+
+    struct png_strip {
+        int y0, y1;
+        unsigned char* deflated;
+        int deflated_size;
+    };
+
+    struct png_job {
+        const std::vector<float>* planes;
+        int width, height;
+        bool srgb;
+        std::vector<unsigned char>* filtered;
+        std::vector<png_strip>* strips;
+        std::atomic<int> next;
+    };
+
+    // Filters and compresses strips until none are left.
+    inline void* png_thread(void* arg) {
+        auto& job = *static_cast<png_job*>(arg);
+        int bytes = 3 * job.width;
+        size_t stride = bytes + 1;
+        std::vector<unsigned char> row(bytes), above(bytes), scratch;
+        while (true) {
+            int s = job.next++;
+            if (s >= static_cast<int>(job.strips->size()))
+                break;
+            auto& strip = (*job.strips)[s];
+            if (strip.y0 > 0)
+                row_bytes(job.planes, job.width, job.height, strip.y0 - 1, job.srgb, &above[0]);
+            else
+                std::fill(above.begin(), above.end(), 0);
+            unsigned char* out = &(*job.filtered)[strip.y0 * stride];
+            for (int y = strip.y0; y < strip.y1; y++) {
+                row_bytes(job.planes, job.width, job.height, y, job.srgb, &row[0]);
+                filter_row(row.data(), above.data(), bytes, out + (y - strip.y0) * stride,
+                           scratch);
+                row.swap(above);
+            }
+            strip.deflated = stbi_zlib_compress(out, static_cast<int>((strip.y1 - strip.y0)
+                                                                      * stride),
+                                                &strip.deflated_size, 8);
+        }
+        return NULL;
+    }
+
+    inline uint32_t adler32(const unsigned char* data, size_t size) {
+        uint32_t a = 1, b = 0;
+        while (size > 0) {
+            size_t n = size < 5552 ? size : 5552;
+            for (size_t i = 0; i < n; i++) {
+                a += data[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            data += n;
+            size -= n;
+        }
+        return (b << 16) | a;
+    }
+
+    inline void png_chunk(std::string& out, const char* tag, const std::string& data) {
+        put32_be(out, static_cast<uint32_t>(data.size()));
+        std::string body = tag + data;
+        out += body;
+        put32_be(out, stbiw__crc32((unsigned char*)&body[0], static_cast<int>(body.size())));
+    }
+
+    // The whole PNG file, or an empty string if compression failed.
+    inline std::string encode_png(const std::vector<float>* planes, int width, int height,
+                                  const image_options& options) {
+        const int strip_rows = 32;
+        size_t stride = 3 * static_cast<size_t>(width) + 1;
+        std::vector<unsigned char> filtered(stride * height);
+        std::vector<png_strip> strips;
+        for (int y = 0; y < height; y += strip_rows)
+            strips.push_back(png_strip{y, std::min(y + strip_rows, height), NULL, 0});
+
+        png_job job;
+        job.planes = planes;
+        job.width = width;
+        job.height = height;
+        job.srgb = options.srgb;
+        job.filtered = &filtered;
+        job.strips = &strips;
+        job.next = 0;
+        int n = options.nthreads > 0 ? options.nthreads
+                                     : static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+        n = std::max(1, std::min(n, static_cast<int>(strips.size())));
+        // The calling thread is one of the workers.
+        std::vector<pthread_t> threads(n);
+        std::vector<char> started(n, 0);
+        for (int i = 1; i < n; i++)
+            started[i] = pthread_create(&threads[i], NULL, png_thread, &job) == 0;
+        png_thread(&job);
+        for (int i = 1; i < n; i++) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+        }
+
+        // Join the strips' blocks into one zlib stream: a zlib header, every block but the
+        // last with its BFINAL bit cleared, and the checksum of all the filtered rows.
+        bit_writer bits;
+        bits.out = "\x78\x5e";
+        bool ok = true;
+        for (size_t s = 0; s < strips.size(); s++) {
+            const unsigned char* deflate = strips[s].deflated + 2;
+            size_t size = strips[s].deflated ? strips[s].deflated_size - 6 : 0;
+            size_t length = size ? fixed_block_bits(deflate, size) : 0;
+            ok = ok && length > 0;
+            for (size_t i = 0; ok && i < length; i += 8) {
+                int n = static_cast<int>(std::min<size_t>(8, length - i));
+                uint32_t byte = deflate[i / 8] & ((1u << n) - 1);
+                if (i == 0 && s + 1 < strips.size())
+                    byte &= ~1u;
+                bits.put(byte, n);
+            }
+            STBIW_FREE(strips[s].deflated);
+        }
+        if (!ok)
+            return "";
+        bits.flush();
+        put32_be(bits.out, adler32(filtered.data(), filtered.size()));
+
+        std::string ihdr;
+        put32_be(ihdr, width);
+        put32_be(ihdr, height);
+        ihdr += std::string("\x08\x02\x00\x00\x00", 5);   // 8-bit RGB, no interlace
+        std::string png("\x89PNG\r\n\x1a\n", 8);
+        png_chunk(png, "IHDR", ihdr);
+        png_chunk(png, "IDAT", bits.out);
+        png_chunk(png, "IEND", "");
+        return png;
+    }
+}
+
+
+// Writes the planes to `path` ("-" for stdout) in `format`. Returns false if the file
+// cannot be written.
+inline bool write_image(const std::string& path, image_format format, int width, int height,
+                        const std::vector<float>* planes,
+                        const image_options& options = image_options()) {
+    using namespace image_detail;
+
+    bool to_stdout = path == "-";
+    std::string tmp = path + ".tmp";
+    FILE* f = to_stdout ? stdout : fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+
+    bool ok = true;
+    if (format == image_format::png) {
+        std::string png = encode_png(planes, width, height, options);
+        ok = !png.empty() && fwrite(png.data(), 1, png.size(), f) == png.size();
+    } else {
+        std::string header = header_of(format, width, height);
+        ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+        std::vector<unsigned char> bytes(3 * width);
+        std::vector<float> rgb(3 * width);
+        std::string text;
+        // PFM stores the bottom row first, the others the top row.
+        for (int i = 0; ok && i < height; i++) {
+            int y = format == image_format::pfm ? height - 1 - i : i;
+            size_t base = static_cast<size_t>(height - 1 - y) * width;
+            if (format == image_format::p3 || format == image_format::ppm) {
+                row_bytes(planes, width, height, y, options.srgb, &bytes[0]);
+                if (format == image_format::ppm) {
+                    ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+                    continue;
+                }
+                text.clear();
+                char pixel[16];
+                for (int x = 0; x < width; x++) {
+                    snprintf(pixel, sizeof pixel, "%d %d %d\n", bytes[3*x], bytes[3*x + 1],
+                             bytes[3*x + 2]);
+                    text += pixel;
+                }
+                ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+                continue;
+            }
+            for (int x = 0; x < width; x++)
+                for (int k = 0; k < 3; k++)
+                    rgb[3*x + k] = planes[k][base + x];
+            if (format == image_format::pfm) {
+                ok = fwrite(rgb.data(), sizeof(float), rgb.size(), f) == rgb.size();
+            } else {
+                exr_line(rgb.data(), width, y, text);
+                ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+            }
+        }
+    }
+
+    if (to_stdout)
+        return fflush(f) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+class image_stream {
+    public:
+        image_stream() : fd(-1) {}
+        ~image_stream() { close(); }
+
+        image_stream(const image_stream&) = delete;
+        image_stream& operator=(const image_stream&) = delete;
+
+        // Creates `path` at its full size, rows zeroed. `format` must be ppm, pfm or exr.
+        // Returns false if it is not, or if the file cannot be created.
+        bool open(const std::string& path, image_format format, int image_width,
+                  int image_height, const image_options& options = image_options());
+
+        // Writes row y (counted from the bottom) from width linear RGB triples. Rows can be
+        // written from several threads at once.
+        bool write_row(int y, const float* rgb) const { return write_span(y, 0, width, rgb); }
+
+        // Writes `count` pixels of row y from column x0 on, so tiles can go straight to
+        // their place in the file. Spans that do not overlap can be written concurrently.
+        bool write_span(int y, int x0, int count, const float* rgb) const;
+
+        void close() {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+
+    private:
+        int fd;
+        image_format format;
+        int width, height;
+        bool srgb;
+        size_t header_size, row_size;
+};
+
+
+bool image_stream::open(const std::string& path, image_format image_format_, int image_width,
+                        int image_height, const image_options& options) {
+    close();
+    format = image_format_;
+    if (format != image_format::ppm && format != image_format::pfm
+        && format != image_format::exr)
+        return false;
+    width = image_width;
+    height = image_height;
+    srgb = options.srgb;
+
+    std::string header = image_detail::header_of(format, width, height);
+    header_size = header.size();
+    row_size = format == image_format::ppm ? 3 * static_cast<size_t>(width)
+             : format == image_format::pfm ? 12 * static_cast<size_t>(width)
+             : 8 + 12 * static_cast<size_t>(width);
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = pwrite(fd, header.data(), header.size(), 0) == (ssize_t)header.size()
+           && ftruncate(fd, header_size + row_size * height) == 0;
+    // EXR line blocks start with their row number and size, so fill those in now: the file
+    // is valid, if black, from the start. The zeroed rest is left sparse.
+    for (int y = 0; ok && format == image_format::exr && y < height; y++) {
+        std::string line;
+        image_detail::put32(line, y);
+        image_detail::put32(line, 12 * width);
+        ok = pwrite(fd, line.data(), line.size(), header_size + row_size * y) == 8;
+    }
+    if (!ok)
+        close();
+    return ok;
+}
+
+
+bool image_stream::write_span(int y, int x0, int count, const float* rgb) const {
+    if (fd < 0 || y < 0 || y >= height || x0 < 0 || count < 0 || x0 + count > width)
+        return false;
+    int top = height - 1 - y;
+    off_t row = header_size + row_size * (format == image_format::pfm ? y : top);
+    if (format == image_format::ppm) {
+        std::vector<unsigned char> bytes(3 * count);
+        for (int i = 0; i < 3 * count; i++)
+            bytes[i] = image_detail::to_byte(rgb[i], srgb);
+        return pwrite(fd, bytes.data(), bytes.size(), row + 3 * x0) == (ssize_t)bytes.size();
+    }
+    if (format == image_format::pfm) {
+        ssize_t size = 12 * static_cast<ssize_t>(count);
+        return pwrite(fd, rgb, size, row + 12 * x0) == size;
+    }
+    // EXR: the line header, then the row's B, G and R runs.
+    std::vector<float> run(count);
+    for (int c = 0; c < 3; c++) {
+        for (int x = 0; x < count; x++)
+            run[x] = rgb[3*x + 2 - c];
+        ssize_t size = 4 * static_cast<ssize_t>(count);
+        if (pwrite(fd, run.data(), size, row + 8 + 4 * (static_cast<off_t>(c) * width + x0))
+            != size)
+            return false;
+    }
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef MIP_TEXTURE_H
+#define MIP_TEXTURE_H
+//==============================================================================================
+// A mipmapped view of an image_texture with bilinear and trilinear filtering.
+//
+// Level 0 is the decoded image itself, read in place. Each coarser level is split into
+// tile_size x tile_size tiles of float RGB, built the first time a lookup touches them: a
+// texel is the average of the 2x2 texels under it in the next finer level, whose tiles are
+// built as needed in turn. Only the tiles under the parts of the pyramid a render actually
+// sees are ever resident. Lookups from several threads may race to build the same tile; one
+// copy wins and the others are dropped.
+//
+// filtered_value() picks the level from the footprint width in (u,v): zero gives a bilinear
+// lookup in the full-resolution level, wider footprints blend the two nearest levels.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "texture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+
+class mip_texture : public texture {
+    public:
+        // 16x16 float RGB texels: 3 KB, so a bilinear footprint usually stays in one tile
+        // and a tile row spans three cache lines.
+        static const int tile_size = 16;
+
+        mip_texture(shared_ptr<image_texture> source) : image(source), resident(0) {
+            build_levels();
+        }
+
+        mip_texture(const mip_texture&) = delete;
+        mip_texture& operator=(const mip_texture&) = delete;
+
+        ~mip_texture() {
+            free_levels();
+        }
+
+        // Lays out empty levels for the source's current image. Must not run concurrently
+        // with lookups; texture_manager calls it once the source has been decoded.
+        void build_levels();
+
+        virtual color value(double u, double v, const vec3& p) const override {
+            return filtered_value(u, v, p, 0);
+        }
+
+        virtual color filtered_value(double u, double v, const vec3& p, double width) const
+            override;
+
+        int level_count() const { return static_cast<int>(levels.size()); }
+
+        // Bytes of tiles built so far, and what all levels past the first would take.
+        size_t resident_bytes() const { return resident; }
+        size_t full_bytes() const;
+
+    private:
+        struct level {
+            int width, height;
+            int tiles_x, tiles_y;
+            std::atomic<float*>* tiles;     // none for level 0
+        };
+
+        static const int tile_floats = tile_size * tile_size * 3;
+
+        void texel(int l, int x, int y, float rgb[3]) const;
+        const float* build_tile(int l, int tx, int ty) const;
+        color bilinear(int l, double u, double v) const;
+        void free_levels();
+
+        shared_ptr<image_texture> image;
+        std::vector<level> levels;
+        mutable std::atomic<size_t> resident;
+};
+
+
+void mip_texture::build_levels() {
+    free_levels();
+    int width = image->image_width(), height = image->image_height();
+    if (width <= 0 || height <= 0)
+        return;
+
+    while (true) {
+        level l;
+        l.width = width;
+        l.height = height;
+        l.tiles_x = levels.empty() ? 0 : (width + tile_size - 1) / tile_size;
+        l.tiles_y = levels.empty() ? 0 : (height + tile_size - 1) / tile_size;
+        l.tiles = l.tiles_x ? new std::atomic<float*>[l.tiles_x * l.tiles_y] : nullptr;
+        for (int i = 0; i < l.tiles_x * l.tiles_y; i++)
+            l.tiles[i] = nullptr;
+        levels.push_back(l);
+        if (width == 1 && height == 1)
+            break;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+}
+
+
+void mip_texture::free_levels() {
+    for (auto& l : levels) {
+        for (int i = 0; i < l.tiles_x * l.tiles_y; i++)
+            delete[] l.tiles[i].load();
+        delete[] l.tiles;
+    }
+    levels.clear();
+    resident = 0;
+}
+
+
+size_t mip_texture::full_bytes() const {
+    size_t total = 0;
+    for (const auto& l : levels)
+        total += static_cast<size_t>(l.tiles_x) * l.tiles_y * tile_floats * sizeof(float);
+    return total;
+}
+
+
+// RGB of texel (x, y) of level l, with coordinates clamped to the level.
+inline void mip_texture::texel(int l, int x, int y, float rgb[3]) const {
+    const auto& lv = levels[l];
+    x = x < 0 ? 0 : (x >= lv.width ? lv.width - 1 : x);
+    y = y < 0 ? 0 : (y >= lv.height ? lv.height - 1 : y);
+
+    if (l == 0) {
+        unsigned char pixel[3];
+        image->read_texel(x, y, pixel);
+        for (int c = 0; c < 3; c++)
+            rgb[c] = pixel[c] * (1.0f / 255.0f);
+        return;
+    }
+
+    int tx = x / tile_size, ty = y / tile_size;
+    const float* tile = lv.tiles[ty * lv.tiles_x + tx].load(std::memory_order_acquire);
+    if (!tile)
+        tile = build_tile(l, tx, ty);
+    const float* t = tile + ((y % tile_size) * tile_size + x % tile_size) * 3;
+    rgb[0] = t[0];
+    rgb[1] = t[1];
+    rgb[2] = t[2];
+}
+
+
+const float* mip_texture::build_tile(int l, int tx, int ty) const {
+    float* tile = new float[tile_floats]();
+    // Texels past the level's edge are never read: texel() clamps to the last one. The unary
+    // + passes tile_size by value, since it has no out-of-class definition to refer to.
+    int columns = std::min(+tile_size, levels[l].width - tx * tile_size);
+    int rows = std::min(+tile_size, levels[l].height - ty * tile_size);
+
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < columns; i++) {
+            // A finer level of odd size loses its last row or column, as the box filter
+            // over the source did.
+            int x = 2 * (tx * tile_size + i), y = 2 * (ty * tile_size + j);
+            float a[3], b[3], c[3], d[3];
+            texel(l - 1, x, y, a);
+            texel(l - 1, x + 1, y, b);
+            texel(l - 1, x, y + 1, c);
+            texel(l - 1, x + 1, y + 1, d);
+            float* out = tile + (j * tile_size + i) * 3;
+            for (int k = 0; k < 3; k++)
+                out[k] = 0.25f * (a[k] + b[k] + c[k] + d[k]);
+        }
+    }
+
+    float* expected = nullptr;
+    auto& slot = levels[l].tiles[ty * levels[l].tiles_x + tx];
+    if (slot.compare_exchange_strong(expected, tile, std::memory_order_acq_rel)) {
+        resident += tile_floats * sizeof(float);
+        return tile;
+    }
+    delete[] tile;
+    return expected;
+}
+
+
+color mip_texture::bilinear(int l, double u, double v) const {
+    const auto& lv = levels[l];
+    // Same orientation as image_texture: v = 1 is the first image row.
+    double x = u * lv.width - 0.5;
+    double y = (1 - v) * lv.height - 0.5;
+    int x0 = static_cast<int>(floor(x)), y0 = static_cast<int>(floor(y));
+    double fx = x - x0, fy = y - y0;
+
+    float a[3], b[3], c[3], d[3];
+    texel(l, x0, y0, a);
+    texel(l, x0 + 1, y0, b);
+    texel(l, x0, y0 + 1, c);
+    texel(l, x0 + 1, y0 + 1, d);
+    double rgb[3];
+    for (int k = 0; k < 3; k++) {
+        double top = a[k] + fx * (b[k] - a[k]);
+        double bottom = c[k] + fx * (d[k] - c[k]);
+        rgb[k] = top + fy * (bottom - top);
+    }
+    return color(rgb[0], rgb[1], rgb[2]);
+}
+
+
+color mip_texture::filtered_value(double u, double v, const vec3& p, double width) const {
+    if (levels.empty())
+        return image->value(u, v, p);
+
+    u = clamp(u, 0.0, 1.0);
+    v = clamp(v, 0.0, 1.0);
+
+    // Level whose texels are about as wide as the footprint.
+    int last = level_count() - 1;
+    double size = fmax(levels[0].width, levels[0].height);
+    double lod = width > 0 ? log2(width * size) : 0;
+    if (lod <= 0)
+        return bilinear(0, u, v);
+    if (lod >= last)
+        return bilinear(last, u, v);
+
+    int l = static_cast<int>(lod);
+    double f = lod - l;
+    return (1 - f) * bilinear(l, u, v) + f * bilinear(l + 1, u, v);
+}
+
+
+#endif
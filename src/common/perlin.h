@@ -13,6 +13,7 @@
 
 #include "rtweekend.h"
 
+#include "simd.h"
 
 
 class perlin {
@@ -26,13 +27,29 @@ class perlin {
             perm_x = perlin_generate_perm();
             perm_y = perlin_generate_perm();
             perm_z = perlin_generate_perm();
+
+            // The same gradients in SoA form for the turbulence kernels.
+            gradients = new real[3 * point_count];
+            for (int i = 0; i < point_count; ++i)
+                for (int a = 0; a < 3; a++)
+                    gradients[a*point_count + i] = ranvec[i][a];
+            tables.perm_x = perm_x;
+            tables.perm_y = perm_y;
+            tables.perm_z = perm_z;
+            tables.gx = gradients;
+            tables.gy = gradients + point_count;
+            tables.gz = gradients + 2*point_count;
         }
 
+        perlin(const perlin&) = delete;
+        perlin& operator=(const perlin&) = delete;
+
         ~perlin() {
             delete[] ranvec;
             delete[] perm_x;
             delete[] perm_y;
             delete[] perm_z;
+            delete[] gradients;
         }
 
         double noise(const point3& p) const {
@@ -56,18 +73,10 @@ class perlin {
             return perlin_interp(c, u, v, w);
         }
 
+        // Evaluated by the selected SIMD kernel, several octaves at a time.
         double turb(const point3& p, int depth=7) const {
-            auto accum = 0.0;
-            auto temp_p = p;
-            auto weight = 1.0;
-
-            for (int i = 0; i < depth; i++) {
-                accum += weight * noise(temp_p);
-                weight *= 0.5;
-                temp_p *= 2;
-            }
-
-            return fabs(accum);
+            real q[3] = {p.x(), p.y(), p.z()};
+            return fabs(simd.turbulence(tables, q, depth));
         }
 
     private:
@@ -76,6 +85,8 @@ class perlin {
         int* perm_x;
         int* perm_y;
         int* perm_z;
+        real* gradients;
+        noise_tables tables;
 
         static int* perlin_generate_perm() {
             auto p = new int[point_count];
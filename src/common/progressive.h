@@ -0,0 +1,338 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+//==============================================================================================
+// Progressive rendering: the image is rendered in passes of a few samples per pixel, all
+// accumulated into one render_buffers, until one of the stop conditions holds:
+//
+//   - target_samples per pixel have been taken,
+//   - time_budget seconds have passed (checked by the workers, so a pass may end early and
+//     leave some pixels a pass behind the others),
+//   - the mean relative standard error of the pixels' luminance is below noise_threshold,
+//   - the process got SIGTERM (the workers stop at the next pixel).
+//
+// Between passes a snapshot of the image so far (in the format its extension names, see
+// image_output.h) is written every snapshot_interval seconds, and a checkpoint (see
+// checkpoint.h) every checkpoint_interval seconds, on SIGUSR1, and when the render stops.
+// Both go to a temporary file that is then renamed over the old one, so readers only ever
+// see complete files and a kill mid-write loses nothing.
+//
+// To spread a render over several processes, each is given a rank in [0, ranks). The image
+// is cut into tile_size squares dealt out round-robin, so every process gets a share of each
+// part of the image, and each renders only its own tiles. Their checkpoints hold disjoint
+// pixels and merge into the full image.
+//
+// A render can also be limited to a few regions, to fix fireflies or a local change without
+// rendering the rest again. Resuming a checkpoint then throws away what the regions' pixels
+// had gathered and renders them again from scratch, to the full sample count, while the rest
+// of the image stays as it was.
+//
+// The renderer seeds each camera sample from sample_seed(), the pixel and the pixel's sample
+// count (see seed_random() in rtweekend.h), so a checkpoint holds all the state the random
+// numbers depend on and a resumed render takes the samples the uninterrupted one would have.
+// Rendering regions switches to a new sample seed, so they get fresh samples rather than the
+// ones that gave the fireflies.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "checkpoint.h"
+#include "image_output.h"
+#include "render_buffers.h"
+
+#include <signal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Pixels [x0, x1) x [y0, y1), with y up from the bottom like render_buffers.
+struct pixel_region {
+    int x0, y0, x1, y1;
+
+    bool contains(int x, int y) const { return x >= x0 && x < x1 && y >= y0 && y < y1; }
+};
+
+
+struct progressive_settings {
+    int pass_samples = 16;
+    int target_samples = 256;        // 0: no limit
+    double time_budget = 0;          // seconds; 0: no limit
+    double noise_threshold = 0;      // 0: off
+    double snapshot_interval = 0;    // seconds; 0: no snapshots
+    std::string snapshot_path = "snapshot.ppm";
+    double checkpoint_interval = 0;  // seconds; 0: only on SIGUSR1 and at the end
+    std::string checkpoint_path;     // empty: no checkpoints
+    unsigned seed = 1;               // for the samples' random numbers
+    int rank = 0, ranks = 1;         // this process's share of the tiles
+    int tile_size = 32;
+    std::vector<pixel_region> regions;  // empty: the whole image
+};
+
+
+namespace progressive_detail {
+    // Function-local statics, so every file including this header shares one flag each.
+    inline volatile sig_atomic_t& checkpoint_requested() {
+        static volatile sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    inline volatile sig_atomic_t& terminate_requested() {
+        static volatile sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    inline void on_signal(int sig) {
+        checkpoint_requested() = 1;
+        if (sig == SIGTERM)
+            terminate_requested() = 1;
+    }
+}
+
+
+class progressive_render {
+    public:
+        progressive_render(const progressive_settings& s, render_buffers& buffers)
+            : settings(s), frame(buffers), passes(0), samples(0), noise(-1), last_snapshot(0),
+              last_checkpoint(0), start(std::chrono::steady_clock::now()), reason("") {
+            info.seed = info.rng_state = settings.seed;
+            if (!settings.regions.empty())
+                info.rng_state = next_seed(info.rng_state);
+            samples = fewest_samples();
+        }
+
+        // SIGUSR1 then asks for a checkpoint, SIGTERM for a checkpoint and a stop.
+        static void install_signal_handlers();
+
+        // Continues the render saved at `path`, which must be the same size as the frame,
+        // clearing the pixels of settings.regions. Returns false, leaving everything as it
+        // was, if it cannot be read.
+        bool resume(const std::string& path);
+
+        // Samples per pixel the next pass should take, or 0 once a stop condition holds.
+        int next_pass();
+
+        // Call after every pass: updates the statistics and writes a snapshot or checkpoint
+        // when one is due.
+        void end_pass();
+
+        // Call once the loop is over, before the frame is resolved: writes the final
+        // snapshot and checkpoint.
+        void finish();
+
+        // Safe to call from the workers.
+        double elapsed() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                .count();
+        }
+        bool should_stop() const {
+            return progressive_detail::terminate_requested()
+                || (settings.time_budget > 0 && elapsed() >= settings.time_budget);
+        }
+
+        // Writes the image so far to settings.snapshot_path.
+        bool snapshot() const;
+
+        // Writes the sums so far to settings.checkpoint_path.
+        bool checkpoint();
+
+        // Whether this process renders pixel (x, y).
+        bool owns(int x, int y) const {
+            if (!settings.regions.empty() && !in_regions(x, y))
+                return false;
+            if (settings.ranks <= 1)
+                return true;
+            int tiles_x = (frame.width + settings.tile_size - 1) / settings.tile_size;
+            int tile = (y / settings.tile_size) * tiles_x + x / settings.tile_size;
+            return tile % settings.ranks == settings.rank;
+        }
+
+        // What the camera samples are seeded from; safe to call from the workers.
+        uint32_t sample_seed() const { return info.rng_state; }
+
+        int samples_per_pixel() const { return samples; }
+        const char* stop_reason() const { return reason; }
+
+    private:
+        static uint32_t next_seed(uint32_t seed) {
+            return static_cast<uint32_t>(mix_bits(seed + 1ULL));
+        }
+
+        bool in_regions(int x, int y) const {
+            for (const auto& region : settings.regions) {
+                if (region.contains(x, y))
+                    return true;
+            }
+            return false;
+        }
+
+        int fewest_samples() const;
+        double relative_error(const render_buffers& resolved) const;
+
+        progressive_settings settings;
+        render_buffers& frame;
+        int passes;
+        int samples;        // per pixel, the fewest any pixel has
+        double noise;       // after the last pass; -1 until measured
+        double last_snapshot;
+        double last_checkpoint;
+        checkpoint_info info;
+        std::chrono::steady_clock::time_point start;
+        const char* reason;
+};
+
+
+inline void progressive_render::install_signal_handlers() {
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = progressive_detail::on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+
+inline bool progressive_render::resume(const std::string& path) {
+    render_buffers loaded(frame.width, frame.height);
+    checkpoint_info loaded_info;
+    if (!read_checkpoint(path, loaded, loaded_info) || loaded.width != frame.width
+        || loaded.height != frame.height)
+        return false;
+
+    for (int y = 0; y < loaded.height; y++)
+        for (int x = 0; x < loaded.width; x++) {
+            if (!settings.regions.empty() && in_regions(x, y))
+                loaded.clear(x, y);
+        }
+
+    frame = std::move(loaded);
+    info = loaded_info;
+    if (!settings.regions.empty())
+        info.rng_state = next_seed(info.rng_state);
+    passes = info.passes;
+    samples = fewest_samples();
+    return true;
+}
+
+
+inline int progressive_render::next_pass() {
+    if (progressive_detail::terminate_requested())
+        reason = "terminated";
+    else if (samples == INT_MAX)
+        reason = "no tiles to render";
+    else if (settings.target_samples > 0 && samples >= settings.target_samples)
+        reason = "target samples reached";
+    else if (should_stop())
+        reason = "time budget spent";
+    else if (settings.noise_threshold > 0 && noise >= 0 && noise < settings.noise_threshold)
+        reason = "noise threshold reached";
+    else {
+        int n = settings.pass_samples;
+        if (settings.target_samples > 0 && samples + n > settings.target_samples)
+            n = settings.target_samples - samples;
+        return n;
+    }
+    return 0;
+}
+
+
+inline void progressive_render::end_pass() {
+    passes++;
+    // A pass cut short by the time budget leaves some pixels behind.
+    samples = fewest_samples();
+
+    if (settings.noise_threshold > 0) {
+        render_buffers resolved(frame);
+        resolved.resolve();
+        noise = relative_error(resolved);
+    }
+
+    double t = elapsed();
+    std::cerr << "\r Pass " << passes << ": " << samples << " spp in " << t << " s";
+    if (noise >= 0)
+        std::cerr << ", noise " << noise;
+    std::cerr << "   ";
+
+    if (settings.snapshot_interval > 0 && t - last_snapshot >= settings.snapshot_interval) {
+        if (!snapshot())
+            std::cerr << "\nCould not write " << settings.snapshot_path << ".\n";
+        last_snapshot = t;
+    }
+
+    bool due = settings.checkpoint_interval > 0
+            && t - last_checkpoint >= settings.checkpoint_interval;
+    if (!settings.checkpoint_path.empty() && (due || progressive_detail::checkpoint_requested())
+        && !progressive_detail::terminate_requested()) {
+        progressive_detail::checkpoint_requested() = 0;
+        if (!checkpoint())
+            std::cerr << "\nCould not write " << settings.checkpoint_path << ".\n";
+        last_checkpoint = t;
+    }
+}
+
+
+inline void progressive_render::finish() {
+    std::cerr << "\nStopped at " << samples << " spp after " << elapsed() << " s: " << reason
+              << ".\n";
+    if (settings.snapshot_interval > 0 && !snapshot())
+        std::cerr << "Could not write " << settings.snapshot_path << ".\n";
+    if (!settings.checkpoint_path.empty() && !checkpoint())
+        std::cerr << "Could not write " << settings.checkpoint_path << ".\n";
+}
+
+
+inline bool progressive_render::checkpoint() {
+    info.passes = passes;
+    return write_checkpoint(settings.checkpoint_path, frame, info);
+}
+
+
+inline bool progressive_render::snapshot() const {
+    render_buffers resolved(frame);
+    resolved.resolve();
+    return write_image(settings.snapshot_path, image_format_for(settings.snapshot_path),
+                       resolved.width, resolved.height, resolved.radiance);
+}
+
+
+// Over the pixels this process renders; INT_MAX if it has none.
+inline int progressive_render::fewest_samples() const {
+    int fewest = -1;
+    for (int y = 0; y < frame.height; y++)
+        for (int x = 0; x < frame.width; x++) {
+            int n = frame.samples[frame.index(x, y)];
+            if (owns(x, y) && (fewest < 0 || n < fewest))
+                fewest = n;
+        }
+    return fewest < 0 ? INT_MAX : fewest;
+}
+
+
+// Mean over the pixels this process renders of the standard error of the mean luminance
+// relative to the mean luminance. Pixels darker than 1e-3 are measured against that instead,
+// so black backgrounds do not dominate.
+inline double progressive_render::relative_error(const render_buffers& resolved) const {
+    double sum = 0;
+    size_t count = 0;
+    for (int y = 0; y < resolved.height; y++)
+        for (int x = 0; x < resolved.width; x++) {
+            size_t i = resolved.index(x, y);
+            if (resolved.samples[i] < 2 || !owns(x, y))
+                continue;
+            float l = luminance(resolved.radiance[0][i], resolved.radiance[1][i],
+                                resolved.radiance[2][i]);
+            sum += std::sqrt(resolved.variance[i]) / std::max(l, 1e-3f);
+            count++;
+        }
+    return count ? sum / count : -1;
+}
+
+
+#endif
@@ -14,29 +14,33 @@
 #include "vec3.h"
 
 
-class ray {
+template <typename T>
+class ray_t {
     public:
-        ray() {}
-        ray(const point3& origin, const vec3& direction)
+        ray_t() {}
+        ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction)
             : orig(origin), dir(direction), tm(0)
         {}
 
-        ray(const point3& origin, const vec3& direction, double time)
+        ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction, T time)
             : orig(origin), dir(direction), tm(time)
         {}
 
-        point3 origin() const  { return orig; }
-        vec3 direction() const { return dir; }
-        double time() const    { return tm; }
+        vec3_t<T> origin() const  { return orig; }
+        vec3_t<T> direction() const { return dir; }
+        T time() const    { return tm; }
 
-        point3 at(double t) const {
+        vec3_t<T> at(T t) const {
             return orig + t*dir;
         }
 
     public:
-        point3 orig;
-        vec3 dir;
-        double tm;
+        vec3_t<T> orig;
+        vec3_t<T> dir;
+        T tm;
 };
 
+
+using ray = ray_t<real>;
+
 #endif
@@ -0,0 +1,168 @@
+#ifndef RENDER_BUFFERS_H
+#define RENDER_BUFFERS_H
+//==============================================================================================
+// Per-pixel render outputs: mean radiance plus the first-hit auxiliary buffers (AOVs).
+//
+// Every camera sample adds its radiance and an aov_sample to its pixel. resolve() then turns
+// the sums into means and the radiance's second moment into the variance of the mean, which
+// the denoiser uses to tell noise from detail. Pixels are addressed like the camera's (u,v):
+// x to the right, y up from the bottom row.
+//
+// The planes are SoA float arrays, one value per pixel, so the denoiser streams through them.
+// add_sample() needs no locking as long as each pixel is rendered by a single thread.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "image_output.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// What the camera sample saw first: albedo and shading normal of the first non-specular
+// surface along the path (mirrors and glass are looked through), the path length to it, and
+// its material slot. Paths that escape keep the defaults.
+struct aov_sample {
+    color albedo = color(0,0,0);
+    vec3 normal = vec3(0,0,0);
+    double depth = 0;
+    int material = -1;
+};
+
+
+inline float luminance(double r, double g, double b) {
+    return static_cast<float>(0.2126*r + 0.7152*g + 0.0722*b);
+}
+
+
+class render_buffers {
+    public:
+        render_buffers(int image_width, int image_height)
+            : width(image_width), height(image_height) {
+            size_t n = static_cast<size_t>(width) * height;
+            for (int c = 0; c < 3; c++) {
+                radiance[c].assign(n, 0);
+                albedo[c].assign(n, 0);
+                normal[c].assign(n, 0);
+            }
+            depth.assign(n, 0);
+            variance.assign(n, 0);
+            material.assign(n, -1);
+            samples.assign(n, 0);
+        }
+
+        size_t index(int x, int y) const { return static_cast<size_t>(y) * width + x; }
+
+        void add_sample(int x, int y, const color& c, const aov_sample& aov) {
+            size_t i = index(x, y);
+            double rgb[3];
+            for (int k = 0; k < 3; k++) {
+                // Drop NaNs as write_color does.
+                rgb[k] = c[k] == c[k] ? c[k] : 0.0;
+                radiance[k][i] += rgb[k];
+                albedo[k][i] += aov.albedo[k];
+                normal[k][i] += aov.normal[k];
+            }
+            float l = luminance(rgb[0], rgb[1], rgb[2]);
+            variance[i] += l * l;
+            depth[i] += aov.depth;
+            if (samples[i]++ == 0)
+                material[i] = aov.material;
+        }
+
+        // Drops everything pixel (x, y) has gathered, so it can be rendered again.
+        void clear(int x, int y) {
+            size_t i = index(x, y);
+            for (int k = 0; k < 3; k++)
+                radiance[k][i] = albedo[k][i] = normal[k][i] = 0;
+            depth[i] = variance[i] = 0;
+            material[i] = -1;
+            samples[i] = 0;
+        }
+
+        // Adds the samples of `other`, another unresolved render of the same image. Returns
+        // false if the sizes differ.
+        bool merge(const render_buffers& other) {
+            if (other.width != width || other.height != height)
+                return false;
+            for (size_t i = 0; i < samples.size(); i++) {
+                for (int k = 0; k < 3; k++) {
+                    radiance[k][i] += other.radiance[k][i];
+                    albedo[k][i] += other.albedo[k][i];
+                    normal[k][i] += other.normal[k][i];
+                }
+                depth[i] += other.depth[i];
+                variance[i] += other.variance[i];
+                if (samples[i] == 0)
+                    material[i] = other.material[i];
+                samples[i] += other.samples[i];
+            }
+            return true;
+        }
+
+        // Sums to means; call once every sample is in.
+        void resolve() {
+            for (size_t i = 0; i < samples.size(); i++) {
+                if (samples[i] == 0)
+                    continue;
+                float scale = 1.0f / samples[i];
+                for (int k = 0; k < 3; k++) {
+                    radiance[k][i] *= scale;
+                    albedo[k][i] *= scale;
+                }
+                depth[i] *= scale;
+
+                // Variance of the mean luminance: (E[l^2] - E[l]^2) / n.
+                float l = luminance(radiance[0][i], radiance[1][i], radiance[2][i]);
+                variance[i] = std::max(0.0f, variance[i] * scale - l * l) * scale;
+
+                vec3 n(normal[0][i], normal[1][i], normal[2][i]);
+                if (n.length_squared() > 0)
+                    n = unit_vector(n);
+                for (int k = 0; k < 3; k++)
+                    normal[k][i] = static_cast<float>(n[k]);
+            }
+        }
+
+        // <prefix>_albedo.pfm, _normal.pfm (components mapped to [0,1]), _depth.pfm and
+        // _material.pfm (slot + 1, 0 where the path escaped).
+        bool write_aovs(const std::string& prefix) const {
+            size_t n = samples.size();
+            std::vector<float> shown_normal[3], gray[3];
+            for (int k = 0; k < 3; k++) {
+                shown_normal[k].resize(n);
+                for (size_t i = 0; i < n; i++)
+                    shown_normal[k][i] = 0.5f * (normal[k][i] + 1);
+            }
+            for (int k = 0; k < 3; k++)
+                gray[k] = depth;
+            bool ok = write_pfm(prefix + "_albedo.pfm", albedo);
+            ok = write_pfm(prefix + "_normal.pfm", shown_normal) && ok;
+            ok = write_pfm(prefix + "_depth.pfm", gray) && ok;
+            for (int k = 0; k < 3; k++)
+                for (size_t i = 0; i < n; i++)
+                    gray[k][i] = static_cast<float>(material[i] + 1);
+            return write_pfm(prefix + "_material.pfm", gray) && ok;
+        }
+
+    private:
+        bool write_pfm(const std::string& path, const std::vector<float>* planes) const {
+            return write_image(path, image_format::pfm, width, height, planes);
+        }
+
+    public:
+        int width, height;
+        std::vector<float> radiance[3];
+        std::vector<float> albedo[3];
+        std::vector<float> normal[3];   // unit length after resolve(), zero where nothing was hit
+        std::vector<float> depth;
+        std::vector<float> variance;    // sum of squared luminance until resolve()
+        std::vector<int> material;      // slot of the first sample's material
+        std::vector<int> samples;
+};
+
+
+#endif
@@ -0,0 +1,671 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+//==============================================================================================
+// A long-running render server: the scene is built once by the caller, and render jobs that
+// only change the camera, resolution, sample count or region are taken over a Unix socket and
+// rendered on a persistent thread pool.
+//
+// The protocol is line based. A client sends
+//
+//   render id=<name> [priority=<n>] [width=<n>] [height=<n>] [spp=<n>] [pass=<n>]
+//          [from=<x,y,z>] [at=<x,y,z>] [up=<x,y,z>] [vfov=<deg>] [aperture=<a>] [focus=<d>]
+//          [time=<t0,t1>] [region=<x0,y0,x1,y1>] [denoise=0|1] [stream=0|1]
+//   cancel <name>
+//   status
+//   shutdown
+//
+// and gets back `queued <name>` or `error <message>` for each request. Unset job fields take
+// the server's defaults; time is the shutter interval moving objects are sampled over, and
+// the region is in pixels, y up from the bottom row, x1 and y1 exclusive. Jobs are rendered
+// in passes of `pass` samples per pixel. After every pass the server sends
+// `progress <name> <spp> <seconds>`, and with stream=1 also the image so far as
+//
+//   image <name> <spp> <width> <height>\n  then width * height * 3 floats
+//
+// (the region only, linear RGB, top row first, in the machine's byte order). The finished
+// job ends with the same block headed `done` instead of `image`, denoised if asked for; a
+// cancelled one with `cancelled <name>`.
+//
+// The job with the highest priority (earliest first among equals) gets the next pass, so a
+// more urgent job preempts a running one at its next pass boundary. Closing the connection
+// cancels the client's jobs.
+//
+// The region pixels of all queued jobs together are limited to the server's pixel budget, as
+// each takes about 52 bytes until its job ends (and the job being sent three times that). A
+// job that would exceed it gets `error job too large` if it does not fit even on an idle
+// server, and `error server busy` otherwise.
+//
+// Replies are queued per client and written by the client's own thread, so a client that
+// reads slowly holds up neither the scheduler nor the other clients. A streamed image still
+// waiting in the queue is replaced by the job's next one rather than queued behind it.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "denoise.h"
+#include "render_buffers.h"
+#include "thread_pool.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+struct render_job {
+    std::string id;
+    int priority = 0;
+    int width = 800, height = 450;
+    int samples = 64;
+    int pass_samples = 16;
+    int x0 = 0, y0 = 0, x1 = -1, y1 = -1;   // region; -1: to the image's edge
+    point3 lookfrom = point3(0, 0, -1);
+    point3 lookat = point3(0, 0, 0);
+    vec3 vup = vec3(0, 1, 0);
+    double vfov = 40, aperture = 0, focus_dist = 10;
+    double time0 = 0, time1 = 0;           // shutter
+    bool denoise = false;
+    bool stream = false;
+};
+
+
+// Applies the key=value tokens of a render request to `job`. Returns false with a message in
+// `error` on an unknown key, a malformed value or an impossible job.
+inline bool parse_render_job(std::istream& in, render_job& job, std::string& error) {
+    std::string token;
+    while (in >> token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got " + token;
+            return false;
+        }
+        std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+        double v[3];
+        bool ok = true;
+        if (key == "id")
+            job.id = value;
+        else if (key == "priority")
+            job.priority = atoi(value.c_str());
+        else if (key == "width")
+            job.width = atoi(value.c_str());
+        else if (key == "height")
+            job.height = atoi(value.c_str());
+        else if (key == "spp")
+            job.samples = atoi(value.c_str());
+        else if (key == "pass")
+            job.pass_samples = atoi(value.c_str());
+        else if (key == "vfov")
+            job.vfov = atof(value.c_str());
+        else if (key == "aperture")
+            job.aperture = atof(value.c_str());
+        else if (key == "focus")
+            job.focus_dist = atof(value.c_str());
+        else if (key == "denoise")
+            job.denoise = value == "1";
+        else if (key == "stream")
+            job.stream = value == "1";
+        else if (key == "from" || key == "at" || key == "up") {
+            ok = sscanf(value.c_str(), "%lf,%lf,%lf", &v[0], &v[1], &v[2]) == 3;
+            vec3 p(v[0], v[1], v[2]);
+            if (ok)
+                (key == "from" ? job.lookfrom : key == "at" ? job.lookat : job.vup) = p;
+        } else if (key == "time") {
+            ok = sscanf(value.c_str(), "%lf,%lf", &job.time0, &job.time1) == 2;
+        } else if (key == "region") {
+            ok = sscanf(value.c_str(), "%d,%d,%d,%d", &job.x0, &job.y0, &job.x1, &job.y1)
+                 == 4;
+        } else {
+            error = "unknown key " + key;
+            return false;
+        }
+        if (!ok) {
+            error = "bad value for " + key;
+            return false;
+        }
+    }
+
+    if (job.x1 < 0)
+        job.x1 = job.width;
+    if (job.y1 < 0)
+        job.y1 = job.height;
+    if (job.id.empty())
+        error = "missing id";
+    else if (job.width < 2 || job.height < 2 || job.width > 16384 || job.height > 16384)
+        error = "bad image size";
+    else if (job.x0 < 0 || job.y0 < 0 || job.x1 > job.width || job.y1 > job.height
+             || job.x0 >= job.x1 || job.y0 >= job.y1)
+        error = "bad region";
+    else if (job.samples < 1 || job.pass_samples < 1)
+        error = "bad sample count";
+    return error.empty();
+}
+
+
+class render_server {
+    public:
+        // Adds `samples` samples of pixel (x, y) of an image_width x image_height image seen
+        // through `cam` to `out` at (out_x, out_y). Called from the pool's threads.
+        typedef void (*pixel_fn)(void* context, const camera& cam, int image_width,
+                                 int image_height, int x, int y, int samples,
+                                 render_buffers& out, int out_x, int out_y);
+
+        render_server(const render_job& defaults, pixel_fn render_pixel, void* context,
+                      int nthreads, size_t max_pixels = size_t(1) << 24)
+            : defaults(defaults), render_pixel(render_pixel), context(context), pool(nthreads),
+              max_pixels(max_pixels), listen_fd(-1), stopping(false), sequence(0),
+              queued_pixels(0) {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&changed, NULL);
+        }
+
+        ~render_server() {
+            pthread_cond_destroy(&changed);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        // Serves clients at `socket_path` until one sends shutdown. Returns nonzero if the
+        // socket cannot be set up.
+        int serve(const std::string& socket_path);
+
+    private:
+        struct connection {
+            explicit connection(int fd)
+                : fd(fd), open(true), closing(false), finished(false), written(0) {
+                pthread_mutex_init(&outbox_mutex, NULL);
+                if (pipe(wake) != 0)
+                    wake[0] = wake[1] = -1;
+                for (int end : wake) {
+                    if (end >= 0)
+                        fcntl(end, F_SETFL, fcntl(end, F_GETFL) | O_NONBLOCK);
+                }
+            }
+            ~connection() {
+                close(fd);
+                for (int end : wake) {
+                    if (end >= 0)
+                        close(end);
+                }
+                pthread_mutex_destroy(&outbox_mutex);
+            }
+
+            // Queues `message` for the client's thread to write; never blocks on the socket.
+            // With a `replaces` key, an unsent message queued with the same key is replaced.
+            void post(const std::string& message, const std::string& replaces = "");
+
+            // From the client's thread: writes as much of the queue as the socket takes
+            // without blocking, and gives up on the client if the socket fails.
+            void flush();
+
+            // Asks the client's thread to write what is queued and end.
+            void close_when_flushed() {
+                closing = true;
+                char byte = 0;
+                if (write(wake[1], &byte, 1) < 0) {
+                    // A wakeup is pending anyway.
+                }
+            }
+
+            bool has_output() {
+                pthread_mutex_lock(&outbox_mutex);
+                bool any = !outbox.empty();
+                pthread_mutex_unlock(&outbox_mutex);
+                return any;
+            }
+
+            int fd;
+            int wake[2];            // a pipe post() writes to, to wake the client's thread
+            std::atomic<bool> open;
+            std::atomic<bool> closing;
+            std::atomic<bool> finished;     // the client's thread has ended
+
+            pthread_mutex_t outbox_mutex;   // guards the fields below
+            std::deque<std::pair<std::string, std::string>> outbox;   // message, its key
+            size_t written;         // bytes of the first message already sent
+        };
+
+        struct active_job {
+            active_job(const render_job& spec)
+                : spec(spec), frame(spec.x1 - spec.x0, spec.y1 - spec.y0), samples(0),
+                  started(false), cancelled(false) {
+                cam = camera(spec.lookfrom, spec.lookat, spec.vup, spec.vfov,
+                             double(spec.width) / spec.height, spec.aperture, spec.focus_dist,
+                             spec.time0, spec.time1);
+            }
+
+            render_job spec;
+            render_server* server;
+            camera cam;
+            render_buffers frame;
+            std::shared_ptr<connection> client;
+            long sequence;
+            std::atomic<int> samples;   // read by status requests
+            int pass_samples;    // of the pass being rendered
+            bool started;
+            std::chrono::steady_clock::time_point start;
+            std::atomic<bool> cancelled;
+        };
+
+        struct client_args {
+            render_server* server;
+            std::shared_ptr<connection> client;
+        };
+
+        struct client_entry {
+            pthread_t thread;
+            std::shared_ptr<connection> client;
+        };
+
+        static void* client_thread(void* arg);
+        static void* scheduler_thread(void* arg);
+        static void render_row(int row, void* arg);
+
+        void handle_client(const std::shared_ptr<connection>& client);
+        std::string handle_request(const std::string& line,
+                                   const std::shared_ptr<connection>& client);
+        void schedule();
+        void send_image(active_job& job, const char* tag, bool final);
+
+        static size_t pixels_of(const render_job& spec) {
+            return static_cast<size_t>(spec.x1 - spec.x0) * (spec.y1 - spec.y0);
+        }
+
+        render_job defaults;
+        pixel_fn render_pixel;
+        void* context;
+        thread_pool pool;
+        size_t max_pixels;              // of all queued jobs' regions together
+        int listen_fd;
+
+        pthread_mutex_t mutex;          // guards the fields below
+        pthread_cond_t changed;
+        bool stopping;
+        long sequence;
+        size_t queued_pixels;           // reserved by the jobs below and those being queued
+        std::vector<std::shared_ptr<active_job>> jobs;
+};
+
+
+void render_server::connection::post(const std::string& message, const std::string& replaces) {
+    if (!open || message.empty())
+        return;
+    pthread_mutex_lock(&outbox_mutex);
+    bool replaced = false;
+    if (!replaces.empty()) {
+        // The first message may be partly written already.
+        for (size_t i = written > 0 ? 1 : 0; i < outbox.size() && !replaced; i++) {
+            if (outbox[i].second == replaces) {
+                outbox[i].first = message;
+                replaced = true;
+            }
+        }
+    }
+    if (!replaced)
+        outbox.push_back(std::make_pair(message, replaces));
+    pthread_mutex_unlock(&outbox_mutex);
+    char byte = 0;
+    if (write(wake[1], &byte, 1) < 0) {
+        // The pipe is full, so a wakeup is pending anyway.
+    }
+}
+
+
+void render_server::connection::flush() {
+    pthread_mutex_lock(&outbox_mutex);
+    while (open && !outbox.empty()) {
+        const std::string& message = outbox.front().first;
+        ssize_t n = ::send(fd, message.data() + written, message.size() - written,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        if (n <= 0) {
+            open = false;
+            break;
+        }
+        written += n;
+        if (written == message.size()) {
+            outbox.pop_front();
+            written = 0;
+        }
+    }
+    pthread_mutex_unlock(&outbox_mutex);
+}
+
+
+int render_server::serve(const std::string& socket_path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof address.sun_path) {
+        std::cerr << "Socket path too long: " << socket_path << '\n';
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&address, sizeof address) != 0
+        || listen(listen_fd, 16) != 0) {
+        std::cerr << "Cannot listen on " << socket_path << ": " << strerror(errno) << '\n';
+        if (listen_fd >= 0)
+            close(listen_fd);
+        return 1;
+    }
+
+    pthread_t scheduler;
+    if (pthread_create(&scheduler, NULL, scheduler_thread, this) != 0) {
+        close(listen_fd);
+        return 1;
+    }
+    std::cerr << "Serving on " << socket_path << " with " << pool.size() << " threads.\n";
+
+    // Client threads are joined, those that ended as new clients come and the rest at
+    // shutdown, so none outlives the server.
+    std::vector<client_entry> clients;
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            break;    // shut down
+        }
+        for (size_t i = 0; i < clients.size();) {
+            if (clients[i].client->finished) {
+                pthread_join(clients[i].thread, NULL);
+                clients.erase(clients.begin() + i);
+            } else {
+                i++;
+            }
+        }
+        auto client = std::make_shared<connection>(fd);
+        if (client->wake[0] < 0)
+            continue;
+        auto args = new client_args{this, client};
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_thread, args) != 0)
+            delete args;
+        else
+            clients.push_back(client_entry{thread, client});
+    }
+
+    // The scheduler has queued the cancelled replies by the time it ends.
+    pthread_join(scheduler, NULL);
+    for (auto& entry : clients)
+        entry.client->close_when_flushed();
+    for (auto& entry : clients)
+        pthread_join(entry.thread, NULL);
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    return 0;
+}
+
+
+void* render_server::client_thread(void* arg) {
+    auto args = static_cast<client_args*>(arg);
+    args->server->handle_client(args->client);
+    args->client->finished = true;
+    delete args;
+    return NULL;
+}
+
+
+void render_server::handle_client(const std::shared_ptr<connection>& client) {
+    std::string pending;
+    char buffer[4096];
+    while (client->open) {
+        // Once the server shuts down, only what is queued is still written, and a client
+        // that takes none of it for a second is given up on.
+        bool closing = client->closing;
+        bool output = client->has_output();
+        if (closing && !output)
+            break;
+        pollfd fds[2];
+        fds[0].fd = client->fd;
+        fds[0].events = (closing ? 0 : POLLIN) | (output ? POLLOUT : 0);
+        fds[1].fd = client->wake[0];
+        fds[1].events = POLLIN;
+        int ready = poll(fds, 2, closing ? 1000 : -1);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            break;
+        if (fds[1].revents & POLLIN) {
+            while (read(client->wake[0], buffer, sizeof buffer) > 0) {}
+        }
+        if (fds[0].revents & POLLOUT)
+            client->flush();
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(client->fd, buffer, sizeof buffer, MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (n <= 0)
+                break;
+            pending.append(buffer, n);
+            size_t end;
+            while ((end = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                client->post(handle_request(line, client));
+            }
+        }
+    }
+
+    // The client is gone: drop its jobs.
+    client->open = false;
+    pthread_mutex_lock(&mutex);
+    for (auto& job : jobs) {
+        if (job->client == client)
+            job->cancelled = true;
+    }
+    pthread_cond_signal(&changed);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+std::string render_server::handle_request(const std::string& line,
+                                          const std::shared_ptr<connection>& client) {
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
+
+    if (command == "render") {
+        render_job spec = defaults;
+        spec.id.clear();
+        std::string error;
+        if (!parse_render_job(in, spec, error))
+            return "error " + error + "\n";
+        size_t pixels = pixels_of(spec);
+        if (pixels > max_pixels)
+            return "error job too large\n";
+        // The pixels are reserved before the buffers are allocated, outside the lock.
+        pthread_mutex_lock(&mutex);
+        bool fits = queued_pixels + pixels <= max_pixels;
+        if (fits)
+            queued_pixels += pixels;
+        pthread_mutex_unlock(&mutex);
+        if (!fits)
+            return "error server busy\n";
+        auto job = std::make_shared<active_job>(spec);
+        job->server = this;
+        job->client = client;
+        pthread_mutex_lock(&mutex);
+        job->sequence = sequence++;
+        jobs.push_back(job);
+        pthread_cond_signal(&changed);
+        pthread_mutex_unlock(&mutex);
+        return "queued " + spec.id + "\n";
+    }
+
+    if (command == "cancel") {
+        std::string id;
+        in >> id;
+        bool found = false;
+        pthread_mutex_lock(&mutex);
+        for (auto& job : jobs) {
+            if (job->client == client && job->spec.id == id) {
+                job->cancelled = true;
+                found = true;
+            }
+        }
+        pthread_cond_signal(&changed);
+        pthread_mutex_unlock(&mutex);
+        return found ? "" : "error no job " + id + "\n";
+    }
+
+    if (command == "status") {
+        std::ostringstream out;
+        pthread_mutex_lock(&mutex);
+        for (auto& job : jobs)
+            out << "job " << job->spec.id << " priority " << job->spec.priority << ' '
+                << job->samples.load() << '/' << job->spec.samples << " spp\n";
+        pthread_mutex_unlock(&mutex);
+        out << "end\n";
+        return out.str();
+    }
+
+    if (command == "shutdown") {
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        for (auto& job : jobs)
+            job->cancelled = true;
+        pthread_cond_signal(&changed);
+        pthread_mutex_unlock(&mutex);
+        // Wakes the accept() in serve().
+        shutdown(listen_fd, SHUT_RDWR);
+        return "bye\n";
+    }
+
+    return "error unknown command " + command + "\n";
+}
+
+
+void* render_server::scheduler_thread(void* arg) {
+    static_cast<render_server*>(arg)->schedule();
+    return NULL;
+}
+
+
+void render_server::schedule() {
+    while (true) {
+        // Next pass goes to the most urgent job; cancelled ones are dropped first.
+        std::shared_ptr<active_job> job;
+        std::vector<std::shared_ptr<active_job>> dropped;
+        pthread_mutex_lock(&mutex);
+        while (true) {
+            for (size_t i = 0; i < jobs.size();) {
+                if (jobs[i]->cancelled) {
+                    dropped.push_back(jobs[i]);
+                    queued_pixels -= pixels_of(jobs[i]->spec);
+                    jobs.erase(jobs.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+            for (auto& j : jobs) {
+                if (!job || j->spec.priority > job->spec.priority
+                    || (j->spec.priority == job->spec.priority && j->sequence < job->sequence))
+                    job = j;
+            }
+            if (job || stopping)
+                break;
+            pthread_cond_wait(&changed, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+        for (auto& j : dropped)
+            j->client->post("cancelled " + j->spec.id + "\n");
+        if (!job)
+            return;
+
+        if (!job->started) {
+            job->started = true;
+            job->start = std::chrono::steady_clock::now();
+        }
+        job->pass_samples = std::min(job->spec.pass_samples, job->spec.samples - job->samples);
+        pool.parallel_for(job->frame.height, render_row, job.get());
+        if (job->cancelled)
+            continue;
+        job->samples += job->pass_samples;
+
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - job->start).count();
+        std::ostringstream progress;
+        progress << "progress " << job->spec.id << ' ' << job->samples.load() << ' ' << seconds
+                 << '\n';
+        job->client->post(progress.str());
+
+        bool finished = job->samples >= job->spec.samples;
+        if (finished || job->spec.stream)
+            send_image(*job, finished ? "done" : "image", finished);
+        if (finished) {
+            pthread_mutex_lock(&mutex);
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (jobs[i] == job) {
+                    queued_pixels -= pixels_of(job->spec);
+                    jobs.erase(jobs.begin() + i);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+}
+
+
+// One row of the job's region for the current pass.
+void render_server::render_row(int row, void* arg) {
+    auto& job = *static_cast<active_job*>(arg);
+    if (job.cancelled)
+        return;
+    const render_job& spec = job.spec;
+    render_server* server = job.server;
+    for (int x = spec.x0; x < spec.x1; x++)
+        server->render_pixel(server->context, job.cam, spec.width, spec.height, x,
+                             spec.y0 + row, job.pass_samples, job.frame, x - spec.x0, row);
+}
+
+
+void render_server::send_image(active_job& job, const char* tag, bool final) {
+    render_buffers resolved(job.frame);
+    resolved.resolve();
+    const std::vector<float>* planes = resolved.radiance;
+    std::vector<float> denoised[3];
+    if (final && job.spec.denoise) {
+        atrous_denoiser().run(resolved, denoised);
+        planes = denoised;
+    }
+
+    int width = resolved.width, height = resolved.height;
+    std::vector<float> pixels(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int k = 0; k < 3; k++)
+                pixels[(static_cast<size_t>(height - 1 - y) * width + x) * 3 + k]
+                    = planes[k][resolved.index(x, y)];
+
+    std::ostringstream header;
+    header << tag << ' ' << job.spec.id << ' ' << job.samples.load() << ' ' << width << ' '
+           << height << '\n';
+    // One message for header and pixels, so a streamed image is never split by other replies.
+    std::string message = header.str();
+    message.append(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float));
+    job.client->post(message, final ? "" : "image " + job.spec.id);
+}
+
+
+#endif
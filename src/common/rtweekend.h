@@ -10,6 +10,7 @@
 //==============================================================================================
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -38,9 +39,31 @@ inline double clamp(double x, double min, double max) {
     return x;
 }
 
+// Random numbers come from a splitmix64 generator per thread, so threads neither contend for
+// nor reorder each other's numbers. Renders restart it with seed_random() before each camera
+// sample, which makes a sample's numbers depend only on its key, not on the thread or the
+// moment it was taken.
+
+inline uint64_t& random_state() {
+    thread_local uint64_t state = 0x853c49e6748fea9bULL;
+    return state;
+}
+
+inline uint64_t mix_bits(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline void seed_random(uint64_t key, uint64_t n) {
+    random_state() = mix_bits(mix_bits(key) + n);
+}
+
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    uint64_t& state = random_state();
+    state += 0x9e3779b97f4a7c15ULL;
+    return (mix_bits(state) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double random_double(double min, double max) {
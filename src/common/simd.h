@@ -0,0 +1,566 @@
+#ifndef SIMD_H
+#define SIMD_H
+//==============================================================================================
+// SIMD kernels for the intersection and traversal hot paths.
+//
+// Every kernel is compiled once per instruction set (scalar, SSE4.2, AVX2, AVX-512) through
+// GCC/Clang target attributes, so a single binary runs on any x86-64 machine. The best set
+// the CPU supports is picked at startup; RT_SIMD=scalar|sse4.2|avx2|avx512 in the
+// environment caps it (useful for benchmarking one path against another).
+//
+// The kernels work on SoA blocks of simd_block_width lanes: a wide BVH node keeps its child
+// boxes this way so one call tests a ray against all of them. Spheres are tested a run of up
+// to simd_block_width at a time straight out of flat SoA arrays. With AVX-512, Perlin
+// turbulence evaluates its octaves side by side, one per lane.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+const int simd_block_width = 8;
+
+enum simd_level { simd_scalar, simd_sse42, simd_avx2, simd_avx512 };
+
+inline const char* simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_sse42:  return "sse4.2";
+        case simd_avx2:   return "avx2";
+        case simd_avx512: return "avx512";
+        default:          return "scalar";
+    }
+}
+
+
+// Boxes in SoA form: lo[axis][lane], hi[axis][lane]. Unused lanes hold a box collapsed to
+// the point at +infinity, which no ray direction can enter.
+struct box_block {
+    real lo[3][simd_block_width];
+    real hi[3][simd_block_width];
+
+    void clear() {
+        for (int a = 0; a < 3; a++)
+            for (int i = 0; i < simd_block_width; i++) {
+                lo[a][i] = std::numeric_limits<real>::infinity();
+                hi[a][i] = std::numeric_limits<real>::infinity();
+            }
+    }
+
+    void set(int lane, const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            lo[a][lane] = box.min()[a];
+            hi[a][lane] = box.max()[a];
+        }
+    }
+};
+
+
+// Spheres in SoA form. The kernels always read simd_block_width entries from `first`, so the
+// owner pads every array with simd_block_width - 1 valid entries past the last sphere.
+struct sphere_arrays {
+    const real* cx;
+    const real* cy;
+    const real* cz;
+    const real* radius;
+};
+
+
+// A ray prepared for the kernels: the reciprocal direction is computed once per ray.
+struct simd_ray {
+    simd_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            org[a] = r.origin()[a];
+            dir[a] = r.direction()[a];
+            inv_dir[a] = 1 / r.direction()[a];
+        }
+        dir_length_squared = r.direction().length_squared();
+    }
+
+    real org[3];
+    real dir[3];
+    real inv_dir[3];
+    real dir_length_squared;
+};
+
+
+// Tests the ray against every lane of the block and returns a bitmask of lanes it enters
+// within (t_min, t_max). The entry distance of each hit lane is written to t_entry.
+typedef unsigned (*boxes_hit_fn)(
+    const box_block& b, const simd_ray& r, real t_min, real t_max, real* t_entry);
+
+
+// The same for boxes that move: lane i is b + s * motion, with s in [0,1] the ray's position
+// in the shutter interval. Empty lanes need zero motion so they stay at +inf.
+typedef unsigned (*moving_boxes_hit_fn)(
+    const box_block& b, const box_block& motion, real s, const simd_ray& r, real t_min,
+    real t_max, real* t_entry);
+
+
+// Intersects the ray with spheres first .. first + count - 1 (count <= simd_block_width) and
+// returns a bitmask of those hit within [t_min, t_max], writing each one's nearest valid
+// root to t_hit[lane].
+typedef unsigned (*spheres_hit_fn)(
+    const sphere_arrays& s, int first, int count, const simd_ray& r, real t_min, real t_max,
+    real* t_hit);
+
+
+// Perlin noise tables with the gradients in SoA form. The gradient at lattice point (i,j,k)
+// is entry perm_x[i & 255] ^ perm_y[j & 255] ^ perm_z[k & 255] of gx, gy and gz.
+struct noise_tables {
+    const int* perm_x;
+    const int* perm_y;
+    const int* perm_z;
+    const real* gx;
+    const real* gy;
+    const real* gz;
+};
+
+
+// Sum of `depth` octaves of Perlin noise at p, octave i sampled at p * 2^i with weight 2^-i.
+typedef real (*turbulence_fn)(const noise_tables& t, const real p[3], int depth);
+
+
+struct simd_kernels {
+    simd_level level;
+    boxes_hit_fn boxes_hit;
+    moving_boxes_hit_fn moving_boxes_hit;
+    spheres_hit_fn spheres_hit;
+    turbulence_fn turbulence;
+};
+
+
+namespace simd_detail {
+
+    template <bool Moving>
+    inline unsigned boxes_hit_scalar(
+        const box_block& b, const box_block* motion, real s, const simd_ray& r, real t_min,
+        real t_max, real* t_entry
+    ) {
+        unsigned mask = 0;
+        for (int i = 0; i < simd_block_width; i++) {
+            real lo = t_min, hi = t_max;
+            for (int a = 0; a < 3; a++) {
+                real blo = b.lo[a][i], bhi = b.hi[a][i];
+                if (Moving) {
+                    blo += s * motion->lo[a][i];
+                    bhi += s * motion->hi[a][i];
+                }
+                real t0 = (blo - r.org[a]) * r.inv_dir[a];
+                real t1 = (bhi - r.org[a]) * r.inv_dir[a];
+                if (t1 < t0) std::swap(t0, t1);
+                lo = t0 > lo ? t0 : lo;
+                hi = t1 < hi ? t1 : hi;
+            }
+            if (lo < hi) {
+                mask |= 1u << i;
+                t_entry[i] = lo;
+            }
+        }
+        return mask;
+    }
+
+    inline unsigned boxes_hit_scalar(
+        const box_block& b, const simd_ray& r, real t_min, real t_max, real* t_entry
+    ) {
+        return boxes_hit_scalar<false>(b, nullptr, 0, r, t_min, t_max, t_entry);
+    }
+
+    inline unsigned moving_boxes_hit_scalar(
+        const box_block& b, const box_block& motion, real s, const simd_ray& r, real t_min,
+        real t_max, real* t_entry
+    ) {
+        return boxes_hit_scalar<true>(b, &motion, s, r, t_min, t_max, t_entry);
+    }
+
+    // Solves for the roots of the lanes whose discriminant is non-negative. Few lanes get
+    // this far, so the square roots are done one lane at a time.
+    inline unsigned sphere_roots(
+        unsigned candidates, const real* half_b, const real* disc, real a, real t_min,
+        real t_max, real* t_hit
+    ) {
+        unsigned mask = 0;
+        while (candidates) {
+            int i = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            real sqrtd = std::sqrt(disc[i]);
+            real root = (-half_b[i] - sqrtd) / a;
+            if (root < t_min || t_max < root) {
+                root = (-half_b[i] + sqrtd) / a;
+                if (root < t_min || t_max < root)
+                    continue;
+            }
+            mask |= 1u << i;
+            t_hit[i] = root;
+        }
+        return mask;
+    }
+
+    inline unsigned spheres_hit_scalar(
+        const sphere_arrays& s, int first, int count, const simd_ray& r, real t_min,
+        real t_max, real* t_hit
+    ) {
+        real half_b[simd_block_width], disc[simd_block_width];
+        unsigned candidates = 0;
+        for (int i = 0; i < count; i++) {
+            int j = first + i;
+            real ox = r.org[0] - s.cx[j], oy = r.org[1] - s.cy[j], oz = r.org[2] - s.cz[j];
+            half_b[i] = ox*r.dir[0] + oy*r.dir[1] + oz*r.dir[2];
+            real c = ox*ox + oy*oy + oz*oz - s.radius[j]*s.radius[j];
+            disc[i] = half_b[i]*half_b[i] - r.dir_length_squared*c;
+            if (disc[i] >= 0)
+                candidates |= 1u << i;
+        }
+        return sphere_roots(candidates, half_b, disc, r.dir_length_squared, t_min, t_max, t_hit);
+    }
+
+    // Always inlined so the per-instruction-set wrappers below compile them with their own
+    // floor and FMA instructions.
+    __attribute__((always_inline)) inline real noise_scalar(
+        const noise_tables& t, real x, real y, real z
+    ) {
+        real fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+        real u = x - fx, v = y - fy, w = z - fz;
+        int i = static_cast<int>(fx), j = static_cast<int>(fy), k = static_cast<int>(fz);
+        real uu = u*u*(3-2*u), vv = v*v*(3-2*v), ww = w*w*(3-2*w);
+
+        real accum = 0;
+        for (int di = 0; di < 2; di++)
+            for (int dj = 0; dj < 2; dj++)
+                for (int dk = 0; dk < 2; dk++) {
+                    int g = t.perm_x[(i+di) & 255] ^ t.perm_y[(j+dj) & 255]
+                          ^ t.perm_z[(k+dk) & 255];
+                    accum += (di ? uu : 1-uu) * (dj ? vv : 1-vv) * (dk ? ww : 1-ww)
+                           * (t.gx[g]*(u-di) + t.gy[g]*(v-dj) + t.gz[g]*(w-dk));
+                }
+        return accum;
+    }
+
+    __attribute__((always_inline)) inline real turbulence_scalar(
+        const noise_tables& t, const real p[3], int depth
+    ) {
+        real accum = 0, weight = 1;
+        real x = p[0], y = p[1], z = p[2];
+        for (int i = 0; i < depth; i++) {
+            accum += weight * noise_scalar(t, x, y, z);
+            weight *= 0.5;
+            x *= 2;
+            y *= 2;
+            z *= 2;
+        }
+        return accum;
+    }
+
+#ifdef RT_SIMD_X86
+    typedef real vreal16 __attribute__((vector_size(16)));
+    typedef real vreal32 __attribute__((vector_size(32)));
+    #ifdef RT_USE_FLOAT
+    // Eight float lanes already fill a 256-bit register.
+    typedef vreal32 vreal64;
+    #else
+    typedef real vreal64 __attribute__((vector_size(64)));
+    #endif
+
+    // Written once with GCC vector extensions and inlined into each target-specific wrapper
+    // below, where it is compiled to that wrapper's instruction set.
+    template <typename V, bool Moving>
+    __attribute__((always_inline)) inline unsigned boxes_hit_vector(
+        const box_block& b, const box_block* motion, real s, const simd_ray& r, real t_min,
+        real t_max, real* t_entry
+    ) {
+        const int width = sizeof(V) / sizeof(real);
+        const V zero = {};
+        unsigned mask = 0;
+
+        for (int i = 0; i < simd_block_width; i += width) {
+            V lo = zero + t_min;
+            V hi = zero + t_max;
+            for (int a = 0; a < 3; a++) {
+                V blo, bhi;
+                std::memcpy(&blo, &b.lo[a][i], sizeof(V));
+                std::memcpy(&bhi, &b.hi[a][i], sizeof(V));
+                if (Moving) {
+                    V mlo, mhi;
+                    std::memcpy(&mlo, &motion->lo[a][i], sizeof(V));
+                    std::memcpy(&mhi, &motion->hi[a][i], sizeof(V));
+                    blo += s * mlo;
+                    bhi += s * mhi;
+                }
+                V t0 = (blo - r.org[a]) * r.inv_dir[a];
+                V t1 = (bhi - r.org[a]) * r.inv_dir[a];
+                V tnear = t0 < t1 ? t0 : t1;
+                V tfar  = t0 < t1 ? t1 : t0;
+                lo = tnear > lo ? tnear : lo;
+                hi = tfar < hi ? tfar : hi;
+            }
+            auto inside = lo < hi;
+            for (int k = 0; k < width; k++) {
+                if (inside[k]) {
+                    mask |= 1u << (i + k);
+                    t_entry[i + k] = lo[k];
+                }
+            }
+        }
+        return mask;
+    }
+
+    template <typename V>
+    __attribute__((always_inline)) inline unsigned spheres_hit_vector(
+        const sphere_arrays& s, int first, int count, const simd_ray& r, real t_min,
+        real t_max, real* t_hit
+    ) {
+        const int width = sizeof(V) / sizeof(real);
+        real half_b[simd_block_width], disc[simd_block_width];
+        unsigned candidates = 0;
+
+        // A full block is computed so the loop has a fixed trip count; lanes past `count`
+        // read padding or the next spheres and are masked off below.
+        for (int i = 0; i < simd_block_width; i += width) {
+            V cx, cy, cz, rad;
+            std::memcpy(&cx, s.cx + first + i, sizeof(V));
+            std::memcpy(&cy, s.cy + first + i, sizeof(V));
+            std::memcpy(&cz, s.cz + first + i, sizeof(V));
+            std::memcpy(&rad, s.radius + first + i, sizeof(V));
+            V ox = r.org[0] - cx, oy = r.org[1] - cy, oz = r.org[2] - cz;
+            V hb = ox*r.dir[0] + oy*r.dir[1] + oz*r.dir[2];
+            V c = ox*ox + oy*oy + oz*oz - rad*rad;
+            V d = hb*hb - r.dir_length_squared*c;
+            std::memcpy(&half_b[i], &hb, sizeof(V));
+            std::memcpy(&disc[i], &d, sizeof(V));
+            auto real_roots = d >= 0;
+            for (int k = 0; k < width; k++)
+                if (real_roots[k])
+                    candidates |= 1u << (i + k);
+        }
+        if (count < simd_block_width)
+            candidates &= (1u << count) - 1;
+        return sphere_roots(candidates, half_b, disc, r.dir_length_squared, t_min, t_max, t_hit);
+    }
+
+    __attribute__((target("sse4.2"))) inline unsigned boxes_hit_sse42(
+        const box_block& b, const simd_ray& r, real t_min, real t_max, real* t_entry
+    ) {
+        return boxes_hit_vector<vreal16, false>(b, nullptr, 0, r, t_min, t_max, t_entry);
+    }
+
+    __attribute__((target("sse4.2"))) inline unsigned moving_boxes_hit_sse42(
+        const box_block& b, const box_block& motion, real s, const simd_ray& r, real t_min,
+        real t_max, real* t_entry
+    ) {
+        return boxes_hit_vector<vreal16, true>(b, &motion, s, r, t_min, t_max, t_entry);
+    }
+
+    __attribute__((target("avx2,fma"))) inline unsigned boxes_hit_avx2(
+        const box_block& b, const simd_ray& r, real t_min, real t_max, real* t_entry
+    ) {
+        return boxes_hit_vector<vreal32, false>(b, nullptr, 0, r, t_min, t_max, t_entry);
+    }
+
+    __attribute__((target("avx2,fma"))) inline unsigned moving_boxes_hit_avx2(
+        const box_block& b, const box_block& motion, real s, const simd_ray& r, real t_min,
+        real t_max, real* t_entry
+    ) {
+        return boxes_hit_vector<vreal32, true>(b, &motion, s, r, t_min, t_max, t_entry);
+    }
+
+    __attribute__((target("avx512f"))) inline unsigned boxes_hit_avx512(
+        const box_block& b, const simd_ray& r, real t_min, real t_max, real* t_entry
+    ) {
+        return boxes_hit_vector<vreal64, false>(b, nullptr, 0, r, t_min, t_max, t_entry);
+    }
+
+    __attribute__((target("avx512f"))) inline unsigned moving_boxes_hit_avx512(
+        const box_block& b, const box_block& motion, real s, const simd_ray& r, real t_min,
+        real t_max, real* t_entry
+    ) {
+        return boxes_hit_vector<vreal64, true>(b, &motion, s, r, t_min, t_max, t_entry);
+    }
+
+    __attribute__((target("sse4.2"))) inline unsigned spheres_hit_sse42(
+        const sphere_arrays& s, int first, int count, const simd_ray& r, real t_min,
+        real t_max, real* t_hit
+    ) {
+        return spheres_hit_vector<vreal16>(s, first, count, r, t_min, t_max, t_hit);
+    }
+
+    __attribute__((target("avx2,fma"))) inline unsigned spheres_hit_avx2(
+        const sphere_arrays& s, int first, int count, const simd_ray& r, real t_min,
+        real t_max, real* t_hit
+    ) {
+        return spheres_hit_vector<vreal32>(s, first, count, r, t_min, t_max, t_hit);
+    }
+
+    __attribute__((target("avx512f"))) inline unsigned spheres_hit_avx512(
+        const sphere_arrays& s, int first, int count, const simd_ray& r, real t_min,
+        real t_max, real* t_hit
+    ) {
+        return spheres_hit_vector<vreal64>(s, first, count, r, t_min, t_max, t_hit);
+    }
+
+    // Lane-parallel octaves only pay off with AVX-512's eight lanes and cheap gathers, so SSE
+    // and AVX2 run the scalar loop, which still gains inline floor (and FMA).
+    __attribute__((target("sse4.2"))) inline real turbulence_sse42(
+        const noise_tables& t, const real p[3], int depth
+    ) {
+        return turbulence_scalar(t, p, depth);
+    }
+
+    __attribute__((target("avx2,fma"))) inline real turbulence_avx2(
+        const noise_tables& t, const real p[3], int depth
+    ) {
+        return turbulence_scalar(t, p, depth);
+    }
+
+    typedef int vint8 __attribute__((vector_size(32)));
+
+    // Loads base[index[k]] into lane k with the hardware gather instructions.
+    __attribute__((target("avx512f"), always_inline)) inline vreal64 gather8(
+        const real* base, vint8 index
+    ) {
+    #ifdef RT_USE_FLOAT
+        return (vreal64)_mm256_i32gather_ps(base, (__m256i)index, sizeof(real));
+    #else
+        return (vreal64)_mm512_i32gather_pd((__m256i)index, base, sizeof(real));
+    #endif
+    }
+
+    __attribute__((target("avx512f"), always_inline)) inline vint8 gather8(
+        const int* base, vint8 index
+    ) {
+        return (vint8)_mm256_i32gather_epi32(base, (__m256i)index, sizeof(int));
+    }
+
+    // Eight octaves per pass, lane k holding octave first + k; lanes past `depth` get zero
+    // weight. Every table lookup is a gather across the lanes.
+    __attribute__((target("avx512f"))) inline real turbulence_avx512(
+        const noise_tables& t, const real p[3], int depth
+    ) {
+        const vreal64 zero = {};
+        vreal64 sum = zero;
+
+        for (int first = 0; first < depth; first += 8) {
+            vreal64 scale, weight;
+            for (int k = 0; k < 8; k++) {
+                scale[k] = std::ldexp(real(1), first + k);
+                weight[k] = first + k < depth ? 1 / scale[k] : 0;
+            }
+
+            // Position within the lattice cell, and the permuted cell corners, per axis.
+            vreal64 frac[3];
+            vint8 h[3][2];
+            const int* perm[3] = {t.perm_x, t.perm_y, t.perm_z};
+            for (int a = 0; a < 3; a++) {
+                vreal64 x = p[a] * scale;
+                vreal64 fx = __builtin_convertvector(__builtin_convertvector(x, vint8), vreal64);
+                fx = fx > x ? fx - 1 : fx;
+                frac[a] = x - fx;
+                vint8 cell = __builtin_convertvector(fx, vint8);
+                h[a][0] = gather8(perm[a], cell & 255);
+                h[a][1] = gather8(perm[a], (cell + 1) & 255);
+            }
+            vreal64 u = frac[0], v = frac[1], w = frac[2];
+
+            // Gradient dot offset at the corners, corner index di*4 + dj*2 + dk.
+            vreal64 dots[8];
+            for (int c = 0; c < 8; c++) {
+                int di = c >> 2, dj = (c >> 1) & 1, dk = c & 1;
+                vint8 g = h[0][di] ^ h[1][dj] ^ h[2][dk];
+                dots[c] = gather8(t.gx, g)*(u - real(di)) + gather8(t.gy, g)*(v - real(dj))
+                        + gather8(t.gz, g)*(w - real(dk));
+            }
+
+            vreal64 uu = u*u*(3 - 2*u), vv = v*v*(3 - 2*v), ww = w*w*(3 - 2*w);
+            vreal64 x00 = dots[0] + ww*(dots[1] - dots[0]);
+            vreal64 x01 = dots[2] + ww*(dots[3] - dots[2]);
+            vreal64 x10 = dots[4] + ww*(dots[5] - dots[4]);
+            vreal64 x11 = dots[6] + ww*(dots[7] - dots[6]);
+            vreal64 y0 = x00 + vv*(x01 - x00);
+            vreal64 y1 = x10 + vv*(x11 - x10);
+            sum += weight * (y0 + uu*(y1 - y0));
+        }
+
+        real total = 0;
+        for (int k = 0; k < 8; k++)
+            total += sum[k];
+        return total;
+    }
+#endif
+
+    inline simd_level detect_level() {
+        simd_level level = simd_scalar;
+#ifdef RT_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            level = simd_avx512;
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            level = simd_avx2;
+        else if (__builtin_cpu_supports("sse4.2"))
+            level = simd_sse42;
+#endif
+        // Allow lowering, never raising, the detected level.
+        const char* cap = std::getenv("RT_SIMD");
+        if (cap) {
+            for (int l = simd_scalar; l <= simd_avx512; l++) {
+                if (std::strcmp(cap, simd_level_name(simd_level(l))) == 0 && l < level)
+                    level = simd_level(l);
+            }
+        }
+        return level;
+    }
+
+    inline simd_kernels select_kernels() {
+        simd_kernels k;
+        k.level = detect_level();
+        k.boxes_hit = boxes_hit_scalar;
+        k.moving_boxes_hit = moving_boxes_hit_scalar;
+        k.spheres_hit = spheres_hit_scalar;
+        k.turbulence = turbulence_scalar;
+#ifdef RT_SIMD_X86
+        switch (k.level) {
+            case simd_avx512:
+                k.boxes_hit = boxes_hit_avx512;
+                k.moving_boxes_hit = moving_boxes_hit_avx512;
+                k.spheres_hit = spheres_hit_avx512;
+                k.turbulence = turbulence_avx512;
+                break;
+            case simd_avx2:
+                k.boxes_hit = boxes_hit_avx2;
+                k.moving_boxes_hit = moving_boxes_hit_avx2;
+                k.spheres_hit = spheres_hit_avx2;
+                k.turbulence = turbulence_avx2;
+                break;
+            case simd_sse42:
+                k.boxes_hit = boxes_hit_sse42;
+                k.moving_boxes_hit = moving_boxes_hit_sse42;
+                k.spheres_hit = spheres_hit_sse42;
+                k.turbulence = turbulence_sse42;
+                break;
+            default: break;
+        }
+#endif
+        return k;
+    }
+}
+
+
+// The kernel set in use, selected once at static initialisation.
+const simd_kernels simd = simd_detail::select_kernels();
+
+
+inline void report_simd_kernels() {
+    std::cerr << "SIMD kernels: " << simd_level_name(simd.level)
+              << " (" << (sizeof(real) == 4 ? "float" : "double") << ")\n";
+}
+
+
+#endif
@@ -13,15 +13,25 @@
 
 #include "rtweekend.h"
 
+#include "aabb.h"
+#include "bc1.h"
 #include "perlin.h"
 #include "rtw_stb_image.h"
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 
 
 class texture  {
     public:
         virtual color value(double u, double v, const vec3& p) const = 0;
+
+        // value() averaged over a footprint `width` wide in (u,v). Textures that do not
+        // filter return the point sample.
+        virtual color filtered_value(double u, double v, const vec3& p, double width) const {
+            return value(u, v, p);
+        }
 };
 
 
@@ -74,12 +84,62 @@ class noise_texture : public texture {
         virtual color value(double u, double v, const vec3& p) const override {
             // return color(1,1,1)*0.5*(1 + noise.turb(scale * p));
             // return color(1,1,1)*noise.turb(scale * p);
-            return color(1,1,1)*0.5*(1 + sin(scale*p.z() + 10*noise.turb(p)));
+            return color(1,1,1)*0.5*(1 + sin(scale*p.z() + 10*turbulence(p)));
+        }
+
+        // Samples noise.turb() at the corners of a resolution^3 grid of cells over `bounds`.
+        // Lookups inside the box then interpolate the grid, which is far cheaper but loses
+        // detail finer than a cell; lookups outside it still evaluate the noise.
+        void bake(const aabb& bounds, int resolution) {
+            baked_bounds = bounds;
+            baked_resolution = resolution;
+            int n = resolution + 1;
+            baked.resize(static_cast<size_t>(n) * n * n);
+            vec3 cell = (bounds.max() - bounds.min()) / resolution;
+            for (int k = 0; k < n; k++)
+                for (int j = 0; j < n; j++)
+                    for (int i = 0; i < n; i++)
+                        baked[(static_cast<size_t>(k) * n + j) * n + i] = static_cast<float>(
+                            noise.turb(bounds.min() + vec3(i*cell.x(), j*cell.y(), k*cell.z())));
         }
 
+        size_t baked_bytes() const { return baked.size() * sizeof(float); }
+
     public:
         perlin noise;
         double scale;
+
+    private:
+        double turbulence(const point3& p) const {
+            if (baked.empty())
+                return noise.turb(p);
+
+            int n = baked_resolution + 1;
+            double g[3];
+            int c[3];
+            for (int a = 0; a < 3; a++) {
+                double extent = baked_bounds.max()[a] - baked_bounds.min()[a];
+                g[a] = (p[a] - baked_bounds.min()[a]) / extent * baked_resolution;
+                if (!(g[a] >= 0 && g[a] <= baked_resolution))
+                    return noise.turb(p);
+                c[a] = std::min(static_cast<int>(g[a]), baked_resolution - 1);
+                g[a] -= c[a];
+            }
+
+            const float* corner = &baked[(static_cast<size_t>(c[2]) * n + c[1]) * n + c[0]];
+            size_t dy = n, dz = static_cast<size_t>(n) * n;
+            double x00 = corner[0]       + g[0] * (corner[1]       - corner[0]);
+            double x10 = corner[dy]      + g[0] * (corner[dy+1]    - corner[dy]);
+            double x01 = corner[dz]      + g[0] * (corner[dz+1]    - corner[dz]);
+            double x11 = corner[dz+dy]   + g[0] * (corner[dz+dy+1] - corner[dz+dy]);
+            double y0 = x00 + g[1] * (x10 - x00);
+            double y1 = x01 + g[1] * (x11 - x01);
+            return y0 + g[2] * (y1 - y0);
+        }
+
+        std::vector<float> baked;  // (resolution + 1)^3 samples, x fastest; empty if not baked
+        aabb baked_bounds;
+        int baked_resolution = 0;
 };
 
 
@@ -90,9 +150,22 @@ class image_texture : public texture {
         image_texture()
           : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
 
-        image_texture(const char* filename) {
+        image_texture(const char* filename)
+          : data(nullptr), width(0), height(0), bytes_per_scanline(0) {
+            load(filename);
+        }
+
+        ~image_texture() {
+            STBI_FREE(data);
+        }
+
+        // Decodes `filename`, replacing any image already held. Safe to call for different
+        // textures from different threads.
+        bool load(const char* filename) {
             auto components_per_pixel = bytes_per_pixel;
 
+            STBI_FREE(data);
+            blocks.clear();
             data = stbi_load(
                 filename, &width, &height, &components_per_pixel, components_per_pixel);
 
@@ -102,15 +175,46 @@ class image_texture : public texture {
             }
 
             bytes_per_scanline = bytes_per_pixel * width;
+            return data != nullptr;
         }
 
-        ~image_texture() {
+        // Re-encodes the image as BC1 blocks and frees the RGB8 pixels: a sixth of the memory,
+        // at the cost of a lossy encode and a small decode per lookup.
+        void compress() {
+            if (data == nullptr)
+                return;
+            blocks_x = (width + 3) / 4;
+            blocks.resize(static_cast<size_t>(blocks_x) * ((height + 3) / 4) * bc1_block_bytes);
+            bc1_encode_image(data, width, height, blocks.data());
             STBI_FREE(data);
+            data = nullptr;
+        }
+
+        bool compressed() const { return !blocks.empty(); }
+        int image_width() const { return width; }
+        int image_height() const { return height; }
+
+        size_t size_in_bytes() const {
+            return compressed() ? blocks.size() : static_cast<size_t>(bytes_per_scanline) * height;
+        }
+
+        // RGB8 of pixel (i, j), counted from the top-left corner.
+        void read_texel(int i, int j, unsigned char rgb[3]) const {
+            if (compressed()) {
+                auto block = blocks.data() + (static_cast<size_t>(j / 4) * blocks_x + i / 4)
+                                             * bc1_block_bytes;
+                bc1_decode_texel(block, i % 4, j % 4, rgb);
+            } else {
+                auto pixel = data + j*bytes_per_scanline + i*bytes_per_pixel;
+                rgb[0] = pixel[0];
+                rgb[1] = pixel[1];
+                rgb[2] = pixel[2];
+            }
         }
 
         virtual color value(double u, double v, const vec3& p) const override {
             // If we have no texture data, then return solid cyan as a debugging aid.
-            if (data == nullptr)
+            if (data == nullptr && !compressed())
                 return color(0,1,1);
 
             // Clamp input texture coordinates to [0,1] x [1,0]
@@ -125,7 +229,8 @@ class image_texture : public texture {
             if (j >= height) j = height-1;
 
             const auto color_scale = 1.0 / 255.0;
-            auto pixel = data + j*bytes_per_scanline + i*bytes_per_pixel;
+            unsigned char pixel[3];
+            read_texel(i, j, pixel);
 
             return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
         }
@@ -134,6 +239,8 @@ class image_texture : public texture {
         unsigned char *data;
         int width, height;
         int bytes_per_scanline;
+        std::vector<unsigned char> blocks;  // BC1 blocks once compressed, row-major
+        int blocks_x;
 };
 
 
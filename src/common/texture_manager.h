@@ -0,0 +1,186 @@
+#ifndef TEXTURE_MANAGER_H
+#define TEXTURE_MANAGER_H
+//==============================================================================================
+// Image textures shared by path and decoded together.
+//
+// get() hands out one image_texture per path, however often the path is asked for, so the
+// image is decoded and held in memory once. Decoding is deferred: the textures stay empty
+// (and render as the cyan debug color) until load_all() decodes every pending image, one
+// image per worker thread at a time.
+//
+// get_mipmapped() wraps the same shared image in a mip_texture, whose filtered tiles are
+// built lazily during rendering.
+//
+// With compression on, each image is re-encoded as BC1 blocks by the worker that decoded it,
+// trading a lossy encode for a sixth of the memory.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "mip_texture.h"
+#include "texture.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+
+class texture_manager {
+    public:
+        texture_manager() : compress(false) {}
+
+        // Applies to images loaded by later calls to load_all().
+        void set_compression(bool on) { compress = on; }
+
+        shared_ptr<image_texture> get(const std::string& path);
+        shared_ptr<mip_texture> get_mipmapped(const std::string& path);
+
+        // Decodes every image not loaded yet, using up to `nthreads` threads (one per online
+        // CPU by default). Returns the number of images that failed to load.
+        int load_all(int nthreads = 0);
+
+        // One line per texture: size, decoded bytes and how many times get() or
+        // get_mipmapped() handed it out, plus how much of the mip pyramid has been built so
+        // far.
+        void report(std::ostream& out) const;
+
+        size_t size_in_bytes() const;
+
+    private:
+        struct entry {
+            shared_ptr<image_texture> tex;
+            shared_ptr<mip_texture> mip;
+            bool loaded;
+            int requests = 0;
+        };
+
+        struct load_job {
+            std::vector<entry*> pending;
+            std::vector<std::string> paths;
+            std::atomic<size_t> next;
+            std::atomic<int> failed;
+            bool compress;
+        };
+
+        static void* load_thread(void* arg);
+
+        entry& find(const std::string& path);
+
+        std::map<std::string, entry> textures;
+        bool compress;
+};
+
+
+texture_manager::entry& texture_manager::find(const std::string& path) {
+    auto& e = textures[path];
+    if (!e.tex) {
+        e.tex = make_shared<image_texture>();
+        e.loaded = false;
+    }
+    e.requests++;
+    return e;
+}
+
+
+shared_ptr<image_texture> texture_manager::get(const std::string& path) {
+    return find(path).tex;
+}
+
+
+shared_ptr<mip_texture> texture_manager::get_mipmapped(const std::string& path) {
+    auto& e = find(path);
+    if (!e.mip)
+        e.mip = make_shared<mip_texture>(e.tex);
+    return e.mip;
+}
+
+
+void* texture_manager::load_thread(void* arg) {
+    auto& job = *static_cast<load_job*>(arg);
+    while (true) {
+        size_t i = job.next++;
+        if (i >= job.pending.size())
+            break;
+        auto& tex = *job.pending[i]->tex;
+        if (!tex.load(job.paths[i].c_str()))
+            job.failed++;
+        else if (job.compress)
+            tex.compress();
+    }
+    return NULL;
+}
+
+
+int texture_manager::load_all(int nthreads) {
+    load_job job;
+    job.next = 0;
+    job.failed = 0;
+    job.compress = compress;
+    for (auto& kv : textures) {
+        if (!kv.second.loaded) {
+            job.pending.push_back(&kv.second);
+            job.paths.push_back(kv.first);
+        }
+    }
+    if (job.pending.empty())
+        return 0;
+
+    if (nthreads <= 0)
+        nthreads = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    if (nthreads > static_cast<int>(job.pending.size()))
+        nthreads = static_cast<int>(job.pending.size());
+
+    // The calling thread is one of the workers.
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<char> started(nthreads, 0);
+    for (int i = 1; i < nthreads; i++)
+        started[i] = pthread_create(&threads[i], NULL, load_thread, &job) == 0;
+    load_thread(&job);
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    for (auto e : job.pending) {
+        e->loaded = true;
+        if (e->mip)
+            e->mip->build_levels();
+    }
+    return job.failed;
+}
+
+
+size_t texture_manager::size_in_bytes() const {
+    size_t total = 0;
+    for (const auto& kv : textures)
+        total += kv.second.tex->size_in_bytes();
+    return total;
+}
+
+
+void texture_manager::report(std::ostream& out) const {
+    for (const auto& kv : textures) {
+        const auto& e = kv.second;
+        const auto& tex = *e.tex;
+        out << std::setw(5) << tex.image_width() << 'x' << std::setw(5) << std::left
+            << tex.image_height() << std::right << std::setw(8)
+            << (tex.size_in_bytes() + 1023) / 1024 << " KB " << (tex.compressed() ? "BC1" : "RGB")
+            << "  x" << e.requests << "  " << kv.first;
+        if (e.mip)
+            out << "  (mip: " << e.mip->level_count() << " levels, "
+                << (e.mip->resident_bytes() + 1023) / 1024 << " of "
+                << (e.mip->full_bytes() + 1023) / 1024 << " KB built)";
+        out << '\n';
+    }
+    out << "Textures: " << textures.size() << " images, "
+        << (size_in_bytes() + 1023) / 1024 << " KB in memory.\n";
+}
+
+
+#endif
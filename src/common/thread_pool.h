@@ -0,0 +1,116 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+//==============================================================================================
+// A fixed set of pthreads that stay parked between jobs, for callers that run many short
+// parallel loops (a render server's passes) and should not pay for thread creation each time.
+//
+// parallel_for() hands out the indices of one loop through an atomic counter; the calling
+// thread works along with the pool and returns once every index is done. One loop runs at a
+// time.
+//==============================================================================================
+
+#include <pthread.h>
+
+#include <atomic>
+#include <vector>
+
+
+class thread_pool {
+    public:
+        typedef void (*task_fn)(int index, void* context);
+
+        // `nthreads` counts the caller, so the pool itself starts nthreads - 1 threads.
+        explicit thread_pool(int nthreads) : stopping(false), generation(0), busy(0) {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&work_ready, NULL);
+            pthread_cond_init(&work_done, NULL);
+            for (int i = 1; i < nthreads; i++) {
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, worker, this) == 0)
+                    threads.push_back(thread);
+            }
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        ~thread_pool() {
+            pthread_mutex_lock(&mutex);
+            stopping = true;
+            pthread_cond_broadcast(&work_ready);
+            pthread_mutex_unlock(&mutex);
+            for (auto thread : threads)
+                pthread_join(thread, NULL);
+            pthread_cond_destroy(&work_done);
+            pthread_cond_destroy(&work_ready);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        int size() const { return static_cast<int>(threads.size()) + 1; }
+
+        void parallel_for(int count, task_fn fn, void* context) {
+            pthread_mutex_lock(&mutex);
+            task = fn;
+            task_context = context;
+            task_count = count;
+            next = 0;
+            busy = static_cast<int>(threads.size());
+            generation++;
+            pthread_cond_broadcast(&work_ready);
+            pthread_mutex_unlock(&mutex);
+
+            run_tasks();
+
+            pthread_mutex_lock(&mutex);
+            while (busy > 0)
+                pthread_cond_wait(&work_done, &mutex);
+            pthread_mutex_unlock(&mutex);
+        }
+
+    private:
+        static void* worker(void* arg) {
+            auto& pool = *static_cast<thread_pool*>(arg);
+            long seen = 0;
+            while (true) {
+                pthread_mutex_lock(&pool.mutex);
+                while (!pool.stopping && pool.generation == seen)
+                    pthread_cond_wait(&pool.work_ready, &pool.mutex);
+                if (pool.stopping) {
+                    pthread_mutex_unlock(&pool.mutex);
+                    return NULL;
+                }
+                seen = pool.generation;
+                pthread_mutex_unlock(&pool.mutex);
+
+                pool.run_tasks();
+
+                pthread_mutex_lock(&pool.mutex);
+                if (--pool.busy == 0)
+                    pthread_cond_signal(&pool.work_done);
+                pthread_mutex_unlock(&pool.mutex);
+            }
+        }
+
+        void run_tasks() {
+            while (true) {
+                int i = next++;
+                if (i >= task_count)
+                    break;
+                task(i, task_context);
+            }
+        }
+
+        std::vector<pthread_t> threads;
+        pthread_mutex_t mutex;
+        pthread_cond_t work_ready, work_done;
+        bool stopping;
+        long generation;            // bumped for every loop
+        int busy;                   // pool threads still in the current loop
+        task_fn task;
+        void* task_context;
+        int task_count;
+        std::atomic<int> next;
+};
+
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef TILED_RENDER_H
+#define TILED_RENDER_H
+//==============================================================================================
+// Out-of-core rendering for images too large for a render_buffers (52 bytes a pixel, so 52 GB
+// for a gigapixel poster).
+//
+// The image is cut into tile_size squares, and each pool thread renders one tile at a time to
+// its full sample count in a tile-sized render_buffers, resolves and denoises it there, and
+// writes the result straight to its place in the output file through an image_stream. Memory
+// then grows with the tile size and thread count, not with the image: nothing but the open
+// file ever holds the whole image.
+//
+// The denoiser looks up to 2 * (2^iterations - 1) pixels away (30 with the default four
+// passes), so a denoised tile is rendered with an apron that wide around it, then cropped.
+// Apron pixels are rendered again by the neighbouring tile, which costs about half as much
+// again at 256-pixel tiles; larger tiles waste less. Unlike a progressive render there are no
+// checkpoints or snapshots, and tiles are only written once they are done.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "denoise.h"
+#include "image_output.h"
+#include "render_buffers.h"
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+
+// Peak resident set size of the process so far, in bytes.
+inline size_t peak_rss_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;    // kilobytes on Linux
+}
+
+
+struct tiled_settings {
+    int tile_size = 256;
+    int samples = 256;      // per pixel
+    bool denoise = true;
+};
+
+
+class tiled_render {
+    public:
+        // Same as render_server::pixel_fn: adds `samples` samples of pixel (x, y) of an
+        // image_width x image_height image seen through `cam` to `out` at (out_x, out_y).
+        typedef void (*pixel_fn)(void* context, const camera& cam, int image_width,
+                                 int image_height, int x, int y, int samples,
+                                 render_buffers& out, int out_x, int out_y);
+
+        tiled_render(const tiled_settings& settings, pixel_fn render_pixel, void* context,
+                     int nthreads)
+            : settings(settings), render_pixel(render_pixel), context(context),
+              pool(nthreads) {
+            pthread_mutex_init(&print_mutex, NULL);
+        }
+
+        ~tiled_render() { pthread_mutex_destroy(&print_mutex); }
+
+        // Renders the image_width x image_height image seen through `cam` into `out`, which
+        // must be open at that size, top tiles first. Returns false if a tile could not be
+        // written.
+        bool run(const camera& cam, int image_width, int image_height, image_stream& out);
+
+    private:
+        static void render_tile(int tile, void* arg);
+
+        tiled_settings settings;
+        pixel_fn render_pixel;
+        void* context;
+        thread_pool pool;
+        pthread_mutex_t print_mutex;
+
+        // Of the image being rendered.
+        const camera* cam;
+        image_stream* out;
+        int width, height, tiles_x, tiles, apron;
+        std::atomic<int> done;
+        std::atomic<bool> failed;
+        std::chrono::steady_clock::time_point start;
+};
+
+
+bool tiled_render::run(const camera& image_cam, int image_width, int image_height,
+                       image_stream& image_out) {
+    cam = &image_cam;
+    out = &image_out;
+    width = image_width;
+    height = image_height;
+    tiles_x = (width + settings.tile_size - 1) / settings.tile_size;
+    tiles = tiles_x * ((height + settings.tile_size - 1) / settings.tile_size);
+    apron = settings.denoise ? atrous_denoiser().radius() : 0;
+    done = 0;
+    failed = false;
+    start = std::chrono::steady_clock::now();
+    pool.parallel_for(tiles, render_tile, this);
+    std::cerr << '\n';
+    return !failed;
+}
+
+
+void tiled_render::render_tile(int tile, void* arg) {
+    auto& self = *static_cast<tiled_render*>(arg);
+    int size = self.settings.tile_size;
+    int tiles_y = self.tiles / self.tiles_x;
+    int x0 = (tile % self.tiles_x) * size;
+    int y0 = (tiles_y - 1 - tile / self.tiles_x) * size;
+    int x1 = std::min(x0 + size, self.width), y1 = std::min(y0 + size, self.height);
+
+    // The tile and its apron, cut back at the image's edges.
+    int ax0 = std::max(x0 - self.apron, 0), ay0 = std::max(y0 - self.apron, 0);
+    int ax1 = std::min(x1 + self.apron, self.width);
+    int ay1 = std::min(y1 + self.apron, self.height);
+    render_buffers frame(ax1 - ax0, ay1 - ay0);
+    for (int y = ay0; y < ay1; y++)
+        for (int x = ax0; x < ax1; x++)
+            self.render_pixel(self.context, *self.cam, self.width, self.height, x, y,
+                              self.settings.samples, frame, x - ax0, y - ay0);
+    frame.resolve();
+
+    const std::vector<float>* image = frame.radiance;
+    std::vector<float> denoised[3];
+    if (self.settings.denoise) {
+        // Tiles already keep every thread busy.
+        atrous_denoiser denoiser;
+        denoiser.nthreads = 1;
+        denoiser.run(frame, denoised);
+        image = denoised;
+    }
+
+    std::vector<float> rgb(3 * (x1 - x0));
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            size_t i = frame.index(x - ax0, y - ay0);
+            for (int k = 0; k < 3; k++)
+                rgb[3 * (x - x0) + k] = image[k][i];
+        }
+        if (!self.out->write_span(y, x0, x1 - x0, rgb.data()))
+            self.failed = true;
+    }
+
+    int finished = ++self.done;
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - self.start)
+                   .count();
+    pthread_mutex_lock(&self.print_mutex);
+    std::cerr << "\r Tile " << finished << " of " << self.tiles << " in " << t << " s, peak "
+              << peak_rss_bytes() / (1 << 20) << " MB   " << std::flush;
+    pthread_mutex_unlock(&self.print_mutex);
+}
+
+
+#endif
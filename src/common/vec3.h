@@ -17,120 +17,140 @@
 using std::sqrt;
 using std::fabs;
 
-class vec3 {
+
+// Scalar type used for geometry storage and intersection math. Building with RT_USE_FLOAT
+// halves the size of vectors, rays and bounding boxes; colour accumulation stays in double.
+#ifdef RT_USE_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+
+template <typename T>
+class vec3_t {
     public:
-        vec3() : e{0,0,0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        vec3_t() : e{0,0,0} {}
+        vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
+
+        template <typename U>
+        explicit vec3_t(const vec3_t<U>& v) : e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
 
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
+        T operator[](int i) const { return e[i]; }
+        T& operator[](int i) { return e[i]; }
 
-        vec3& operator=(const vec3 &v) {
+        vec3_t& operator=(const vec3_t &v) {
             e[0] = v.e[0]; 
             e[1] = v.e[1]; 
             e[2] = v.e[2]; 
             return *this;
         }
 
-        vec3& operator+=(const vec3 &v) {
+        vec3_t& operator+=(const vec3_t &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
             return *this;
         }
 
-        vec3& operator*=(const double t) {
+        vec3_t& operator*=(const T t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vec3& operator/=(const double t) {
+        vec3_t& operator/=(const T t) {
             return *this *= 1/t;
         }
 
-        double length() const {
-            return sqrt(length_squared());
+        T length() const {
+            return std::sqrt(length_squared());
         }
 
-        double length_squared() const {
+        T length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
         bool near_zero() const {
             // Return true if the vector is close to zero in all dimensions.
             const auto s = 1e-8;
-            return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
+            return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
         }
 
-        inline static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        inline static vec3_t random() {
+            return vec3_t(random_double(), random_double(), random_double());
         }
 
-        inline static vec3 random(double min, double max) {
-            return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+        inline static vec3_t random(double min, double max) {
+            return vec3_t(random_double(min,max), random_double(min,max), random_double(min,max));
         }
 
-    public:
-        double e[3];
-};
+        // The arithmetic operators are hidden friends rather than free templates so that a
+        // double scalar still multiplies a float vector (and vice versa) without casts.
 
+        friend vec3_t operator+(const vec3_t &u, const vec3_t &v) {
+            return vec3_t(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+        }
 
-// Type aliases for vec3
-using point3 = vec3;   // 3D point
-using color = vec3;    // RGB color
+        friend vec3_t operator-(const vec3_t &u, const vec3_t &v) {
+            return vec3_t(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+        }
 
+        friend vec3_t operator*(const vec3_t &u, const vec3_t &v) {
+            return vec3_t(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+        }
 
-// vec3 Utility Functions
+        friend vec3_t operator*(T t, const vec3_t &v) {
+            return vec3_t(t*v.e[0], t*v.e[1], t*v.e[2]);
+        }
 
-inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
-    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
-}
+        friend vec3_t operator*(const vec3_t &v, T t) {
+            return t * v;
+        }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
-}
+        friend vec3_t operator/(const vec3_t &v, T t) {
+            return (1/t) * v;
+        }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
-}
+        friend T dot(const vec3_t &u, const vec3_t &v) {
+            return u.e[0] * v.e[0]
+                 + u.e[1] * v.e[1]
+                 + u.e[2] * v.e[2];
+        }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
-}
+        friend vec3_t cross(const vec3_t &u, const vec3_t &v) {
+            return vec3_t(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                          u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                          u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+        }
 
-inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
-}
+        friend vec3_t unit_vector(const vec3_t &v) {
+            return v / v.length();
+        }
 
-inline vec3 operator*(const vec3 &v, double t) {
-    return t * v;
-}
+    public:
+        T e[3];
+};
 
-inline vec3 operator/(vec3 v, double t) {
-    return (1/t) * v;
-}
 
-inline double dot(const vec3 &u, const vec3 &v) {
-    return u.e[0] * v.e[0]
-         + u.e[1] * v.e[1]
-         + u.e[2] * v.e[2];
-}
+// Type aliases for vec3
+using vec3 = vec3_t<real>;
+using point3 = vec3;   // 3D point
+using color = vec3;    // RGB color
+using color_accum = vec3_t<double>;   // per-pixel radiance sums, always double
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
-}
 
-inline vec3 unit_vector(vec3 v) {
-    return v / v.length();
+// vec3 Utility Functions
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream &out, const vec3_t<T> &v) {
+    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
 inline vec3 random_in_unit_disk() {
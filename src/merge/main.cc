@@ -0,0 +1,90 @@
+//==============================================================================================
+// Merges render checkpoints of the same image into one: renders run separately (with
+// different seeds) add up to a higher sample count, and the ranks of a distributed render,
+// each holding its own tiles, to the full image. The result is itself a checkpoint, which
+// RayTracePlanes can resume; with --image the merged, denoised image is written as well.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "checkpoint.h"
+#include "denoise.h"
+#include "image_output.h"
+#include "progressive.h"
+#include "render_buffers.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+  std::string output, image_path;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--image") && i + 1 < argc)
+      image_path = argv[++i];
+    else if (output.empty())
+      output = argv[i];
+    else
+      inputs.push_back(argv[i]);
+  }
+  if (inputs.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--image merged.ppm] merged.ckpt input.ckpt...\n";
+    return 1;
+  }
+
+  render_buffers merged(1, 1);
+  checkpoint_info merged_info;
+  std::set<uint32_t> seeds;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    render_buffers frame(1, 1);
+    checkpoint_info info;
+    if (!read_checkpoint(inputs[i], frame, info)) {
+      std::cerr << "Could not read " << inputs[i] << ".\n";
+      return 1;
+    }
+    if (!seeds.insert(info.seed).second)
+      std::cerr << "Warning: " << inputs[i] << " was started with seed "
+                << info.seed << " like an earlier input; its samples may "
+                << "repeat those.\n";
+
+    if (i == 0) {
+      merged = frame;
+      merged_info = info;
+    } else if (!merged.merge(frame)) {
+      std::cerr << inputs[i] << " is " << frame.width << 'x' << frame.height
+                << ", not " << merged.width << 'x' << merged.height << ".\n";
+      return 1;
+    } else {
+      merged_info.rng_state ^= info.rng_state;
+      merged_info.passes += info.passes;
+    }
+    std::cerr << inputs[i] << ": "
+              << *std::min_element(frame.samples.begin(), frame.samples.end())
+              << " spp\n";
+  }
+
+  if (!write_checkpoint(output, merged, merged_info)) {
+    std::cerr << "Could not write " << output << ".\n";
+    return 1;
+  }
+  std::cerr << output << ": "
+            << *std::min_element(merged.samples.begin(), merged.samples.end())
+            << " spp\n";
+
+  if (!image_path.empty()) {
+    merged.resolve();
+    std::vector<float> denoised[3];
+    atrous_denoiser().run(merged, denoised);
+    if (!write_image(image_path, image_format_for(image_path), merged.width,
+                     merged.height, denoised)) {
+      std::cerr << "Could not write " << image_path << ".\n";
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -24,7 +24,15 @@ class xy_rect : public hittable {
             double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat
         ) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -35,7 +43,8 @@ class xy_rect : public hittable {
 
     public:
         shared_ptr<material> mp;
-        double x0, x1, y0, y1, k;
+        int mat_slot = -1;      // see compiled_scene::add_materials()
+        real x0, x1, y0, y1, k;
 };
 
 class xz_rect : public hittable {
@@ -48,7 +57,15 @@ class xz_rect : public hittable {
             _area = (x1-x0)*(z1-z0);
         };
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -79,7 +96,8 @@ class xz_rect : public hittable {
 
     public:
         shared_ptr<material> mp;
-        double x0, x1, z0, z1, k;
+        int mat_slot = -1;      // see compiled_scene::add_materials()
+        real x0, x1, z0, z1, k;
         double _area;
 };
 
@@ -91,7 +109,15 @@ class yz_rect : public hittable {
             double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat
         ) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
@@ -102,10 +128,11 @@ class yz_rect : public hittable {
 
     public:
         shared_ptr<material> mp;
-        double y0, y1, z0, z1, k;
+        int mat_slot = -1;      // see compiled_scene::add_materials()
+        real y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xy_rect::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
     auto t = (k-r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max)
         return false;
@@ -115,18 +142,25 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
 
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (y-y0)/(y1-y0);
-    rec.t = t;
+    h.t = t;
+    h.object = this;
+    return true;
+}
+
+void xy_rect::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x()-x0)/(x1-x0);
+    rec.v = (rec.p.y()-y0)/(y1-y0);
+    rec.uv_extent = sqrt((x1-x0)*(y1-y0));
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.mat_slot = mat_slot;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xz_rect::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
     auto t = (k-r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -136,18 +170,25 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
 
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    h.t = t;
+    h.object = this;
+    return true;
+}
+
+void xz_rect::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x()-x0)/(x1-x0);
+    rec.v = (rec.p.z()-z0)/(z1-z0);
+    rec.uv_extent = sqrt((x1-x0)*(z1-z0));
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.mat_slot = mat_slot;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool yz_rect::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
     auto t = (k-r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -157,15 +198,22 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
 
-    rec.u = (y-y0)/(y1-y0);
-    rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    h.t = t;
+    h.object = this;
+    return true;
+}
+
+void yz_rect::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.y()-y0)/(y1-y0);
+    rec.v = (rec.p.z()-z0)/(z1-z0);
+    rec.uv_extent = sqrt((y1-y0)*(z1-z0));
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.mat_slot = mat_slot;
 }
 
 #endif
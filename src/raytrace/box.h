@@ -13,16 +13,36 @@
 
 #include "rtweekend.h"
 
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
 
+#include <utility>
 
+
+// Faces of a box: the face at the minimum and at the maximum of each axis.
+enum box_face { box_x0, box_x1, box_y0, box_y1, box_z0, box_z1 };
+
+
+// An axis-aligned box intersected with a single slab test. The face normal comes from the
+// axis the ray enters (or, from inside, leaves) through, and always points out of the box.
+// Each face has its own material, and its (u,v) run over [0,1] in the same directions as
+// the matching xy_rect, xz_rect or yz_rect.
 class box : public hittable  {
     public:
         box() {}
         box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        // face_ptrs is indexed by box_face.
+        box(const point3& p0, const point3& p1, const shared_ptr<material> face_ptrs[6]);
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
@@ -32,26 +52,76 @@ class box : public hittable  {
     public:
         point3 box_min;
         point3 box_max;
-        hittable_list sides;
+        shared_ptr<material> face_mat[6];
+        int face_slot[6] = {-1, -1, -1, -1, -1, -1};    // see compiled_scene::add_materials()
 };
 
 
 box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
     box_min = p0;
     box_max = p1;
+    for (int f = 0; f < 6; f++)
+        face_mat[f] = ptr;
+}
+
+box::box(const point3& p0, const point3& p1, const shared_ptr<material> face_ptrs[6]) {
+    box_min = p0;
+    box_max = p1;
+    for (int f = 0; f < 6; f++)
+        face_mat[f] = face_ptrs[f];
+}
 
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+bool box::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
+    real t_near = -infinity, t_far = infinity;
+    int near_axis = 0, far_axis = 0;
+    for (int a = 0; a < 3; a++) {
+        auto inv_d = 1 / r.direction()[a];
+        auto t0 = (box_min[a] - r.origin()[a]) * inv_d;
+        auto t1 = (box_max[a] - r.origin()[a]) * inv_d;
+        if (inv_d < 0)
+            std::swap(t0, t1);
+        if (t0 > t_near) {
+            t_near = t0;
+            near_axis = a;
+        }
+        if (t1 < t_far) {
+            t_far = t1;
+            far_axis = a;
+        }
+    }
+    if (t_near > t_far)
+        return false;
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    // Rays starting inside the box (or too close to the entry face) hit the exit face.
+    bool entering = t_min <= t_near && t_near <= t_max;
+    if (!entering && (t_far < t_min || t_max < t_far))
+        return false;
+    int axis = entering ? near_axis : far_axis;
+    bool max_side = entering ? r.direction()[axis] < 0 : r.direction()[axis] > 0;
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    h.t = entering ? t_near : t_far;
+    h.object = this;
+    h.prim = 2*axis + max_side;
+    return true;
 }
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+void box::compute_surface_interaction(const ray& r, const surface_hit& h, hit_record& rec) const {
+    int axis = h.prim / 2;
+    bool max_side = h.prim % 2;
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = max_side ? 1 : -1;
+    rec.set_face_normal(r, outward_normal);
+
+    int u_axis = axis == 0 ? 1 : 0;
+    int v_axis = axis == 2 ? 1 : 2;
+    rec.u = (rec.p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+    rec.v = (rec.p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+    rec.uv_extent = sqrt((box_max[u_axis] - box_min[u_axis]) * (box_max[v_axis] - box_min[v_axis]));
+    rec.mat_ptr = face_mat[h.prim];
+    rec.mat_slot = face_slot[h.prim];
 }
 
 
@@ -29,6 +29,8 @@ public:
   bvh_node(const std::vector<shared_ptr<hittable>> &src_objects, size_t start,
            size_t end, double time0, double time1);
 
+  virtual bool intersect(const ray &r, double t_min, double t_max,
+                         surface_hit &h) const override;
   virtual bool hit(const ray &r, double t_min, double t_max,
                    hit_record &rec) const override;
 
@@ -164,11 +166,16 @@ bvh_node::bvh_node(const std::vector<shared_ptr<hittable>> &src_objects,
 
 bool bvh_node::hit(const ray &r, double t_min, double t_max,
                    hit_record &rec) const {
+  return hit_deferred(r, t_min, t_max, rec);
+}
+
+bool bvh_node::intersect(const ray &r, double t_min, double t_max,
+                         surface_hit &h) const {
   if (!box.hit(r, t_min, t_max))
     return false;
 
-  bool hit_left = left->hit(r, t_min, t_max, rec);
-  bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+  bool hit_left = left->intersect(r, t_min, t_max, h);
+  bool hit_right = right->intersect(r, t_min, hit_left ? h.t : t_max, h);
 
   return hit_left || hit_right;
 }
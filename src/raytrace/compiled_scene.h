@@ -0,0 +1,318 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+//==============================================================================================
+// A scene compiled into per-type primitive arrays under one wide BVH.
+//
+// Spheres, rects, boxes and triangles are copied by value into one array per type, and each
+// BVH leaf lists (type, range) runs into those arrays. A run is intersected by a loop that
+// calls the concrete type's intersect() directly, so the leaf tests inline and the only
+// branch on the type is taken once per run rather than once per primitive.
+//
+// Anything else -- meshes, planes, sphere_sets, transforms, user-defined hittables, and
+// subclasses of the built-in types -- goes into the fallback slot and is reached through the
+// usual virtual call. hittable_lists and wide_bvhs are flattened into the scene.
+//
+// Moving spheres and moving instances are gathered into one motion_bvh, which bounds them at
+// the ray's time, and that goes into the fallback slot as a single primitive. In the outer
+// tree it keeps the box of the whole shutter interval.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "box.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material_table.h"
+#include "mesh.h"
+#include "motion_bvh.h"
+#include "moving_sphere.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "triangle.h"
+#include "wide_bvh.h"
+
+#include <typeinfo>
+#include <vector>
+
+
+enum primitive_type {
+    prim_sphere, prim_xy_rect, prim_xz_rect, prim_yz_rect, prim_box, prim_triangle,
+    prim_fallback, primitive_type_count
+};
+
+
+// Primitives [first, first + count) of the array for `type`.
+struct primitive_run {
+    int type;
+    int first;
+    int count;
+};
+
+
+class compiled_scene : public hittable {
+    public:
+        compiled_scene() {}
+
+        compiled_scene(const hittable_list& list, double time0, double time1)
+            : compiled_scene(list.objects, time0, time1) {}
+
+        compiled_scene(const std::vector<shared_ptr<hittable>>& src_objects,
+                       double time0, double time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = tree.bounds;
+            return !tree.empty();
+        }
+
+        // Adds the materials of the scene's primitives to `table` and stores their slots on
+        // the primitives, which copy them into hit_record::mat_slot. Fallback hittables are
+        // only looked into when they are meshes, sphere_sets or moving spheres, placed by
+        // an instance or not; the table looks up the slots of the others.
+        void add_materials(material_table& table);
+
+    public:
+        std::vector<sphere> spheres;
+        std::vector<xy_rect> xy_rects;
+        std::vector<xz_rect> xz_rects;
+        std::vector<yz_rect> yz_rects;
+        std::vector<box> boxes;
+        std::vector<triangle> triangles;
+        std::vector<shared_ptr<hittable>> fallback;
+
+        // Leaf lanes of the tree hold the index of their first run and the number of runs.
+        wide_bvh_tree tree;
+        std::vector<primitive_run> runs;
+
+    private:
+        static void flatten(const shared_ptr<hittable>& p, std::vector<shared_ptr<hittable>>& out);
+        static int type_of(const hittable& object);
+
+        int append(int type, const shared_ptr<hittable>& p);
+        bool intersect_run(
+            const primitive_run& run, const ray& r, double t_min, double& closest,
+            surface_hit& h) const;
+};
+
+
+void compiled_scene::flatten(
+    const shared_ptr<hittable>& p, std::vector<shared_ptr<hittable>>& out
+) {
+    const auto& type = typeid(*p);
+    if (type == typeid(hittable_list)) {
+        for (const auto& child : std::static_pointer_cast<hittable_list>(p)->objects)
+            flatten(child, out);
+    } else if (type == typeid(wide_bvh)) {
+        for (const auto& child : std::static_pointer_cast<wide_bvh>(p)->objects)
+            flatten(child, out);
+    } else {
+        out.push_back(p);
+    }
+}
+
+
+// Exact type matches only, so a subclass that overrides intersect() keeps its behavior.
+int compiled_scene::type_of(const hittable& object) {
+    const auto& type = typeid(object);
+    if (type == typeid(sphere))   return prim_sphere;
+    if (type == typeid(xy_rect))  return prim_xy_rect;
+    if (type == typeid(xz_rect))  return prim_xz_rect;
+    if (type == typeid(yz_rect))  return prim_yz_rect;
+    if (type == typeid(box))      return prim_box;
+    if (type == typeid(triangle)) return prim_triangle;
+    return prim_fallback;
+}
+
+
+// Copies the primitive into the array for `type` and returns its index there.
+int compiled_scene::append(int type, const shared_ptr<hittable>& p) {
+    switch (type) {
+        case prim_sphere:
+            spheres.push_back(*std::static_pointer_cast<sphere>(p));
+            return static_cast<int>(spheres.size()) - 1;
+        case prim_xy_rect:
+            xy_rects.push_back(*std::static_pointer_cast<xy_rect>(p));
+            return static_cast<int>(xy_rects.size()) - 1;
+        case prim_xz_rect:
+            xz_rects.push_back(*std::static_pointer_cast<xz_rect>(p));
+            return static_cast<int>(xz_rects.size()) - 1;
+        case prim_yz_rect:
+            yz_rects.push_back(*std::static_pointer_cast<yz_rect>(p));
+            return static_cast<int>(yz_rects.size()) - 1;
+        case prim_box:
+            boxes.push_back(*std::static_pointer_cast<box>(p));
+            return static_cast<int>(boxes.size()) - 1;
+        case prim_triangle:
+            triangles.push_back(*std::static_pointer_cast<triangle>(p));
+            return static_cast<int>(triangles.size()) - 1;
+        default:
+            fallback.push_back(p);
+            return static_cast<int>(fallback.size()) - 1;
+    }
+}
+
+
+compiled_scene::compiled_scene(
+    const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1
+) {
+    std::vector<shared_ptr<hittable>> objects, moving;
+    for (const auto& p : src_objects)
+        flatten(p, objects);
+    size_t kept = 0;
+    for (const auto& p : objects) {
+        const auto& type = typeid(*p);
+        if (type == typeid(moving_sphere) || type == typeid(moving_instance))
+            moving.push_back(p);
+        else
+            objects[kept++] = p;
+    }
+    objects.resize(kept);
+    if (!moving.empty())
+        objects.push_back(make_shared<motion_bvh>(moving, time0, time1));
+
+    std::vector<aabb> prim_boxes(objects.size());
+    std::vector<int> types(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (!objects[i]->bounding_box(time0, time1, prim_boxes[i]))
+            std::cerr << "No bounding box in compiled_scene constructor.\n";
+        types[i] = type_of(*objects[i]);
+    }
+
+    tree.build(prim_boxes, 2);
+
+    // Fill the arrays leaf by leaf, grouping each leaf's primitives by type, so every leaf
+    // becomes a handful of contiguous runs.
+    for (auto& node : tree.nodes) {
+        for (int lane = 0; lane < simd_block_width; lane++) {
+            if (node.count[lane] == 0)
+                continue;
+            int first_slot = node.child[lane];
+            int slot_count = node.count[lane];
+            int first_run = static_cast<int>(runs.size());
+            for (int type = 0; type < primitive_type_count; type++) {
+                primitive_run run = {type, -1, 0};
+                for (int s = first_slot; s < first_slot + slot_count; s++) {
+                    int prim = tree.order[s];
+                    if (types[prim] != type)
+                        continue;
+                    int index = append(type, objects[prim]);
+                    if (run.count++ == 0)
+                        run.first = index;
+                }
+                if (run.count > 0)
+                    runs.push_back(run);
+            }
+            node.child[lane] = first_run;
+            node.count[lane] = static_cast<int>(runs.size()) - first_run;
+        }
+    }
+}
+
+
+void compiled_scene::add_materials(material_table& table) {
+    for (auto& s : spheres)
+        s.mat_slot = table.add(s.mat_ptr);
+    for (auto& rect : xy_rects)
+        rect.mat_slot = table.add(rect.mp);
+    for (auto& rect : xz_rects)
+        rect.mat_slot = table.add(rect.mp);
+    for (auto& rect : yz_rects)
+        rect.mat_slot = table.add(rect.mp);
+    for (auto& b : boxes)
+        for (int face = 0; face < 6; face++)
+            b.face_slot[face] = table.add(b.face_mat[face]);
+    for (auto& tri : triangles)
+        tri.mat_slot = table.add(tri.mp);
+    std::vector<shared_ptr<hittable>> objects = fallback;
+    for (const auto& p : fallback)
+        if (auto tree = std::dynamic_pointer_cast<motion_bvh>(p))
+            objects.insert(objects.end(), tree->objects.begin(), tree->objects.end());
+    for (const auto& p : objects) {
+        shared_ptr<hittable> placed = p;
+        if (auto i = std::dynamic_pointer_cast<instance>(p))
+            placed = i->ptr;
+        else if (auto i = std::dynamic_pointer_cast<moving_instance>(p))
+            placed = i->ptr;
+
+        if (auto set = std::dynamic_pointer_cast<sphere_set>(placed))
+            for (size_t i = 0; i < set->materials.size(); i++)
+                set->material_slots[i] = table.add(set->materials[i]);
+        else if (auto m = std::dynamic_pointer_cast<mesh>(placed))
+            m->mat_slot = table.add(m->mp);
+        else if (auto s = std::dynamic_pointer_cast<moving_sphere>(placed))
+            s->mat_slot = table.add(s->mat_ptr);
+    }
+}
+
+
+// Intersects prims[first, first + count) through the static type T, bypassing the vtable.
+template <typename T>
+inline bool intersect_primitives(
+    const std::vector<T>& prims, int first, int count, const ray& r, double t_min,
+    double& closest, surface_hit& h
+) {
+    bool hit_anything = false;
+    for (int i = first; i < first + count; i++) {
+        if (prims[i].T::intersect(r, t_min, closest, h)) {
+            hit_anything = true;
+            closest = h.t;
+        }
+    }
+    return hit_anything;
+}
+
+
+bool compiled_scene::intersect_run(
+    const primitive_run& run, const ray& r, double t_min, double& closest, surface_hit& h
+) const {
+    switch (run.type) {
+        case prim_sphere:
+            return intersect_primitives(spheres, run.first, run.count, r, t_min, closest, h);
+        case prim_xy_rect:
+            return intersect_primitives(xy_rects, run.first, run.count, r, t_min, closest, h);
+        case prim_xz_rect:
+            return intersect_primitives(xz_rects, run.first, run.count, r, t_min, closest, h);
+        case prim_yz_rect:
+            return intersect_primitives(yz_rects, run.first, run.count, r, t_min, closest, h);
+        case prim_box:
+            return intersect_primitives(boxes, run.first, run.count, r, t_min, closest, h);
+        case prim_triangle:
+            return intersect_primitives(triangles, run.first, run.count, r, t_min, closest, h);
+        default: {
+            bool hit_anything = false;
+            for (int i = run.first; i < run.first + run.count; i++) {
+                if (fallback[i]->intersect(r, t_min, closest, h)) {
+                    hit_anything = true;
+                    closest = h.t;
+                }
+            }
+            return hit_anything;
+        }
+    }
+}
+
+
+bool compiled_scene::intersect(
+    const ray& r, double t_min, double t_max, surface_hit& h
+) const {
+    return tree.traverse(r, t_min, t_max, [&](int first, int count, double& closest) {
+        bool hit_anything = false;
+        for (int i = first; i < first + count; i++) {
+            if (intersect_run(runs[i], r, t_min, closest, h))
+                hit_anything = true;
+        }
+        return hit_anything;
+    });
+}
+
+
+#endif
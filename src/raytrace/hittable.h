@@ -23,15 +23,40 @@ struct hit_record {
     point3 p;
     vec3 normal;
     shared_ptr<material> mat_ptr;
+    int mat_slot = -1;     // mat_ptr's slot in the scene's material_table, or -1 if not known
     double t;
     double u;
     double v;
     bool front_face;
+    double uv_extent = 0;  // world-space size of a unit step in (u,v) at p; 0 if unknown
+    double uv_width = 0;   // width of the ray's footprint in (u,v); 0 samples the finest level
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal :-outward_normal;
     }
+
+    // Projects a ray cone `width` wide at p onto the surface, in (u,v) units. The projected
+    // footprint is an ellipse stretched by 1/cos; this is the side of a square of the same
+    // area, which blurs less at grazing angles than the long axis would.
+    inline void set_footprint(const ray& r, double width) {
+        auto cosine = fabs(dot(unit_vector(r.direction()), normal));
+        uv_width = uv_extent > 0 ? width / (sqrt(fmax(cosine, 1e-4)) * uv_extent) : 0;
+    }
+};
+
+
+class hittable;
+
+
+// What a traversal keeps about its closest hit so far. The full hit_record is only built
+// once, for the final hit, by the primitive that was hit.
+struct surface_hit {
+    double t;
+    const hittable* object;  // builds the hit_record in compute_surface_interaction()
+    int prim;                // primitive index within object, if it has several
+    double b1, b2;           // barycentric or parametric coordinates, as object defines them
+    hit_record rec;          // only used by hittables without an intersect() of their own
 };
 
 
@@ -40,6 +65,23 @@ class hittable {
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
 
+        // Two-phase form of hit(): intersect() finds the closest hit in (t_min, t_max) and
+        // keeps only t and what h.object needs to build the record later. The defaults go
+        // through hit(), so hittables that only implement hit() keep working.
+        virtual bool intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
+            if (!hit(r, t_min, t_max, h.rec))
+                return false;
+            h.t = h.rec.t;
+            h.object = this;
+            return true;
+        }
+
+        // Fills in `rec` for a hit that this object reported through intersect() for `r`.
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const {
+            rec = h.rec;
+        }
+
         virtual double pdf_value(const vec3& o, const vec3& v) const {
             return 0.0;
         }
@@ -51,6 +93,16 @@ class hittable {
         virtual double area() const {
             return 0.0;
         }
+
+    protected:
+        // hit() for hittables that override intersect().
+        bool hit_deferred(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            surface_hit h;
+            if (!intersect(r, t_min, t_max, h))
+                return false;
+            h.object->compute_surface_interaction(r, h, rec);
+            return true;
+        }
 };
 
 
@@ -41,7 +41,12 @@ class hittable_list : public hittable  {
         }
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
         virtual double pdf_value(const vec3 &o, const vec3 &v) const override;
@@ -59,16 +64,14 @@ class hittable_list : public hittable  {
 };
 
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
+bool hittable_list::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
     auto hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->intersect(r, t_min, closest_so_far, h)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = h.t;
         }
     }
 
@@ -0,0 +1,194 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+//==============================================================================================
+// A hittable placed in the world by an arbitrary affine transform.
+//
+// The instance keeps the object-to-world matrix and its precomputed inverse. A ray is moved
+// into object space with the inverse (the direction is not renormalized, so t carries over
+// unchanged), and the hit point and normal are moved back with the forward matrix and the
+// inverse transpose. Since that preserves the sign of dot(direction, normal), the child's
+// front_face stays valid and set_face_normal is not run again.
+//
+// Wrapping an instance, translate or rotate_y in another instance composes the matrices
+// instead of nesting, so a chain of transforms always costs one ray transform.
+//
+// moving_instance is the motion-blurred variant: two keyframe matrices at time0 and time1,
+// split into translation, rotation and stretch (see affine_parts), blended for each ray's
+// time and inverted.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "affine.h"
+#include "hittable.h"
+
+#include <initializer_list>
+#include <iostream>
+
+
+class instance : public hittable {
+    public:
+        instance(shared_ptr<hittable> p, const affine& object_to_world);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bbox;
+            return hasbox;
+        }
+
+    public:
+        shared_ptr<hittable> ptr;
+        affine to_world;
+        affine to_object;
+        bool hasbox;
+        aabb bbox;
+};
+
+
+// Peels transform wrappers off `p`, accumulating them into `xform`, and returns the first
+// hittable that is not a transform.
+inline shared_ptr<hittable> collapse_transforms(shared_ptr<hittable> p, affine& xform) {
+    while (true) {
+        if (auto i = std::dynamic_pointer_cast<instance>(p)) {
+            xform = xform * i->to_world;
+            p = i->ptr;
+        } else if (auto t = std::dynamic_pointer_cast<translate>(p)) {
+            xform = xform * affine::translation(t->offset);
+            p = t->ptr;
+        } else if (auto ry = std::dynamic_pointer_cast<rotate_y>(p)) {
+            auto angle = atan2(ry->sin_theta, ry->cos_theta) * 180 / pi;
+            xform = xform * affine::rotation(1, angle);
+            p = ry->ptr;
+        } else {
+            return p;
+        }
+    }
+}
+
+
+// Replaces a chain of translate / rotate_y / instance wrappers with a single instance.
+inline shared_ptr<hittable> flatten_transforms(shared_ptr<hittable> p) {
+    affine xform;
+    auto leaf = collapse_transforms(p, xform);
+    return leaf == p ? p : make_shared<instance>(leaf, xform);
+}
+
+
+instance::instance(shared_ptr<hittable> p, const affine& object_to_world) {
+    to_world = object_to_world;
+    ptr = collapse_transforms(p, to_world);
+    if (to_world.determinant() == 0)
+        std::cerr << "Singular transform in instance constructor.\n";
+    to_object = to_world.inverse();
+
+    aabb child;
+    hasbox = ptr->bounding_box(0, 1, child);
+    if (hasbox)
+        bbox = to_world.bounds(child);
+}
+
+
+class moving_instance : public hittable {
+    public:
+        moving_instance(
+            shared_ptr<hittable> p, const affine& _start, const affine& _end, double _time0,
+            double _time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        // Asked for a single instant this is the box at that time. Without rotation, points
+        // move linearly between the keyframes, so the boxes in between never leave the
+        // interpolation of the two end boxes, as motion_bvh expects. A turning point strays
+        // from its straight path by at most radius * angle / 2, so with rotation every box
+        // is padded by that much.
+        virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override;
+
+        // A closed shutter (time0 == time1) keeps the start keyframe.
+        affine to_world(double time) const {
+            double s = time1 > time0 ? (time - time0) / (time1 - time0) : 0;
+            return interpolate(start, end, s).matrix();
+        }
+
+    public:
+        shared_ptr<hittable> ptr;
+        affine_parts start, end;
+        double time0, time1;
+        bool hasbox;
+        aabb child_box;
+        double pad;     // see bounding_box()
+};
+
+
+moving_instance::moving_instance(
+    shared_ptr<hittable> p, const affine& _start, const affine& _end, double _time0,
+    double _time1
+) : time0(_time0), time1(_time1) {
+    affine inner;
+    ptr = collapse_transforms(p, inner);
+    start = affine_parts(_start * inner);
+    end = affine_parts(_end * inner);
+    hasbox = ptr->bounding_box(0, 1, child_box);
+
+    // How far a stretched child box corner gets from the instance's origin; the length is
+    // convex in both the point and the time, so this bounds every point at every time.
+    double radius = 0;
+    for (int corner = 0; hasbox && corner < 8; corner++) {
+        double c[3] = {(corner & 1 ? child_box.max() : child_box.min()).x(),
+                       (corner & 2 ? child_box.max() : child_box.min()).y(),
+                       (corner & 4 ? child_box.max() : child_box.min()).z()};
+        for (const affine_parts* key : {&start, &end}) {
+            double length = 0;
+            for (int i = 0; i < 3; i++) {
+                double v = 0;
+                for (int j = 0; j < 3; j++)
+                    v += key->stretch[i][j] * c[j];
+                length += v * v;
+            }
+            radius = std::fmax(radius, sqrt(length));
+        }
+    }
+    pad = radius * rotation_angle(start, end) / 2;
+}
+
+
+bool moving_instance::bounding_box(double _time0, double _time1, aabb& output_box) const {
+    if (!hasbox)
+        return false;
+    output_box = surrounding_box(to_world(_time0).bounds(child_box),
+                                 to_world(_time1).bounds(child_box));
+    if (pad > 0) {
+        vec3 margin(pad, pad, pad);
+        output_box = aabb(output_box.min() - margin, output_box.max() + margin);
+    }
+    return true;
+}
+
+
+bool moving_instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    affine world = to_world(r.time());
+    affine object = world.inverse();
+    ray object_r(object.point(r.origin()), object.vector(r.direction()), r.time());
+    if (!ptr->hit(object_r, t_min, t_max, rec))
+        return false;
+
+    rec.p = world.point(rec.p);
+    rec.normal = unit_vector(object.transposed_vector(rec.normal));
+    return true;
+}
+
+
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    ray object_r(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+    if (!ptr->hit(object_r, t_min, t_max, rec))
+        return false;
+
+    rec.p = to_world.point(rec.p);
+    rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+    return true;
+}
+
+
+#endif
@@ -17,23 +17,47 @@
 #include "bvh.h"
 #include "camera.h"
 #include "color.h"
+#include "compiled_scene.h"
+#include "denoise.h"
 #include "hittable_list.h"
-#include "list_merge.h"
+#include "image_input.h"
+#include "image_output.h"
 #include "material.h"
+#include "material_table.h"
 #include "mesh.h"
 #include "planes.h"
+#include "progressive.h"
+#include "render_buffers.h"
+#include "render_server.h"
+#include "scene_file.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "texture.h"
+#include "texture_manager.h"
+#include "tiled_render.h"
 #include "triangle.h"
 #include "vec3.h"
 #include "vertices.h"
+#include "wide_bvh.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <pthread.h>
+#include <string>
 #include <vector>
 
+// With --stream, each band of rows is written to the output file as soon as
+// every pixel in it has been rendered in the current pass.
+struct band_stream {
+  image_stream file;
+  int band_rows;
+  std::unique_ptr<std::atomic<int>[]> done; // pixels of each band this pass
+};
+
 typedef struct task_struct {
   int samples_per_pixel, image_height, image_width;
-  std::list<pixel> *color_buffer;
   hittable *world;
   shared_ptr<hittable> lights;
   color background;
@@ -41,63 +65,162 @@ typedef struct task_struct {
   int no;
   int *pixel_pool;
   double prob_to_stop;
+  render_buffers *buffers;
+  const progressive_render *progress;
+  band_stream *stream;
 } task_struct;
 
-pthread_mutex_t print_mutex;
 pthread_mutex_t pixel_mutex;
-int finished_pixels = 0;
 auto lights = make_shared<hittable_list>(true);
+material_table materials;
+texture_manager textures;
 
+// With `aov` set, the path also records its first-hit AOVs there. Mirrors and
+// glass are followed, for up to 8 bounces, to the first surface that scatters
+// diffusely or emits, so the guides show what is seen through them.
 color ray_color(const ray &r, const color &background, const hittable &world,
-                shared_ptr<hittable> lights, double prob_to_stop) {
+                const shared_ptr<hittable_list> &lights, double prob_to_stop,
+                const ray_cone &cone, aov_sample *aov = NULL,
+                int aov_bounce = 0) {
   hit_record rec;
 
-  // If we've exceeded the ray bounce limit, no more light is gathered.
-  if (random_double() < prob_to_stop)
+  // If we've exceeded the ray bounce limit, no more light is gathered. Paths
+  // still recording AOVs are never cut, so the guides always find a surface.
+  double survival = aov ? 1 : 1 - prob_to_stop;
+  if (!aov && random_double() < prob_to_stop)
     return color(0, 0, 0);
 
   // If the ray hits nothing, return the background color.
   if (!world.hit(r, 0.001, infinity, rec))
-    return background / (1 - prob_to_stop);
-
-  scatter_record srec;
-  color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+    return background / survival;
+
+  // Width of the ray cone where it hits; t is in units of the direction's length.
+  double cone_width = cone.width + cone.spread * rec.t * r.direction().length();
+  rec.set_footprint(r, cone_width);
+
+  materials.resolve_slot(rec);
+  material_sample srec;
+  color emitted = materials.emitted(r, rec);
+  bool scatters = materials.scatter(r, rec, srec);
+
+  if (aov) {
+    aov->depth += rec.t * r.direction().length();
+    if (!scatters || !srec.is_specular) {
+      aov->normal = rec.normal;
+      aov->material = rec.mat_slot;
+      aov->albedo = scatters ? srec.attenuation
+                             : color(fmin(emitted.x(), 1.0),
+                                     fmin(emitted.y(), 1.0),
+                                     fmin(emitted.z(), 1.0));
+    }
+  }
 
-  if (!rec.mat_ptr->scatter(r, rec, srec))
-    return emitted / (1 - prob_to_stop);
+  if (!scatters)
+    return emitted / survival;
 
   if (srec.is_specular) {
+    // Mirrors and glass are treated as flat: the cone keeps spreading as before.
     return (srec.attenuation * ray_color(srec.specular_ray, background, world,
-                                         lights, prob_to_stop)) /
-           (1 - prob_to_stop);
+                                         lights, prob_to_stop,
+                                         ray_cone{cone_width, cone.spread},
+                                         aov_bounce < 7 ? aov : NULL,
+                                         aov_bounce + 1)) /
+           survival;
   }
 
-  auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-  mixture_pdf p(light_ptr, srec.pdf_ptr);
-  ray scattered = ray(rec.p, p.generate(), r.time());
-  auto pdf_val = p.value(scattered.direction());
-
+  // Equal mix of light sampling and the material's distribution, as mixture_pdf does,
+  // without allocating the pdfs. A scene without lights to sample uses the
+  // material's distribution alone.
+  hittable_pdf light_pdf(lights, rec.p);
+  cosine_pdf cosine(rec.normal);
+  const pdf &surface_pdf = srec.pdf_ptr ? *srec.pdf_ptr : cosine;
+  double light_share = lights->objects.empty() ? 0 : 0.5;
+  ray scattered = ray(rec.p,
+                      random_double() < light_share ? light_pdf.generate()
+                                                    : surface_pdf.generate(),
+                      r.time());
+  auto pdf_val = surface_pdf.value(scattered.direction());
+  if (light_share > 0)
+    pdf_val = light_share * light_pdf.value(scattered.direction()) +
+              (1 - light_share) * pdf_val;
+
+  // A diffuse bounce averages over the hemisphere anyway, so the cone is dropped and
+  // textures seen by the scattered ray are sampled at full resolution.
   return (emitted +
-          srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered) *
-              ray_color(scattered, background, world, lights, prob_to_stop) /
+          srec.attenuation * materials.scattering_pdf(r, rec, scattered) *
+              ray_color(scattered, background, world, lights, prob_to_stop,
+                        ray_cone{0, 0}) /
               pdf_val) /
-         (1 - prob_to_stop);
+         survival;
 }
 
-bool in_region(int x,int y)
-{
-  if(x>50&&x<350&&y<230&&y>0)
-  {
-    return true;
+// Adds `samples` camera samples of pixel (x, y) of an image_width x
+// image_height image to `out` at (out_x, out_y). Each sample draws its random
+// numbers from `seed`, the pixel and how many samples `out` already holds, so
+// a resumed render takes the samples the uninterrupted one would have.
+void render_pixel(const camera &cam, const hittable &world,
+                  const color &background, double prob_to_stop,
+                  int image_width, int image_height, int x, int y, int samples,
+                  uint32_t seed, render_buffers &out, int out_x, int out_y) {
+  ray_cone pixel_cone = cam.pixel_cone(image_height);
+  // XOR keeps the keys of one seed distinct past 2^32 pixels.
+  uint64_t pixel_index = static_cast<uint64_t>(y) * image_width + x;
+  uint64_t pixel_key = static_cast<uint64_t>(seed) << 32 ^ pixel_index;
+  int taken = out.samples[out.index(out_x, out_y)];
+  for (int s = 0; s < samples; ++s) {
+    seed_random(pixel_key, taken + s);
+    auto u = (x + random_double()) / (image_width - 1);
+    auto v = (y + random_double()) / (image_height - 1);
+    ray r = cam.get_ray(u, v);
+    aov_sample aov;
+    color c = ray_color(r, background, world, lights, prob_to_stop, pixel_cone,
+                        &aov);
+    out.add_sample(out_x, out_y, c, aov);
+  }
+}
+
+// What render_server's jobs and tiled renders render with.
+struct scene_context {
+  const hittable *world;
+  color background;
+  double prob_to_stop;
+  uint32_t seed;
+};
+
+void scene_pixel(void *context, const camera &cam, int image_width,
+                 int image_height, int x, int y, int samples,
+                 render_buffers &out, int out_x, int out_y) {
+  auto scene = static_cast<const scene_context *>(context);
+  render_pixel(cam, *scene->world, scene->background, scene->prob_to_stop,
+               image_width, image_height, x, y, samples, scene->seed, out,
+               out_x, out_y);
+}
+
+// Counts pixel row y as done for this pass, and writes out its band's mean
+// radiance if it was the band's last pixel.
+void pixel_done(band_stream &stream, const render_buffers &frame, int y) {
+  int band = y / stream.band_rows;
+  int y0 = band * stream.band_rows;
+  int y1 = std::min(y0 + stream.band_rows, frame.height);
+  if (++stream.done[band] < (y1 - y0) * frame.width)
+    return;
+  std::vector<float> rgb(3 * frame.width);
+  for (int row = y0; row < y1; row++) {
+    for (int x = 0; x < frame.width; x++) {
+      size_t i = frame.index(x, row);
+      float scale = frame.samples[i] > 0 ? 1.0f / frame.samples[i] : 0.0f;
+      for (int k = 0; k < 3; k++)
+        rgb[3 * x + k] = frame.radiance[k][i] * scale;
+    }
+    stream.file.write_row(row, rgb.data());
   }
-  else return false;
 }
 
 void *rt_handler(void *task) {
 
   task_struct *thread_task = (task_struct *)task;
 
-  while (true) {
+  while (!thread_task->progress->should_stop()) {
     pthread_mutex_lock(&pixel_mutex);
     int pixel_loc = *thread_task->pixel_pool;
     if (pixel_loc == 0) {
@@ -110,33 +233,25 @@ void *rt_handler(void *task) {
     int y = (pixel_loc - 1) / thread_task->image_width;
     int x = thread_task->image_width - 1 -
             ((pixel_loc - 1) % thread_task->image_width);
-    
-    int samples = thread_task->samples_per_pixel;
-    if(in_region(x,y))
-    {
-      samples*=1;
+    if (!thread_task->progress->owns(x, y)) {
+      if (thread_task->stream)
+        pixel_done(*thread_task->stream, *thread_task->buffers, y);
+      continue;
     }
 
-
-    color pixel_color(0, 0, 0);
-    for (int s = 0; s < samples; ++s) {
-      auto u = (x + random_double()) / (thread_task->image_width - 1);
-      auto v = (y + random_double()) / (thread_task->image_height - 1);
-      ray r = thread_task->cam->get_ray(u, v);
-      pixel_color +=
-          ray_color(r, thread_task->background, *(thread_task->world), lights,
-                    thread_task->prob_to_stop);
-    }
-    write_color(thread_task->color_buffer, pixel_color,
-                samples, y, x);
-    pthread_mutex_lock(&print_mutex);
-    finished_pixels++;
-    if (finished_pixels % 1000 == 0)
-      std::cerr << "\r Remaining pixels: "
-                << thread_task->image_width * thread_task->image_height -
-                       finished_pixels
-                << "   ";
-    pthread_mutex_unlock(&print_mutex);
+    // Brings the pixel to this pass's sample count. A render stopped mid-pass
+    // leaves some pixels a pass ahead; they wait for the others to catch up.
+    const render_buffers &frame = *thread_task->buffers;
+    int samples = thread_task->progress->samples_per_pixel() +
+                  thread_task->samples_per_pixel -
+                  frame.samples[frame.index(x, y)];
+    render_pixel(*thread_task->cam, *thread_task->world, thread_task->background,
+                 thread_task->prob_to_stop, thread_task->image_width,
+                 thread_task->image_height, x, y, samples,
+                 thread_task->progress->sample_seed(), *thread_task->buffers, x,
+                 y);
+    if (thread_task->stream)
+      pixel_done(*thread_task->stream, *thread_task->buffers, y);
   }
 
   free(task);
@@ -149,28 +264,28 @@ hittable_list sjtu_world() {
   // externals
 
   auto emat = make_shared<lambertian>(
-      make_shared<image_texture>("/home/yevzwming/code/Raytracing/"
-                                 "tra/src/raytrace/star1.jpg"));
+      textures.get_mipmapped("/home/yevzwming/code/Raytracing/"
+                             "tra/src/raytrace/star1.jpg"));
   auto sjtu = make_shared<lambertian>(
-      make_shared<image_texture>("/home/yevzwming/code/Raytracing/"
-                                 "tra/src/raytrace/night.jpg"));
+      textures.get_mipmapped("/home/yevzwming/code/Raytracing/"
+                             "tra/src/raytrace/night.jpg"));
   auto mercury = make_shared<lambertian>(
-      make_shared<image_texture>("/home/yevzwming/code/Raytracing/"
-                                 "tra/src/raytrace/Mercury.jpg"));
+      textures.get_mipmapped("/home/yevzwming/code/Raytracing/"
+                             "tra/src/raytrace/Mercury.jpg"));
   auto moon = make_shared<lambertian>(
-      make_shared<image_texture>("/home/yevzwming/code/Raytracing/"
-                                 "tra/src/raytrace/surface.jpg"));
-  auto sjtu1 = make_shared<lambertian>(make_shared<image_texture>(
+      textures.get_mipmapped("/home/yevzwming/code/Raytracing/"
+                             "tra/src/raytrace/surface.jpg"));
+  auto sjtu1 = make_shared<lambertian>(textures.get_mipmapped(
       "/home/yevzwming/code/Raytracing/tra/src/raytrace/1.png"));
-  auto sjtu2 = make_shared<lambertian>(make_shared<image_texture>(
+  auto sjtu2 = make_shared<lambertian>(textures.get_mipmapped(
       "/home/yevzwming/code/Raytracing/tra/src/raytrace/2.jpg"));
-  auto sjtu3 = make_shared<lambertian>(make_shared<image_texture>(
+  auto sjtu3 = make_shared<lambertian>(textures.get_mipmapped(
       "/home/yevzwming/code/Raytracing/tra/src/raytrace/3.jpg"));
-  auto sjtu4 = make_shared<lambertian>(make_shared<image_texture>(
+  auto sjtu4 = make_shared<lambertian>(textures.get_mipmapped(
       "/home/yevzwming/code/Raytracing/tra/src/raytrace/baihe.jpg"));
-  auto sjtu5 = make_shared<lambertian>(make_shared<image_texture>(
+  auto sjtu5 = make_shared<lambertian>(textures.get_mipmapped(
       "/home/yevzwming/code/Raytracing/tra/src/raytrace/5.png"));
-  auto sjtu6 = make_shared<lambertian>(make_shared<image_texture>(
+  auto sjtu6 = make_shared<lambertian>(textures.get_mipmapped(
       "/home/yevzwming/code/Raytracing/tra/src/raytrace/6.png"));
   auto white = make_shared<lambertian>(color(.73, .73, .73));
   auto light = make_shared<diffuse_light>(color(15, 15, 15));
@@ -203,27 +318,27 @@ hittable_list sjtu_world() {
   // ground light
   objects.add(
       make_shared<sphere>(point3(100, -30, 600), 80,
-                          make_shared<diffuse_light>(make_shared<image_texture>(
+                          make_shared<diffuse_light>(textures.get_mipmapped(
                               "/home/yevzwming/code/Raytracing/"
                               "tra/src/raytrace/Mercury.jpg"))));
   objects.add(
       make_shared<sphere>(point3(100, -30, 100), 60,
-                          make_shared<diffuse_light>(make_shared<image_texture>(
+                          make_shared<diffuse_light>(textures.get_mipmapped(
                               "/home/yevzwming/code/Raytracing/"
                               "tra/src/raytrace/Mercury.jpg"))));
   objects.add(
       make_shared<sphere>(point3(600, -50, 170), 100,
-                          make_shared<diffuse_light>(make_shared<image_texture>(
+                          make_shared<diffuse_light>(textures.get_mipmapped(
                               "/home/yevzwming/code/Raytracing/"
                               "tra/src/raytrace/Mercury.jpg"))));
   objects.add(
       make_shared<sphere>(point3(800, -50, 600), 80,
-                          make_shared<diffuse_light>(make_shared<image_texture>(
+                          make_shared<diffuse_light>(textures.get_mipmapped(
                               "/home/yevzwming/code/Raytracing/"
                               "tra/src/raytrace/Mercury.jpg"))));
   objects.add(
       make_shared<sphere>(point3(100, 400, 550), 80,
-                          make_shared<diffuse_light>(make_shared<image_texture>(
+                          make_shared<diffuse_light>(textures.get_mipmapped(
                               "/home/yevzwming/code/Raytracing/"
                               "tra/src/raytrace/surface.jpg"))));
 
@@ -324,7 +439,7 @@ hittable_list sjtu_world() {
       }
     }
   }
-  objects.add(make_shared<bvh_node>(spheres, 0, 1));
+  objects.add(make_shared<sphere_set>(spheres));
 
   objects.add(make_shared<sphere>(point3(300, 200, 300), 80, glass));
   // objects.add(make_shared<sphere>(point3(600, 275, 350), 50, glass));
@@ -339,7 +454,7 @@ hittable_list sjtu_world() {
   trian.add(make_shared<triangle>(v1, v2, v4, glass));
   trian.add(make_shared<triangle>(v1, v3, v4, glass));
   trian.add(make_shared<triangle>(v2, v3, v4, glass));
-  bvh_maker.add(make_shared<bvh_node>(trian, 0, 1));
+  bvh_maker.add(make_shared<wide_bvh>(trian, 0, 1));
 
     // shadow
       // objects.add(make_shared<sphere>(point3(100, 400, 50), 50, light));
@@ -347,8 +462,8 @@ hittable_list sjtu_world() {
       objects.add(make_shared<sphere>(point3(100,300,200),40,emat));
 
 
-  bvh_maker.add(make_shared<mesh>("/home/yevzwming/code/Raytracing/tra/src/raytrace/xh.obj",2,15,vec3(720,350,350),vec3(0,240,0),blue));
-  bvh_maker.add(make_shared<bvh_node>(objects, 0, 1));
+  bvh_maker.add(make_shared<mesh>("/home/yevzwming/code/Raytracing/tra/src/raytrace/xh.obj",15,vec3(720,350,350),vec3(0,240,0),blue,mesh_optimize_options(true)));
+  bvh_maker.add(make_shared<wide_bvh>(objects, 0, 1));
 
 
 
@@ -400,7 +515,7 @@ hittable_list cornell_box() {
   trian.add(make_shared<triangle>(v1, v2, v4, glass));
   trian.add(make_shared<triangle>(v1, v3, v4, glass));
   trian.add(make_shared<triangle>(v2, v3, v4, glass));
-  objects.add(make_shared<bvh_node>(trian, 0, 1));
+  objects.add(make_shared<wide_bvh>(trian, 0, 1));
   // construct a obj file
   // v 1.000000 1.000000 -1.000000
   // v 1.000000 -1.000000 -1.000000
@@ -413,7 +528,7 @@ hittable_list cornell_box() {
 
   // refer to mesh.h
   objects.add(make_shared<mesh>(
-      "/home/yevzwming/code/Raytracing/tra/src/raytrace/xh.obj", 2, 15,
+      "/home/yevzwming/code/Raytracing/tra/src/raytrace/xh.obj", 15,
       vec3(600, 200, 350), vec3(0, 240, 0), red));
 
   // std::vector<point3> square_points;
@@ -475,97 +590,475 @@ hittable_list cornell_box() {
   return objects;
 }
 
-int main() {
+// `path` with ".<rank>" before its extension: snapshot.ppm becomes
+// snapshot.2.ppm.
+std::string rank_path(const std::string &path, int rank) {
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = path.size();
+  return path.substr(0, dot) + "." + std::to_string(rank) + path.substr(dot);
+}
+
+int main(int argc, char **argv) {
+  // Usage: RayTracePlanes [--resume checkpoint] [--seed n] [--threads n]
+  //                        [--rank r --size n] [--serve socket]
+  //                        [--max-pixels n]
+  //                        [--output path] [--format f] [--srgb] [--stream]
+  //                        [--width n] [--spp n] [--tiled]
+  //                        [--region x,y,w,h]... [--base image]
+  //                        [--scene file] [--bc1] [--aovs]
+  //                        [--time seconds] [--noise threshold]
+  //                        [--snapshot path] [--snapshot-every seconds]
+  //                        [--checkpoint path | --no-checkpoint]
+  // Runs with different seeds can be merged with MergeCheckpoints. With
+  // --size n, the process renders only its share of the tiles, to
+  // render.<r>.ckpt, and the n checkpoints are merged into the image. With
+  // --serve, the scene is built once and render jobs are taken over the Unix
+  // socket (see render_server.h); --max-pixels caps the pixels of all queued
+  // jobs together (16M by default, about 52 bytes each).
+  // The image goes to stdout as binary PPM unless --output names a file; its
+  // format is --format (p3, ppm, png, pfm or exr) or else the file's
+  // extension. --srgb encodes 8-bit formats with the sRGB curve instead of
+  // gamma 2. --stream writes rows to a ppm, pfm or exr output as they finish.
+  // --width sets the image width (800 by default), --spp the samples per
+  // pixel (256). --tiled renders one tile at a time into a ppm, pfm or exr
+  // output, for images too large to keep in memory (see tiled_render.h).
+  // --region limits the render to a rectangle, in pixels from the top left
+  // corner; it can be given more than once. With --resume, the regions are
+  // rendered again from scratch into the checkpoint. With --base, they are
+  // pasted into that image, which the output then replaces.
+  // --scene reads the scene, camera and render settings from a scene file
+  // (see scene_file.h) instead of building the scene below; --width and --spp
+  // still override the file's.
+  // --bc1 stores image textures as BC1 blocks: a sixth of the memory for a
+  // slightly lossy encode.
+  // --aovs also writes the denoiser's guides (see render_buffers::write_aovs)
+  // next to the output: image_albedo.pfm and so on for --output image.png, or
+  // aov_*.pfm when the image goes to stdout.
+  // --time stops the render after that many seconds, --noise once the mean
+  // relative error of the pixels falls below the threshold (see
+  // progressive.h); the render also stops at --spp. A snapshot of the image
+  // so far is written to --snapshot (snapshot.ppm) every --snapshot-every
+  // seconds (60; 0 turns snapshots off).
+  // The sums are checkpointed every 10 minutes, on SIGUSR1 and on SIGTERM to
+  // --checkpoint: render.ckpt by default, or the checkpoint resumed from.
+  // --no-checkpoint writes none (not with --size).
+  auto setup_start = std::chrono::steady_clock::now();
+  const char *resume_path = NULL;
+  const char *serve_path = NULL;
+  std::string output_path = "-";
+  image_format format = image_format::ppm;
+  bool format_given = false, stream = false, tiled = false, bc1 = false;
+  bool aovs = false;
+  int width = 0, spp = 0; // 0: as the scene says
+  const char *scene_path = NULL;
+  std::vector<std::vector<int>> region_args;
+  const char *base_path = NULL;
+  image_options output_options;
+  unsigned seed = 1;
+  int nthreads = 16;
+  int rank = 0, ranks = 1;
+  long long max_pixels = 1 << 24;
+  double time_budget = 0, noise_threshold = 0, snapshot_every = 60;
+  std::string snapshot_path = "snapshot.ppm";
+  const char *checkpoint_arg = NULL;
+  bool no_checkpoint = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--resume") && i + 1 < argc) {
+      resume_path = argv[++i];
+    } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      seed = static_cast<unsigned>(strtoul(argv[++i], NULL, 10));
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--rank") && i + 1 < argc) {
+      rank = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      ranks = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (!strcmp(argv[i], "--max-pixels") && i + 1 < argc) {
+      max_pixels = atoll(argv[++i]);
+    } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (!strcmp(argv[i], "--format") && i + 1 < argc &&
+               parse_image_format(argv[i + 1], format)) {
+      format_given = true;
+      i++;
+    } else if (!strcmp(argv[i], "--srgb")) {
+      output_options.srgb = true;
+    } else if (!strcmp(argv[i], "--stream")) {
+      stream = true;
+    } else if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+      width = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--spp") && i + 1 < argc) {
+      spp = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--tiled")) {
+      tiled = true;
+    } else if (!strcmp(argv[i], "--region") && i + 1 < argc) {
+      std::vector<int> r(4);
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &r[0], &r[1], &r[2], &r[3]) != 4 ||
+          r[2] <= 0 || r[3] <= 0) {
+        nthreads = 0;
+        break;
+      }
+      region_args.push_back(r);
+    } else if (!strcmp(argv[i], "--base") && i + 1 < argc) {
+      base_path = argv[++i];
+    } else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+      scene_path = argv[++i];
+    } else if (!strcmp(argv[i], "--bc1")) {
+      bc1 = true;
+    } else if (!strcmp(argv[i], "--aovs")) {
+      aovs = true;
+    } else if (!strcmp(argv[i], "--time") && i + 1 < argc) {
+      time_budget = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--noise") && i + 1 < argc) {
+      noise_threshold = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+      snapshot_path = argv[++i];
+    } else if (!strcmp(argv[i], "--snapshot-every") && i + 1 < argc) {
+      snapshot_every = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+      checkpoint_arg = argv[++i];
+    } else if (!strcmp(argv[i], "--no-checkpoint")) {
+      no_checkpoint = true;
+    } else {
+      nthreads = 0;
+      break;
+    }
+  }
+  if (!format_given && output_path != "-")
+    format = image_format_for(output_path);
+  bool streamable = format == image_format::ppm ||
+                    format == image_format::pfm || format == image_format::exr;
+  if ((stream || tiled) && (output_path == "-" || !streamable))
+    nthreads = 0;
+  if (tiled && (ranks > 1 || resume_path || !region_args.empty()))
+    nthreads = 0;
+  if (base_path && (resume_path || region_args.empty()))
+    nthreads = 0;
+  if ((width && (width < 16 || width > (1 << 16))) || spp < 0 ||
+      max_pixels < 1)
+    nthreads = 0;
+  if (time_budget < 0 || noise_threshold < 0 || snapshot_every < 0)
+    nthreads = 0;
+  if (no_checkpoint && (checkpoint_arg || ranks > 1))
+    nthreads = 0;
+  if (nthreads < 1 || ranks < 1 || rank < 0 || rank >= ranks) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--resume checkpoint] [--seed n] [--threads n]"
+                 " [--rank r --size n] [--serve socket] [--max-pixels n]"
+                 " [--output path] [--format p3|ppm|png|pfm|exr] [--srgb]"
+                 " [--stream] [--width n] [--spp n] [--tiled]"
+                 " [--region x,y,w,h]... [--base image] [--scene file]"
+                 " [--bc1] [--aovs] [--time seconds] [--noise threshold]"
+                 " [--snapshot path] [--snapshot-every seconds]"
+                 " [--checkpoint path | --no-checkpoint]\n"
+                 "--stream and --tiled need an --output file in ppm, pfm or"
+                 " exr; --tiled does not work with --resume, --size or"
+                 " --region. --base needs --region and no --resume."
+                 " --no-checkpoint does not work with --size.\n";
+    return 1;
+  }
+  output_options.nthreads = nthreads;
+
   // Parallel
-  const int nthreads = 16;
+  report_simd_kernels();
+
+  // Scene
+
+  scene_description description;
+  if (scene_path) {
+    std::string error;
+    if (!load_scene(scene_path, textures, description, error)) {
+      std::cerr << error << '\n';
+      return 1;
+    }
+    std::cerr << "Scene " << scene_path << ": "
+              << description.objects.objects.size() << " objects, "
+              << description.unused << " unused declarations.\n";
+  } else {
+    description.objects = sjtu_world();
+    auto &sampled = description.lights;
+    sampled.push_back(
+        make_shared<xz_rect>(400, 600, 300, 500, 599, shared_ptr<material>()));
+    sampled.push_back(make_shared<sphere>(point3(500, 800, 400), 100,
+                                          shared_ptr<material>()));
+    sampled.push_back(
+        make_shared<sphere>(point3(100, 400, 50), 50, shared_ptr<material>()));
+    sampled.push_back(
+        make_shared<sphere>(point3(525, 175, 200), 20, shared_ptr<material>()));
+    sampled.push_back(
+        make_shared<sphere>(point3(1000, 100, 0), 50, shared_ptr<material>()));
+    description.settings.lookfrom = point3(540, 200, -400);
+    description.settings.lookat = point3(500, 200, 0);
+  }
+  scene_settings &settings = description.settings;
+  if (width)
+    settings.width = width;
+  if (spp)
+    settings.samples = spp;
 
   // Image
 
-  const auto aspect_ratio = 16.0 / 9.0;
-  const int image_width = 800;
+  const auto aspect_ratio = settings.aspect_ratio;
+  const int image_width = settings.width;
   const int image_height = static_cast<int>(image_width / aspect_ratio);
-  const int samples_per_pixel = 10000;
+  const bool denoise = settings.denoise;
   // const int max_depth = 10;
-  const double prob_to_stop = 0.05;
+  const double prob_to_stop = settings.prob_to_stop;
+
+  // Passes of 16 samples until 256 per pixel (with the denoiser, 2.5% of the
+  // 10000 the raw image needed give a comparable image), or until --time or
+  // --noise says stop.
+  progressive_settings progressive;
+  progressive.pass_samples = settings.pass_samples;
+  progressive.target_samples = settings.samples;
+  progressive.time_budget = time_budget;
+  progressive.noise_threshold = noise_threshold;
+  progressive.snapshot_interval = snapshot_every;
+  progressive.snapshot_path = snapshot_path;
+  // Checkpoints every 10 minutes, on SIGUSR1 and on SIGTERM, by default into
+  // the checkpoint the render resumed from.
+  progressive.checkpoint_interval = 600;
+  std::string checkpoint_path = checkpoint_arg ? checkpoint_arg
+                                : resume_path  ? resume_path
+                                               : "render.ckpt";
+  progressive.checkpoint_path = no_checkpoint ? "" : checkpoint_path;
+  progressive.seed = seed;
+  progressive.rank = rank;
+  progressive.ranks = ranks;
+  // Regions, cut to the image, with y up from the bottom.
+  std::vector<pixel_region> regions;
+  for (const auto &r : region_args) {
+    pixel_region region = {std::max(r[0], 0),
+                           std::max(image_height - r[1] - r[3], 0),
+                           std::min(r[0] + r[2], image_width),
+                           std::min(image_height - r[1], image_height)};
+    if (region.x0 >= region.x1 || region.y0 >= region.y1) {
+      std::cerr << "Region " << r[0] << ',' << r[1] << ',' << r[2] << ','
+                << r[3] << " is outside the " << image_width << 'x'
+                << image_height << " image.\n";
+      return 1;
+    }
+    regions.push_back(region);
+  }
+  progressive.regions = regions;
+  std::vector<float> base[3];
+  if (base_path) {
+    int base_width, base_height;
+    if (!read_image(base_path, base_width, base_height, base,
+                    output_options.srgb) ||
+        base_width != image_width || base_height != image_height) {
+      std::cerr << "Could not read a " << image_width << 'x' << image_height
+                << " image from " << base_path << ".\n";
+      return 1;
+    }
+    // The denoiser needs the neighbourhood of each region pixel, so render
+    // that too; only the regions themselves are pasted.
+    int apron = denoise ? atrous_denoiser().radius() : 0;
+    for (auto &region : progressive.regions) {
+      region.x0 = std::max(region.x0 - apron, 0);
+      region.y0 = std::max(region.y0 - apron, 0);
+      region.x1 = std::min(region.x1 + apron, image_width);
+      region.y1 = std::min(region.y1 + apron, image_height);
+    }
+  }
+  if (ranks > 1) {
+    progressive.snapshot_path = rank_path(snapshot_path, rank);
+    // A resumed rank's checkpoint already is its own.
+    if (checkpoint_arg || !resume_path)
+      progressive.checkpoint_path = rank_path(checkpoint_path, rank);
+    progressive.seed = seed + rank;
+  }
 
-  int pixel_pool = image_width * image_height;
+  int pixel_pool;
 
   // World
-  // auto lights = make_shared<hittable_list>();
-  auto world = sjtu_world();
-  color background(0, 0, 0);
-
-  lights->add(
-      make_shared<xz_rect>(400, 600, 300, 500, 599, shared_ptr<material>()));
-  lights->add(
-      make_shared<sphere>(point3(500, 800, 400), 100, shared_ptr<material>()));
-  lights->add(
-      make_shared<sphere>(point3(100, 400, 50), 50, shared_ptr<material>()));
-  lights->add(
-      make_shared<sphere>(point3(525, 175, 20), 20, shared_ptr<material>()));
-  lights->add(
-      make_shared<sphere>(point3(1000, 100, 0), 50, shared_ptr<material>()));
+  compiled_scene world(description.objects, settings.time0, settings.time1);
+  textures.set_compression(bc1);
+  textures.load_all();
+  textures.report(std::cerr);
+  world.add_materials(materials);
+  color background = settings.background;
+  for (const auto &light : description.lights)
+    lights->add(light);
 
   // Camera
 
-  point3 lookfrom(540, 200, -400);
-  point3 lookat(500, 200, 0);
-  vec3 vup(0, 1, 0);
-  auto dist_to_focus = 10.0;
-  auto aperture = 0.0;
-  auto vfov = 40.0;
-  auto time0 = 0.0;
-  auto time1 = 1.0;
+  point3 lookfrom = settings.lookfrom;
+  point3 lookat = settings.lookat;
+  vec3 vup = settings.vup;
+  auto dist_to_focus = settings.focus_dist;
+  auto aperture = settings.aperture;
+  auto vfov = settings.vfov;
+  auto time0 = settings.time0;
+  auto time1 = settings.time1;
 
   camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus,
              time0, time1);
+  scene_context scene = {&world, background, prob_to_stop, seed};
+
+  if (serve_path) {
+    render_job defaults;
+    defaults.width = image_width;
+    defaults.height = image_height;
+    defaults.samples = progressive.target_samples;
+    defaults.pass_samples = progressive.pass_samples;
+    defaults.lookfrom = lookfrom;
+    defaults.lookat = lookat;
+    defaults.vup = vup;
+    defaults.vfov = vfov;
+    defaults.aperture = aperture;
+    defaults.focus_dist = dist_to_focus;
+    defaults.time0 = time0;
+    defaults.time1 = time1;
+    defaults.denoise = denoise;
+    std::cerr << "Scene ready in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                               setup_start)
+                     .count()
+              << " s.\n";
+    render_server server(defaults, scene_pixel, &scene, nthreads,
+                         static_cast<size_t>(max_pixels));
+    return server.serve(serve_path);
+  }
 
-  // Render
+  if (tiled) {
+    image_stream out;
+    if (!out.open(output_path, format, image_width, image_height,
+                  output_options)) {
+      std::cerr << "Could not create " << output_path << ".\n";
+      return 1;
+    }
+    tiled_settings tiles;
+    tiles.samples = progressive.target_samples;
+    tiles.denoise = denoise;
+    tiled_render renderer(tiles, scene_pixel, &scene, nthreads);
+    bool ok = renderer.run(cam, image_width, image_height, out);
+    out.close();
+    std::cerr << "Peak memory " << peak_rss_bytes() / (1 << 20) << " MB.\n";
+    if (!ok) {
+      std::cerr << "Could not write " << output_path << ".\n";
+      return 1;
+    }
+    std::cerr << "Done.\n";
+    return 0;
+  }
 
-  std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+  // Render
 
   // MultiThread accelerate
-  std::list<pixel> *lists = new std::list<pixel>[nthreads];
-  pthread_t *rt_threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
-  for (int nt = 0; nt < nthreads; nt++) {
-
-    task_struct *task = (task_struct *)malloc(sizeof(task_struct));
-    task->image_width = image_width;
-    task->image_height = image_height;
-    task->color_buffer = &lists[nt];
-
-    task->prob_to_stop = prob_to_stop;
-    task->samples_per_pixel = samples_per_pixel;
-    task->cam = &cam;
-    // task->lights = lights;
-    task->background = background;
-    task->world = &world;
-    task->no = nt;
-    task->pixel_pool = &pixel_pool;
-
-    if (pthread_create(&rt_threads[nt], NULL, rt_handler, task)) {
-      fprintf(stderr, "Error creating thread\n");
+  render_buffers frame(image_width, image_height);
+  progressive_render progress(progressive, frame);
+  if (resume_path) {
+    if (!progress.resume(resume_path)) {
+      std::cerr << "Could not resume from " << resume_path << ".\n";
+      return 1;
+    }
+    std::cerr << "Resuming at " << progress.samples_per_pixel() << " spp.\n";
+  }
+  progressive_render::install_signal_handlers();
+
+  band_stream bands;
+  int nbands = 0;
+  if (stream && ranks == 1) {
+    bands.band_rows = 16;
+    nbands = (image_height + bands.band_rows - 1) / bands.band_rows;
+    bands.done.reset(new std::atomic<int>[nbands]);
+    if (!bands.file.open(output_path, format, image_width, image_height,
+                         output_options)) {
+      std::cerr << "Could not create " << output_path << ".\n";
       return 1;
     }
   }
 
-  for (int nt = 0; nt < nthreads; nt++) {
-    pthread_join(rt_threads[nt], NULL);
+  pthread_t *rt_threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  int pass_samples;
+  while ((pass_samples = progress.next_pass()) > 0) {
+    pixel_pool = image_width * image_height;
+    for (int b = 0; b < nbands; b++)
+      bands.done[b] = 0;
+    for (int nt = 0; nt < nthreads; nt++) {
+
+      task_struct *task = (task_struct *)malloc(sizeof(task_struct));
+      task->image_width = image_width;
+      task->image_height = image_height;
+
+      task->prob_to_stop = prob_to_stop;
+      task->samples_per_pixel = pass_samples;
+      task->cam = &cam;
+      // task->lights = lights;
+      task->background = background;
+      task->world = &world;
+      task->no = nt;
+      task->pixel_pool = &pixel_pool;
+      task->buffers = &frame;
+      task->progress = &progress;
+      task->stream = nbands > 0 ? &bands : NULL;
+
+      if (pthread_create(&rt_threads[nt], NULL, rt_handler, task)) {
+        fprintf(stderr, "Error creating thread\n");
+        return 1;
+      }
+    }
+
+    for (int nt = 0; nt < nthreads; nt++) {
+      pthread_join(rt_threads[nt], NULL);
+    }
+    progress.end_pass();
+  }
+  progress.finish();
+  bands.file.close();
+  if (ranks > 1) {
+    std::cerr << "Tiles of rank " << rank << " are in "
+              << progressive.checkpoint_path << ".\n";
+    return 0;
   }
 
-  int remain_list = nthreads;
-  while (remain_list > 1) {
-    int step = nthreads / remain_list;
-    for (int i = 0; i < nthreads; i += (2 * step)) {
-      if (i + step < nthreads)
-        merge_list(lists[i], lists[i + step]);
+  frame.resolve();
+  if (aovs) {
+    std::string prefix = "aov";
+    if (output_path != "-") {
+      size_t slash = output_path.find_last_of('/');
+      size_t dot = output_path.find_last_of('.');
+      bool has_extension =
+          dot != std::string::npos && (slash == std::string::npos || dot > slash);
+      prefix = has_extension ? output_path.substr(0, dot) : output_path;
     }
-    remain_list /= 2;
+    if (!frame.write_aovs(prefix))
+      std::cerr << "\nCould not write the AOV images.\n";
+  }
+
+  const std::vector<float> *image = frame.radiance;
+  std::vector<float> denoised[3];
+  if (denoise) {
+    atrous_denoiser().run(frame, denoised);
+    image = denoised;
+  }
+  if (base_path) {
+    for (int y = 0; y < image_height; y++)
+      for (int x = 0; x < image_width; x++) {
+        size_t i = frame.index(x, y);
+        for (const auto &region : regions) {
+          if (region.contains(x, y)) {
+            for (int k = 0; k < 3; k++)
+              base[k][i] = image[k][i];
+            break;
+          }
+        }
+      }
+    image = base;
   }
 
-  for (auto c : lists[0]) {
-    std::cout << c.r << ' ' << c.g << ' ' << c.b << '\n';
+  // Replaces the streamed file, if any, with the denoised image.
+  if (!write_image(output_path, format, image_width, image_height, image,
+                   output_options)) {
+    std::cerr << "\nCould not write " << output_path << ".\n";
+    return 1;
   }
 
-  std::cerr << "\nDone.\n";
+  std::cerr << "\nPeak memory " << peak_rss_bytes() / (1 << 20) << " MB.\n";
+  std::cerr << "Done.\n";
 }
@@ -56,7 +56,7 @@ class lambertian : public material {
             const ray& r_in, const hit_record& rec, scatter_record& srec
         ) const override {
             srec.is_specular = false;
-            srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+            srec.attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.uv_width);
             srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
             return true;
         }
@@ -146,7 +146,7 @@ class diffuse_light : public material {
         ) const override {
             if (!rec.front_face)
                 return color(0,0,0);
-            return emit->value(u, v, p);
+            return emit->filtered_value(u, v, p, rec.uv_width);
         }
 
     public:
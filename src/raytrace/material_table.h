@@ -0,0 +1,286 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+//==============================================================================================
+// The built-in materials flattened into a table and shaded through a switch.
+//
+// Every material added to the table gets a slot. Its kind and parameters are stored in
+// per-field arrays, and constant (solid_color) textures are baked to a color. emitted(),
+// scatter() and scattering_pdf() then switch on the kind instead of calling through the
+// vtable. Nothing is allocated per shading point: a diffuse bounce reports "cosine around the
+// normal" rather than a heap-allocated cosine_pdf.
+//
+// The shading calls take the slot from hit_record::mat_slot, which compiled_scene's
+// primitives fill in from the slots add_materials() gave them, so a hit costs no lookup.
+// resolve_slot() looks it up once for the other hittables. Materials of any other type, and
+// hits whose slot is still -1, are shaded through the virtual material interface, so the
+// table is always safe to use.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+#include "texture.h"
+
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+
+enum material_kind {
+    mat_lambertian, mat_metal, mat_dielectric, mat_diffuse_light, mat_isotropic, mat_fallback,
+    material_kind_count
+};
+
+
+// scatter_record without the heap: pdf_ptr is only set for fallback materials, and a null
+// pdf_ptr on a diffuse sample means the cosine distribution around rec.normal.
+struct material_sample {
+    ray specular_ray;
+    bool is_specular;
+    color attenuation;
+    shared_ptr<pdf> pdf_ptr;
+};
+
+
+class material_table {
+    public:
+        material_table() {}
+
+        // Adds `m` unless it is already in the table, and returns its slot (-1 for null).
+        int add(const shared_ptr<material>& m);
+
+        // Slot of `m` in this table, or -1.
+        int slot_of(const material* m) const {
+            auto found = slots.find(m);
+            return found == slots.end() ? -1 : found->second;
+        }
+
+        // Fills in rec.mat_slot if the hittable did not. Call it once per hit, before
+        // shading.
+        void resolve_slot(hit_record& rec) const {
+            if (rec.mat_slot < 0)
+                rec.mat_slot = slot_of(rec.mat_ptr.get());
+        }
+
+        material_kind kind_of(const material* m) const {
+            int slot = slot_of(m);
+            return slot < 0 ? mat_fallback : static_cast<material_kind>(kinds[slot]);
+        }
+
+        int size() const { return static_cast<int>(kinds.size()); }
+
+        color emitted(const ray& r_in, const hit_record& rec) const;
+        bool scatter(const ray& r_in, const hit_record& rec, material_sample& s) const;
+        double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const;
+
+        // Counting sort of shading points by material kind. On return order[] lists the
+        // indices into `mats` kind by kind, and kind k owns order[begin[k] .. begin[k + 1]).
+        void group_by_kind(
+            const material* const* mats, int count, std::vector<int>& order,
+            int begin[material_kind_count + 1]) const;
+
+    public:
+        std::vector<unsigned char> kinds;
+        std::vector<color> albedo;                  // baked texture color, or emission
+        std::vector<const texture*> textures;       // null when the color is baked
+        std::vector<double> param;                  // metal fuzz, dielectric index
+        std::vector<shared_ptr<material>> sources;  // keeps materials and textures alive
+
+    private:
+        void set_texture(int slot, const shared_ptr<texture>& tex);
+
+        // Kept here rather than on the material, which may be in several tables.
+        std::unordered_map<const material*, int> slots;
+
+        color texture_value(int slot, const hit_record& rec) const {
+            return textures[slot]
+                ? textures[slot]->filtered_value(rec.u, rec.v, rec.p, rec.uv_width)
+                : albedo[slot];
+        }
+
+        static double reflectance(double cosine, double ref_idx) {
+            // Use Schlick's approximation for reflectance.
+            auto r0 = (1-ref_idx) / (1+ref_idx);
+            r0 = r0*r0;
+            return r0 + (1-r0)*pow((1 - cosine),5);
+        }
+};
+
+
+int material_table::add(const shared_ptr<material>& m) {
+    if (!m)
+        return -1;
+    int existing = slot_of(m.get());
+    if (existing >= 0)
+        return existing;
+
+    int slot = size();
+    const auto& type = typeid(*m);
+    material_kind kind = mat_fallback;
+    if (type == typeid(lambertian))         kind = mat_lambertian;
+    else if (type == typeid(metal))         kind = mat_metal;
+    else if (type == typeid(dielectric))    kind = mat_dielectric;
+    else if (type == typeid(diffuse_light)) kind = mat_diffuse_light;
+    else if (type == typeid(isotropic))     kind = mat_isotropic;
+
+    kinds.push_back(static_cast<unsigned char>(kind));
+    albedo.push_back(color(0,0,0));
+    textures.push_back(nullptr);
+    param.push_back(0);
+    sources.push_back(m);
+
+    switch (kind) {
+        case mat_lambertian:
+            set_texture(slot, static_cast<lambertian&>(*m).albedo);
+            break;
+        case mat_metal:
+            albedo[slot] = static_cast<metal&>(*m).albedo;
+            param[slot] = static_cast<metal&>(*m).fuzz;
+            break;
+        case mat_dielectric:
+            param[slot] = static_cast<dielectric&>(*m).ir;
+            break;
+        case mat_diffuse_light:
+            set_texture(slot, static_cast<diffuse_light&>(*m).emit);
+            break;
+        case mat_isotropic:
+            set_texture(slot, static_cast<isotropic&>(*m).albedo);
+            break;
+        default:
+            break;
+    }
+
+    slots[m.get()] = slot;
+    return slot;
+}
+
+
+void material_table::set_texture(int slot, const shared_ptr<texture>& tex) {
+    if (typeid(*tex) == typeid(solid_color))
+        albedo[slot] = tex->value(0, 0, point3(0,0,0));
+    else
+        textures[slot] = tex.get();
+}
+
+
+color material_table::emitted(const ray& r_in, const hit_record& rec) const {
+    int slot = rec.mat_slot;
+    if (slot < 0)
+        return rec.mat_ptr->emitted(r_in, rec, rec.u, rec.v, rec.p);
+
+    switch (kinds[slot]) {
+        case mat_diffuse_light:
+            return rec.front_face ? texture_value(slot, rec) : color(0,0,0);
+        case mat_fallback:
+            return rec.mat_ptr->emitted(r_in, rec, rec.u, rec.v, rec.p);
+        default:
+            return color(0,0,0);
+    }
+}
+
+
+bool material_table::scatter(const ray& r_in, const hit_record& rec, material_sample& s) const {
+    int slot = rec.mat_slot;
+    int kind = slot < 0 ? static_cast<int>(mat_fallback) : static_cast<int>(kinds[slot]);
+
+    switch (kind) {
+        case mat_lambertian:
+            s.is_specular = false;
+            s.attenuation = texture_value(slot, rec);
+            s.pdf_ptr = nullptr;
+            return true;
+
+        case mat_metal: {
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+            s.specular_ray =
+                ray(rec.p, reflected + param[slot]*random_in_unit_sphere(), r_in.time());
+            s.attenuation = albedo[slot];
+            s.is_specular = true;
+            s.pdf_ptr = nullptr;
+            return true;
+        }
+
+        case mat_dielectric: {
+            s.is_specular = true;
+            s.pdf_ptr = nullptr;
+            s.attenuation = color(1.0, 1.0, 1.0);
+            double ir = param[slot];
+            double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
+
+            vec3 unit_direction = unit_vector(r_in.direction());
+            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+            double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+
+            bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+            vec3 direction;
+
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+                direction = reflect(unit_direction, rec.normal);
+            else
+                direction = refract(unit_direction, rec.normal, refraction_ratio);
+
+            s.specular_ray = ray(rec.p, direction, r_in.time());
+            return true;
+        }
+
+        case mat_fallback: {
+            scatter_record srec;
+            if (!rec.mat_ptr->scatter(r_in, rec, srec))
+                return false;
+            s.specular_ray = srec.specular_ray;
+            s.is_specular = srec.is_specular;
+            s.attenuation = srec.attenuation;
+            s.pdf_ptr = srec.pdf_ptr;
+            return true;
+        }
+
+        // diffuse_light only emits; isotropic does not scatter either, matching its disabled
+        // scatter() in material.h.
+        default:
+            return false;
+    }
+}
+
+
+double material_table::scattering_pdf(
+    const ray& r_in, const hit_record& rec, const ray& scattered
+) const {
+    int slot = rec.mat_slot;
+    int kind = slot < 0 ? static_cast<int>(mat_fallback) : static_cast<int>(kinds[slot]);
+
+    switch (kind) {
+        case mat_lambertian: {
+            auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
+            return cosine < 0 ? 0 : cosine/pi;
+        }
+        case mat_fallback:
+            return rec.mat_ptr->scattering_pdf(r_in, rec, scattered);
+        default:
+            return 0;
+    }
+}
+
+
+void material_table::group_by_kind(
+    const material* const* mats, int count, std::vector<int>& order,
+    int begin[material_kind_count + 1]
+) const {
+    for (int k = 0; k <= material_kind_count; k++)
+        begin[k] = 0;
+    for (int i = 0; i < count; i++)
+        begin[kind_of(mats[i]) + 1]++;
+    for (int k = 0; k < material_kind_count; k++)
+        begin[k + 1] += begin[k];
+
+    int next[material_kind_count];
+    for (int k = 0; k < material_kind_count; k++)
+        next[k] = begin[k];
+    order.resize(count);
+    for (int i = 0; i < count; i++)
+        order[next[kind_of(mats[i])]++] = i;
+}
+
+
+#endif
@@ -20,6 +20,9 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "mesh_cache.h"
+#include "mesh_optimize.h"
+#include "obj_loader.h"
 #include "planes.h"
 #include "rtweekend.h"
 #include "vertices.h"
@@ -31,6 +34,7 @@
 
 #include "stdio.h"
 #include "vec3.h"
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -42,8 +46,11 @@ class mesh : public hittable {
 public:
   mesh() {}
   mesh(const char *filename, int flag, int scale, vec3 translate, vec3 rotate,
-       shared_ptr<material> mat)
+       shared_ptr<material> mat,
+       const mesh_optimize_options &optimize = mesh_optimize_options())
       : mp(mat) {
+    std::vector<point3> square_points;
+    std::list<std::vector<int>> planes_nodes_nums;
     string strTemp;
     ifstream infile;
     infile.open(filename);
@@ -110,56 +117,172 @@ public:
         planes_nodes_nums.push_back(firstIndex);
       }
     }
-    auto square_vertices = vertices(square_points);
-    square_vertices.rotate(rotate);
-    square_vertices.scale(scale);
-    square_vertices.translate(translate);
-    std::cerr << "start planes generated.\n";
-    auto square_planes =
-        make_shared<planes>(planes_nodes_nums, square_vertices, mat);
-    std::cerr << "after planes generated.\n";
-    objs.add(square_planes);
-
-    // compute max and min
-    _xmin = square_points[0].x();
-    _ymin = square_points[0].y();
-    _zmin = square_points[0].z();
-    _xmax = square_points[0].x();
-    _ymax = square_points[0].y();
-    _zmax = square_points[0].z();
-
-    for (auto p : square_points) {
-      _xmin = fmin(_xmin, p.x());
-      _ymin = fmin(_ymin, p.y());
-      _zmin = fmin(_zmin, p.z());
-      _xmax = fmax(_xmax, p.x());
-      _ymax = fmax(_ymax, p.y());
-      _zmax = fmax(_zmax, p.z());
+    obj_data data;
+    data.positions = square_points;
+    data.face_offsets.push_back(0);
+    for (auto &face : planes_nodes_nums) {
+      data.face_indices.insert(data.face_indices.end(), face.begin(), face.end());
+      data.face_offsets.push_back(static_cast<int>(data.face_indices.size()));
     }
-
-    node = make_shared<bvh_node>(objs, 0, 1);
+    build(data, scale, translate, rotate, optimize, 0);
   };
+
+  // Loads through load_obj(), which detects the face format by itself. The processed
+  // mesh and its BVH are cached on disk (see mesh_cache.h), so later runs with the same
+  // file, placement and optimize options map the cache instead of parsing and building.
+  mesh(const char *filename, int scale, vec3 translate, vec3 rotate,
+       shared_ptr<material> mat,
+       const mesh_optimize_options &optimize = mesh_optimize_options())
+      : mp(mat) {
+    auto start = std::chrono::steady_clock::now();
+
+    uint64_t key = 0;
+    std::string cache_path;
+    auto dir = mesh_cache_dir();
+    if (!dir.empty() && hash_file(filename, key)) {
+      double settings[7] = {double(scale),     translate.x(), translate.y(),
+                            translate.z(),     rotate.x(),    rotate.y(),
+                            rotate.z()};
+      double cleanup[3] = {optimize.weld_tolerance, optimize.min_area,
+                           double(optimize.reorder)};
+      int layout[3] = {int(mesh_cache_version), mesh_geometry::leaf_size,
+                       int(optimize.enabled)};
+      key = hash_bytes(settings, sizeof(settings), key);
+      key = hash_bytes(cleanup, sizeof(cleanup), key);
+      key = hash_bytes(layout, sizeof(layout), key);
+
+      std::string name = filename;
+      name = name.substr(name.find_last_of('/') + 1);
+      char hex[17];
+      snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+      cache_path = dir + "/" + name + "-" + hex + ".rtmesh";
+
+      if (geometry.load(cache_path, key)) {
+        report(filename, "mapped from cache", start);
+        return;
+      }
+    }
+
+    obj_data data;
+    load_obj(filename, data);
+    build(data, scale, translate, rotate, optimize, key);
+    if (!cache_path.empty() && !geometry.save(cache_path))
+      std::cerr << "Could not write mesh cache '" << cache_path << "'.\n";
+    report(filename, "built", start);
+  }
+
   virtual bool hit(const ray &r, double t_min, double t_max,
-                   hit_record &rec) const override;
+                   hit_record &rec) const override {
+    return hit_deferred(r, t_min, t_max, rec);
+  }
+  virtual bool intersect(const ray &r, double t_min, double t_max,
+                         surface_hit &h) const override;
+  virtual void compute_surface_interaction(const ray &r, const surface_hit &h,
+                                           hit_record &rec) const override;
   virtual bool bounding_box(double time0, double time1,
                             aabb &output_box) const override {
-    output_box = aabb(point3(_xmin - 0.0001, _ymin - 0.0001, _zmin - 0.0001),
-                      point3(_xmax + 0.0001, _ymax + 0.0001, _zmax + 0.0001));
-    return true;
+    output_box = geometry.bounds;
+    return geometry.triangle_count > 0;
+  }
+
+private:
+  // Places the vertices, fan-triangulates every face, optionally cleans the
+  // result up and builds the BVH.
+  void build(const obj_data &data, int scale, vec3 translate, vec3 rotate,
+             const mesh_optimize_options &optimize, uint64_t key) {
+    auto placed = vertices(data.positions);
+    placed.rotate(rotate);
+    placed.scale(scale);
+    placed.translate(translate);
+
+    std::vector<int> tri_indices;
+    tri_indices.reserve(3 * data.face_indices.size());
+    for (size_t f = 0; f < data.face_count(); f++) {
+      auto first = data.face_offsets[f];
+      for (int k = first + 2; k < data.face_offsets[f + 1]; k++) {
+        tri_indices.push_back(data.face_indices[first]);
+        tri_indices.push_back(data.face_indices[k - 1]);
+        tri_indices.push_back(data.face_indices[k]);
+      }
+    }
+    optimize_mesh(placed.points, tri_indices, optimize);
+    if (tri_indices.empty())
+      std::cerr << "mesh has no faces.\n";
+
+    geometry.build(placed.points, tri_indices, key);
+  }
+
+  void report(const char *filename, const char *how,
+              std::chrono::steady_clock::time_point start) const {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cerr << "mesh '" << filename << "': " << how << " in " << elapsed.count()
+              << " ms (" << geometry.triangle_count << " triangles, "
+              << geometry.bytes() / 1024 << " KB)\n";
   }
 
 public:
   shared_ptr<material> mp;
-  shared_ptr<bvh_node> node;
-  hittable_list objs;
-  std::vector<point3> square_points;
-  std::list<std::vector<int>> planes_nodes_nums;
-  double _xmin, _ymin, _zmin, _xmax, _ymax, _zmax;
+  int mat_slot = -1; // see compiled_scene::add_materials()
+  mesh_geometry geometry;
 };
 
-bool mesh::hit(const ray &r, double t_min, double t_max,
-               hit_record &rec) const {
-  return node->hit(r, t_min, t_max, rec);
+bool mesh::intersect(const ray &r, double t_min, double t_max,
+                     surface_hit &h) const {
+  const auto *tris = geometry.triangles;
+  int hit_tri = -1;
+
+  wide_bvh_traverse(
+      geometry.nodes, geometry.node_count, r, t_min, t_max,
+      [&](int first, int count, double &closest) {
+        bool hit_anything = false;
+        for (int i = first; i < first + count; i++) {
+          // Moller Trumbore Algorithm
+          const auto &tri = tris[i];
+          auto s1 = cross(r.direction(), tri.e2);
+          auto deno = dot(s1, tri.e1);
+          if (deno == 0)
+            continue;
+          auto inv = 1 / deno;
+          auto s = r.origin() - tri.p0;
+          auto b1 = dot(s1, s) * inv;
+          if (b1 < 0 || b1 > 1)
+            continue;
+          auto s2 = cross(s, tri.e1);
+          auto b2 = dot(s2, r.direction()) * inv;
+          if (b2 < 0 || b1 + b2 > 1)
+            continue;
+          auto t = dot(s2, tri.e2) * inv;
+          if (t < t_min || t > closest)
+            continue;
+          closest = t;
+          hit_tri = i;
+          h.b1 = b1;
+          h.b2 = b2;
+          hit_anything = true;
+        }
+        return hit_anything;
+      });
+
+  if (hit_tri < 0)
+    return false;
+
+  h.t = t_max;
+  h.object = this;
+  h.prim = hit_tri;
+  return true;
+}
+
+void mesh::compute_surface_interaction(const ray &r, const surface_hit &h,
+                                       hit_record &rec) const {
+  const auto &tri = geometry.triangles[h.prim];
+  rec.t = h.t;
+  rec.p = r.at(h.t);
+  rec.u = 0.5;
+  rec.v = 0.5;
+  rec.set_face_normal(r, unit_vector(cross(tri.e1, tri.e2)));
+  rec.mat_ptr = mp;
+  rec.mat_slot = mat_slot;
 }
 
-#endif
\ No newline at end of file
+#endif
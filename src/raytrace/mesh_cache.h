@@ -0,0 +1,349 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+//==============================================================================================
+// Flat, relocatable storage for a processed triangle mesh and its wide BVH, plus the binary
+// cache file built from it.
+//
+// Everything lives in one contiguous blob: a header followed by 64-byte aligned arrays of
+// positions, triangle indices, precomputed triangle edges (all in BVH leaf order) and BVH
+// nodes. A freshly built mesh keeps the blob in memory; a cached one maps the file and uses
+// it in place, so a warm start does no parsing and no BVH build.
+//
+// Cache files are named <obj basename>-<key>.rtmesh inside RT_CACHE_DIR (default
+// ".rtcache"; set it to an empty string to disable caching). The key hashes the OBJ bytes,
+// the placement settings and the layout version, so a changed source or setting simply maps
+// to a different file. A file that fails validation is rebuilt and overwritten.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "wide_bvh.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+const uint32_t mesh_cache_version = 1;
+
+
+// A triangle ready for Moller-Trumbore: first vertex and the two edges leaving it.
+struct mesh_triangle {
+    point3 p0;
+    vec3 e1, e2;
+};
+
+
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_bytes;
+    uint32_t node_bytes;
+    uint32_t block_width;
+    uint64_t key;
+    uint64_t file_size;
+    uint64_t vertex_count, triangle_count, node_count;
+    uint64_t vertex_offset, index_offset, triangle_offset, node_offset;
+    double bounds[6];
+};
+
+
+// 64-bit FNV-1a, chained through `h`.
+inline uint64_t hash_bytes(const void* data, size_t size, uint64_t h = 14695981039346656037ull) {
+    auto p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+inline bool hash_file(const char* filename, uint64_t& h) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    h = hash_bytes(&size, sizeof(size), h);
+    if (size > 0) {
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        h = hash_bytes(mapped, size, h);
+        munmap(mapped, size);
+    }
+    close(fd);
+    return true;
+}
+
+
+// Directory for cache files, created on demand; empty when caching is disabled.
+inline std::string mesh_cache_dir() {
+    const char* dir = std::getenv("RT_CACHE_DIR");
+    std::string path = dir ? dir : ".rtcache";
+    if (!path.empty())
+        mkdir(path.c_str(), 0755);
+    return path;
+}
+
+
+class mesh_geometry {
+    public:
+        static const int leaf_size = 4;
+
+        mesh_geometry()
+            : positions(nullptr), indices(nullptr), triangles(nullptr), nodes(nullptr),
+              vertex_count(0), triangle_count(0), node_count(0),
+              mapped(nullptr), mapped_size(0) {}
+
+        mesh_geometry(const mesh_geometry&) = delete;
+        mesh_geometry& operator=(const mesh_geometry&) = delete;
+
+        ~mesh_geometry() { release(); }
+
+        // Builds the BVH over `tri_indices` (three per triangle) into an in-memory blob.
+        void build(const std::vector<point3>& points, const std::vector<int>& tri_indices,
+                   uint64_t key);
+
+        // Maps `path` and adopts it if it is a valid cache for `key`.
+        bool load(const std::string& path, uint64_t key);
+
+        // Writes the blob to `path` atomically (temporary file, then rename).
+        bool save(const std::string& path) const;
+
+        size_t bytes() const { return mapped ? mapped_size : buffer.size(); }
+
+    public:
+        const point3* positions;
+        const int* indices;               // 3 per triangle, leaf order
+        const mesh_triangle* triangles;   // leaf order
+        const wide_bvh_node* nodes;
+        size_t vertex_count, triangle_count, node_count;
+        aabb bounds;
+
+    private:
+        void release();
+        void bind(const char* base);
+        static bool valid(const char* base, size_t size, uint64_t key);
+
+        std::vector<char> buffer;
+        void* mapped;
+        size_t mapped_size;
+};
+
+
+namespace mesh_cache_detail {
+    inline uint64_t align64(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+}
+
+
+void mesh_geometry::release() {
+    if (mapped)
+        munmap(mapped, mapped_size);
+    mapped = nullptr;
+    mapped_size = 0;
+    buffer.clear();
+}
+
+
+void mesh_geometry::build(
+    const std::vector<point3>& points, const std::vector<int>& tri_indices, uint64_t key
+) {
+    using mesh_cache_detail::align64;
+    release();
+
+    size_t tri_count = tri_indices.size() / 3;
+    std::vector<aabb> boxes(tri_count);
+    for (size_t t = 0; t < tri_count; t++) {
+        point3 a = points[tri_indices[3*t]];
+        point3 b = points[tri_indices[3*t + 1]];
+        point3 c = points[tri_indices[3*t + 2]];
+        point3 lo, hi;
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::fmin(std::fmin(a[k], b[k]), c[k]) - 0.0001;
+            hi[k] = std::fmax(std::fmax(a[k], b[k]), c[k]) + 0.0001;
+        }
+        boxes[t] = aabb(lo, hi);
+    }
+
+    wide_bvh_tree tree;
+    tree.build(boxes, leaf_size);
+
+    mesh_cache_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, "RTMESH\0", 8);
+    h.version = mesh_cache_version;
+    h.real_bytes = sizeof(real);
+    h.node_bytes = sizeof(wide_bvh_node);
+    h.block_width = simd_block_width;
+    h.key = key;
+    h.vertex_count = points.size();
+    h.triangle_count = tri_count;
+    h.node_count = tree.nodes.size();
+    h.vertex_offset = align64(sizeof(h));
+    h.index_offset = align64(h.vertex_offset + h.vertex_count * sizeof(point3));
+    h.triangle_offset = align64(h.index_offset + h.triangle_count * 3 * sizeof(int));
+    h.node_offset = align64(h.triangle_offset + h.triangle_count * sizeof(mesh_triangle));
+    h.file_size = h.node_offset + h.node_count * sizeof(wide_bvh_node);
+    for (int k = 0; k < 3; k++) {
+        h.bounds[k] = tree.bounds.min()[k];
+        h.bounds[3 + k] = tree.bounds.max()[k];
+    }
+
+    buffer.assign(h.file_size, 0);
+    char* base = buffer.data();
+    std::memcpy(base, &h, sizeof(h));
+    if (!points.empty())
+        std::memcpy(base + h.vertex_offset, points.data(), h.vertex_count * sizeof(point3));
+
+    auto idx = reinterpret_cast<int*>(base + h.index_offset);
+    auto tri = reinterpret_cast<mesh_triangle*>(base + h.triangle_offset);
+    for (size_t slot = 0; slot < tri_count; slot++) {
+        auto t = tree.order[slot];
+        for (int k = 0; k < 3; k++)
+            idx[3*slot + k] = tri_indices[3*t + k];
+        tri[slot].p0 = points[idx[3*slot]];
+        tri[slot].e1 = points[idx[3*slot + 1]] - tri[slot].p0;
+        tri[slot].e2 = points[idx[3*slot + 2]] - tri[slot].p0;
+    }
+    if (!tree.nodes.empty())
+        std::memcpy(base + h.node_offset, tree.nodes.data(),
+                    h.node_count * sizeof(wide_bvh_node));
+
+    bind(base);
+}
+
+
+bool mesh_geometry::valid(const char* base, size_t size, uint64_t key) {
+    if (size < sizeof(mesh_cache_header))
+        return false;
+    mesh_cache_header h;
+    std::memcpy(&h, base, sizeof(h));
+    if (std::memcmp(h.magic, "RTMESH\0", 8) != 0 || h.version != mesh_cache_version ||
+        h.real_bytes != sizeof(real) || h.node_bytes != sizeof(wide_bvh_node) ||
+        h.block_width != simd_block_width || h.key != key || h.file_size != size)
+        return false;
+
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t elem) {
+        return offset % 64 == 0 && offset <= size && count <= (size - offset) / elem;
+    };
+    if (!fits(h.vertex_offset, h.vertex_count, sizeof(point3)) ||
+        !fits(h.index_offset, h.triangle_count * 3, sizeof(int)) ||
+        !fits(h.triangle_offset, h.triangle_count, sizeof(mesh_triangle)) ||
+        !fits(h.node_offset, h.node_count, sizeof(wide_bvh_node)))
+        return false;
+
+    // Nodes and indices are followed blindly at render time, so check they stay in range.
+    auto idx = reinterpret_cast<const int*>(base + h.index_offset);
+    for (uint64_t i = 0; i < h.triangle_count * 3; i++)
+        if (idx[i] < 0 || static_cast<uint64_t>(idx[i]) >= h.vertex_count)
+            return false;
+    // collapse() writes interior children after their parent, so requiring that rules out
+    // cycles, and depths can be settled in one forward pass. Deeper trees than the builder
+    // makes would overflow the traversal stack.
+    auto nodes = reinterpret_cast<const wide_bvh_node*>(base + h.node_offset);
+    std::vector<int> depth(h.node_count, 0);
+    for (uint64_t n = 0; n < h.node_count; n++) {
+        for (int lane = 0; lane < simd_block_width; lane++) {
+            int64_t child = nodes[n].child[lane], count = nodes[n].count[lane];
+            if (count < 0 || child < 0)
+                return false;
+            if (count == 0 && child == 0) {
+                // Unused lane: its box must stay cleared, so no ray enters it.
+                for (int a = 0; a < 3; a++)
+                    if (nodes[n].bounds.lo[a][lane] != infinity
+                        || nodes[n].bounds.hi[a][lane] != infinity)
+                        return false;
+            } else if (count > 0) {
+                if (static_cast<uint64_t>(child + count) > h.triangle_count)
+                    return false;
+            } else {
+                if (static_cast<uint64_t>(child) <= n
+                    || static_cast<uint64_t>(child) >= h.node_count
+                    || depth[n] + 1 >= wide_bvh_tree::max_depth)
+                    return false;
+                depth[child] = std::max(depth[child], depth[n] + 1);
+            }
+        }
+    }
+    return true;
+}
+
+
+bool mesh_geometry::load(const std::string& path, uint64_t key) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    if (!valid(static_cast<const char*>(map), size, key)) {
+        munmap(map, size);
+        return false;
+    }
+
+    release();
+    mapped = map;
+    mapped_size = size;
+    bind(static_cast<const char*>(map));
+    return true;
+}
+
+
+bool mesh_geometry::save(const std::string& path) const {
+    if (buffer.empty())
+        return false;
+    std::string temp = path + ".tmp" + std::to_string(getpid());
+    FILE* f = std::fopen(temp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = std::fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (ok)
+        ok = std::rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok)
+        std::remove(temp.c_str());
+    return ok;
+}
+
+
+void mesh_geometry::bind(const char* base) {
+    mesh_cache_header h;
+    std::memcpy(&h, base, sizeof(h));
+    vertex_count = h.vertex_count;
+    triangle_count = h.triangle_count;
+    node_count = h.node_count;
+    positions = reinterpret_cast<const point3*>(base + h.vertex_offset);
+    indices = reinterpret_cast<const int*>(base + h.index_offset);
+    triangles = reinterpret_cast<const mesh_triangle*>(base + h.triangle_offset);
+    nodes = reinterpret_cast<const wide_bvh_node*>(base + h.node_offset);
+    bounds = aabb(point3(h.bounds[0], h.bounds[1], h.bounds[2]),
+                  point3(h.bounds[3], h.bounds[4], h.bounds[5]));
+}
+
+
+#endif
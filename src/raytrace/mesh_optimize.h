@@ -0,0 +1,185 @@
+#ifndef MESH_OPTIMIZE_H
+#define MESH_OPTIMIZE_H
+//==============================================================================================
+// Optional clean-up pass for triangle meshes, run before the BVH is built:
+//
+//   1. weld vertices closer than a tolerance (relative to the mesh's bounding box diagonal),
+//   2. drop triangles that collapse to a line or a point (repeated indices or ~zero area),
+//   3. sort triangles along a Morton curve and renumber vertices in first-use order, which
+//      also removes vertices no triangle references.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+
+struct mesh_optimize_options {
+    mesh_optimize_options(bool _enabled = false) : enabled(_enabled) {}
+
+    bool enabled;
+    double weld_tolerance = 1e-6;   // fraction of the bounding box diagonal
+    double min_area = 1e-12;        // fraction of the squared diagonal
+    bool reorder = true;
+};
+
+
+namespace mesh_optimize_detail {
+
+    // Spreads the low 21 bits of x so there are two zero bits between each.
+    inline uint64_t spread_bits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8)  & 0x100f00f00f00f00full;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2)  & 0x1249249249249249ull;
+        return x;
+    }
+
+    inline uint64_t morton_code(const point3& p, const point3& lo, const vec3& inv_extent) {
+        uint64_t code = 0;
+        for (int a = 0; a < 3; a++) {
+            double f = (p[a] - lo[a]) * inv_extent[a];
+            auto q = static_cast<uint64_t>(clamp(f, 0.0, 1.0) * 2097151.0);
+            code |= spread_bits(q) << a;
+        }
+        return code;
+    }
+
+    inline uint64_t cell_key(int64_t x, int64_t y, int64_t z) {
+        return (static_cast<uint64_t>(x) * 73856093ull) ^ (static_cast<uint64_t>(y) * 19349663ull)
+             ^ (static_cast<uint64_t>(z) * 83492791ull);
+    }
+
+    inline size_t mesh_bytes(size_t vertex_count, size_t triangle_count) {
+        return vertex_count * sizeof(point3) + triangle_count * 3 * sizeof(int);
+    }
+}
+
+
+// Optimizes `points` and `tri_indices` (three per triangle) in place and prints what changed.
+void optimize_mesh(
+    std::vector<point3>& points, std::vector<int>& tri_indices, const mesh_optimize_options& opt
+) {
+    using namespace mesh_optimize_detail;
+
+    if (!opt.enabled || points.empty())
+        return;
+
+    size_t vertices_before = points.size();
+    size_t triangles_before = tri_indices.size() / 3;
+
+    point3 lo = points[0], hi = points[0];
+    for (const auto& p : points)
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::fmin(lo[a], p[a]);
+            hi[a] = std::fmax(hi[a], p[a]);
+        }
+    double diagonal = (hi - lo).length();
+    if (diagonal == 0)
+        diagonal = 1;
+
+    // 1. Weld through a hash grid whose cells are one tolerance wide: a vertex only has to be
+    //    compared with those already stored in its own and the 26 neighbouring cells.
+    std::vector<int> remap(points.size());
+    std::vector<point3> welded;
+    welded.reserve(points.size());
+    double tol = opt.weld_tolerance * diagonal;
+    if (tol > 0) {
+        std::unordered_map<uint64_t, std::vector<int>> grid;
+        grid.reserve(points.size());
+        for (size_t i = 0; i < points.size(); i++) {
+            int64_t c[3];
+            for (int a = 0; a < 3; a++)
+                c[a] = static_cast<int64_t>(std::floor((points[i][a] - lo[a]) / tol));
+
+            int match = -1;
+            for (int dx = -1; dx <= 1 && match < 0; dx++)
+                for (int dy = -1; dy <= 1 && match < 0; dy++)
+                    for (int dz = -1; dz <= 1 && match < 0; dz++) {
+                        auto it = grid.find(cell_key(c[0] + dx, c[1] + dy, c[2] + dz));
+                        if (it == grid.end())
+                            continue;
+                        for (auto w : it->second)
+                            if ((welded[w] - points[i]).length_squared() <= tol * tol) {
+                                match = w;
+                                break;
+                            }
+                    }
+
+            if (match < 0) {
+                match = static_cast<int>(welded.size());
+                welded.push_back(points[i]);
+                grid[cell_key(c[0], c[1], c[2])].push_back(match);
+            }
+            remap[i] = match;
+        }
+    } else {
+        welded = points;
+        for (size_t i = 0; i < points.size(); i++)
+            remap[i] = static_cast<int>(i);
+    }
+
+    // 2. Drop degenerate triangles.
+    std::vector<int> kept;
+    kept.reserve(tri_indices.size());
+    double min_cross = 2 * opt.min_area * diagonal * diagonal;
+    for (size_t t = 0; t + 2 < tri_indices.size(); t += 3) {
+        int a = remap[tri_indices[t]], b = remap[tri_indices[t + 1]], c = remap[tri_indices[t + 2]];
+        if (a == b || b == c || a == c)
+            continue;
+        if (cross(welded[b] - welded[a], welded[c] - welded[a]).length() <= min_cross)
+            continue;
+        kept.push_back(a);
+        kept.push_back(b);
+        kept.push_back(c);
+    }
+
+    // 3. Morton-order the triangles, then number vertices by first use.
+    size_t tri_count = kept.size() / 3;
+    std::vector<int> tri_order(tri_count);
+    for (size_t t = 0; t < tri_count; t++)
+        tri_order[t] = static_cast<int>(t);
+    if (opt.reorder) {
+        vec3 extent = hi - lo;
+        vec3 inv_extent(extent.x() > 0 ? 1 / extent.x() : 0,
+                        extent.y() > 0 ? 1 / extent.y() : 0,
+                        extent.z() > 0 ? 1 / extent.z() : 0);
+        std::vector<uint64_t> codes(tri_count);
+        for (size_t t = 0; t < tri_count; t++) {
+            point3 centroid = (welded[kept[3*t]] + welded[kept[3*t + 1]] + welded[kept[3*t + 2]]) / 3;
+            codes[t] = morton_code(centroid, lo, inv_extent);
+        }
+        std::sort(tri_order.begin(), tri_order.end(),
+                  [&](int x, int y) { return codes[x] < codes[y]; });
+    }
+
+    std::vector<int> renumber(welded.size(), -1);
+    std::vector<point3> out_points;
+    out_points.reserve(welded.size());
+    tri_indices.resize(kept.size());
+    for (size_t slot = 0; slot < tri_count; slot++) {
+        for (int k = 0; k < 3; k++) {
+            int v = kept[3 * tri_order[slot] + k];
+            if (renumber[v] < 0) {
+                renumber[v] = static_cast<int>(out_points.size());
+                out_points.push_back(welded[v]);
+            }
+            tri_indices[3*slot + k] = renumber[v];
+        }
+    }
+    points.swap(out_points);
+
+    std::cerr << "mesh optimize: vertices " << vertices_before << " -> " << points.size()
+              << ", triangles " << triangles_before << " -> " << tri_count
+              << ", bytes " << mesh_bytes(vertices_before, triangles_before) << " -> "
+              << mesh_bytes(points.size(), tri_count) << "\n";
+}
+
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+//==============================================================================================
+// A wide BVH for moving primitives.
+//
+// A plain BVH has to bound each primitive over the whole shutter interval, so fast movers get
+// long boxes that overlap everything they pass. Here every node keeps its children's boxes at
+// both shutter ends and the traversal interpolates them to the ray's time. For primitives
+// that move linearly (moving_sphere, static ones) the interpolated box always contains the
+// primitive, and the same holds for unions of them higher up the tree. A rotating
+// moving_instance pads its boxes to keep that true.
+//
+// The tree topology is built once from the boxes at the middle of the shutter interval.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "simd.h"
+#include "wide_bvh.h"
+
+#include <vector>
+
+
+class motion_bvh : public hittable {
+    public:
+        motion_bvh() {}
+
+        motion_bvh(const hittable_list& list, double time0, double time1)
+            : motion_bvh(list.objects, time0, time1) {}
+
+        motion_bvh(const std::vector<shared_ptr<hittable>>& src_objects,
+                   double _time0, double _time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override {
+            output_box = bounds;
+            return !tree.empty();
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;  // in leaf order
+        wide_bvh_tree tree;                         // node bounds are those at time0
+        std::vector<box_block> motion;              // per node, box change from time0 to time1
+        double time0, time1;
+        aabb bounds;                                // over the whole interval
+
+    private:
+        void refit(int node, const std::vector<aabb>& boxes0, const std::vector<aabb>& boxes1,
+                   aabb& out0, aabb& out1);
+};
+
+
+motion_bvh::motion_bvh(
+    const std::vector<shared_ptr<hittable>>& src_objects, double _time0, double _time1
+) : time0(_time0), time1(_time1) {
+    auto n = src_objects.size();
+    std::vector<aabb> boxes0(n), boxes1(n), mid(n);
+    double time_mid = 0.5 * (time0 + time1);
+    for (size_t i = 0; i < n; i++) {
+        if (!src_objects[i]->bounding_box(time0, time0, boxes0[i]) ||
+            !src_objects[i]->bounding_box(time1, time1, boxes1[i]) ||
+            !src_objects[i]->bounding_box(time_mid, time_mid, mid[i]))
+            std::cerr << "No bounding box in motion_bvh constructor.\n";
+    }
+
+    tree.build(mid, 2);
+
+    objects.reserve(n);
+    for (auto i : tree.order)
+        objects.push_back(src_objects[i]);
+
+    motion.resize(tree.nodes.size());
+    if (!tree.empty()) {
+        aabb all0, all1;
+        refit(0, boxes0, boxes1, all0, all1);
+        bounds = surrounding_box(all0, all1);
+    }
+}
+
+
+// Rewrites the node's child boxes at time0, records how far they move by time1 and returns
+// the unions at both ends.
+void motion_bvh::refit(
+    int node, const std::vector<aabb>& boxes0, const std::vector<aabb>& boxes1,
+    aabb& out0, aabb& out1
+) {
+    auto& n = tree.nodes[node];
+    auto& m = motion[node];
+    bool first = true;
+    for (int lane = 0; lane < simd_block_width; lane++) {
+        for (int a = 0; a < 3; a++)
+            m.lo[a][lane] = m.hi[a][lane] = 0;
+
+        aabb box0, box1;
+        if (n.count[lane] > 0) {
+            box0 = boxes0[tree.order[n.child[lane]]];
+            box1 = boxes1[tree.order[n.child[lane]]];
+            for (int i = 1; i < n.count[lane]; i++) {
+                box0 = surrounding_box(box0, boxes0[tree.order[n.child[lane] + i]]);
+                box1 = surrounding_box(box1, boxes1[tree.order[n.child[lane] + i]]);
+            }
+        } else if (n.child[lane] > 0) {
+            refit(n.child[lane], boxes0, boxes1, box0, box1);
+        } else {
+            continue;  // empty lane: stays cleared and does not move
+        }
+
+        n.bounds.set(lane, box0);
+        for (int a = 0; a < 3; a++) {
+            m.lo[a][lane] = box1.min()[a] - box0.min()[a];
+            m.hi[a][lane] = box1.max()[a] - box0.max()[a];
+        }
+        out0 = first ? box0 : surrounding_box(out0, box0);
+        out1 = first ? box1 : surrounding_box(out1, box1);
+        first = false;
+    }
+}
+
+
+bool motion_bvh::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
+    real s = time1 > time0 ? (r.time() - time0) / (time1 - time0) : 0;
+    auto boxes_hit = [&](int node, const simd_ray& sr, real lo, real hi, real* t_entry) {
+        return simd.moving_boxes_hit(tree.nodes[node].bounds, motion[node], s, sr, lo, hi,
+                                     t_entry);
+    };
+
+    return wide_bvh_traverse(
+        tree.nodes.data(), tree.nodes.size(), r, t_min, t_max, boxes_hit,
+        [&](int first, int count, double& closest) {
+            bool hit_anything = false;
+            for (int i = first; i < first + count; i++) {
+                if (objects[i]->intersect(r, t_min, closest, h)) {
+                    hit_anything = true;
+                    closest = h.t;
+                }
+            }
+            return hit_anything;
+        });
+}
+
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef MOVING_SPHERE_H
+#define MOVING_SPHERE_H
+//==============================================================================================
+// Originally written in 2016 by Peter Shirley <ptrshrl@gmail.com>
+//
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "sphere.h"
+
+
+// A sphere whose center moves linearly from center0 at time0 to center1 at time1.
+class moving_sphere : public hittable {
+    public:
+        moving_sphere() {}
+        moving_sphere(
+            point3 cen0, point3 cen1, double _time0, double _time1, double r,
+            shared_ptr<material> m)
+            : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
+        {};
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
+
+        // Asked for a single instant (_time0 == _time1) this is the box at that time, which
+        // is what motion_bvh builds its shutter-end bounds from.
+        virtual bool bounding_box(
+            double _time0, double _time1, aabb& output_box) const override;
+
+        point3 center(double time) const;
+
+    public:
+        point3 center0, center1;
+        double time0, time1;
+        real radius;
+        shared_ptr<material> mat_ptr;
+        int mat_slot = -1;      // see compiled_scene::add_materials()
+};
+
+
+point3 moving_sphere::center(double time) const {
+    double s = time1 > time0 ? (time - time0) / (time1 - time0) : 0;
+    return center0 + s*(center1 - center0);
+}
+
+
+bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const {
+    vec3 extent(radius, radius, radius);
+    aabb box0(center(_time0) - extent, center(_time0) + extent);
+    aabb box1(center(_time1) - extent, center(_time1) + extent);
+    output_box = surrounding_box(box0, box1);
+    return true;
+}
+
+
+bool moving_sphere::intersect(
+    const ray& r, double t_min, double t_max, surface_hit& h) const {
+    point3 cen = center(r.time());
+    vec3 oc = r.origin() - cen;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    auto root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+
+    h.t = root;
+    h.object = this;
+    return true;
+}
+
+
+void moving_sphere::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center(r.time())) / radius;
+    rec.set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.uv_extent = sphere::get_sphere_uv_extent(radius, outward_normal);
+    rec.mat_ptr = mat_ptr;
+    rec.mat_slot = mat_slot;
+}
+
+
+#endif
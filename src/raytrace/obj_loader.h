@@ -0,0 +1,316 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+//==============================================================================================
+// Fast Wavefront OBJ loader.
+//
+// The file is memory-mapped and cut into chunks at line boundaries; each chunk is parsed by
+// its own thread with a hand-rolled number parser, and the per-chunk results are stitched
+// together afterwards. Only positions ("v") and faces ("f") are kept. Face vertices may be
+// written as v, v/vt, v//vn or v/vt/vn, and negative (relative) indices are resolved
+// against the vertices defined before the face, as the OBJ spec requires. Faces with fewer
+// than three usable vertices or with an index past the vertices are dropped with a warning.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+
+// Polygon soup in compressed-row form: face f uses
+// face_indices[face_offsets[f] .. face_offsets[f+1]), zero-based into positions.
+struct obj_data {
+    std::vector<point3> positions;
+    std::vector<int> face_offsets;
+    std::vector<int> face_indices;
+
+    size_t face_count() const { return face_offsets.empty() ? 0 : face_offsets.size() - 1; }
+};
+
+
+namespace obj_detail {
+
+    inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    inline const char* skip_space(const char* p, const char* end) {
+        while (p < end && is_space(*p)) p++;
+        return p;
+    }
+
+    inline const char* skip_line(const char* p, const char* end) {
+        while (p < end && *p != '\n') p++;
+        return p < end ? p + 1 : end;
+    }
+
+    inline double pow10(int e) {
+        static const double table[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        if (e >= 0 && e <= 22) return table[e];
+        if (e < 0 && e >= -22) return 1 / table[-e];
+        return std::pow(10.0, e);
+    }
+
+    // Parses [+-]digits[.digits][(e|E)[+-]digits]. Mantissa digits past the 19th are
+    // dropped, which keeps the result within an ulp or two of strtod.
+    inline const char* parse_real(const char* p, const char* end, double& out) {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); digits += mantissa != 0; }
+            else exponent++;
+        }
+        if (p < end && *p == '.') {
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits += mantissa != 0;
+                    exponent--;
+                }
+            }
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            bool exp_negative = false;
+            if (p < end && (*p == '-' || *p == '+'))
+                exp_negative = *p++ == '-';
+            int e = 0;
+            for (; p < end && *p >= '0' && *p <= '9'; p++)
+                e = e < 10000 ? e * 10 + (*p - '0') : e;
+            exponent += exp_negative ? -e : e;
+        }
+
+        double value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / pow10(-exponent) : value * pow10(exponent);
+        out = negative ? -value : value;
+        return p;
+    }
+
+    inline const char* parse_int(const char* p, const char* end, long& out, bool& ok) {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+        long value = 0;
+        ok = false;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            value = value * 10 + (*p - '0');
+            ok = true;
+        }
+        out = negative ? -value : value;
+        return p;
+    }
+
+    // Everything one thread extracts from its slice of the file.
+    struct chunk {
+        const char* begin;
+        const char* end;
+        std::vector<point3> positions;
+        std::vector<int> face_sizes;
+        std::vector<int> face_indices;      // absolute, or relative to this chunk's first vertex
+        std::vector<size_t> relative;       // slots of face_indices holding relative indices
+        size_t bad_lines;
+        size_t short_faces;                 // dropped for having fewer than 3 vertices
+    };
+
+    inline void parse_chunk(chunk& c) {
+        const char* p = c.begin;
+        const char* end = c.end;
+        c.bad_lines = 0;
+        c.short_faces = 0;
+
+        while (p < end) {
+            p = skip_space(p, end);
+            if (p + 1 < end && p[0] == 'v' && is_space(p[1])) {
+                double xyz[3];
+                const char* q = p + 1;
+                for (int a = 0; a < 3; a++)
+                    q = parse_real(skip_space(q, end), end, xyz[a]);
+                c.positions.push_back(point3(xyz[0], xyz[1], xyz[2]));
+                p = q;
+            } else if (p + 1 < end && p[0] == 'f' && is_space(p[1])) {
+                const char* q = p + 1;
+                size_t first_index = c.face_indices.size(), first_relative = c.relative.size();
+                int n = 0;
+                while (true) {
+                    q = skip_space(q, end);
+                    if (q >= end || *q == '\n' || *q == '#')
+                        break;
+                    long index;
+                    bool ok;
+                    q = parse_int(q, end, index, ok);
+                    // Skip the optional /vt and /vn parts of this vertex.
+                    while (q < end && !is_space(*q) && *q != '\n')
+                        q++;
+                    if (!ok || index == 0) {
+                        c.bad_lines++;
+                        continue;
+                    }
+                    if (index > 0) {
+                        c.face_indices.push_back(static_cast<int>(index - 1));
+                    } else {
+                        c.relative.push_back(c.face_indices.size());
+                        c.face_indices.push_back(
+                            static_cast<int>(c.positions.size() + index));
+                    }
+                    n++;
+                }
+                if (n >= 3) {
+                    c.face_sizes.push_back(n);
+                } else {
+                    c.face_indices.resize(first_index);
+                    c.relative.resize(first_relative);
+                    c.short_faces++;
+                }
+                p = q;
+            }
+            p = skip_line(p, end);
+        }
+    }
+
+    inline void* parse_chunk_thread(void* arg) {
+        parse_chunk(*static_cast<chunk*>(arg));
+        return NULL;
+    }
+}
+
+
+// Loads `filename` into `out`. Uses one parsing thread per online CPU unless `nthreads` is
+// given. Returns false (after printing why) if the file cannot be read or has no usable
+// faces.
+bool load_obj(const char* filename, obj_data& out, int nthreads = 0) {
+    using namespace obj_detail;
+
+    out = obj_data();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "ERROR: Could not open OBJ file '" << filename << "'.\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        std::cerr << "ERROR: OBJ file '" << filename << "' is empty or unreadable.\n";
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "ERROR: Could not map OBJ file '" << filename << "'.\n";
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const char* data = static_cast<const char*>(mapped);
+
+    if (nthreads <= 0)
+        nthreads = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    // Chunks smaller than ~1 MB are not worth a thread.
+    size_t max_chunks = size / (1 << 20) + 1;
+    if (static_cast<size_t>(nthreads) > max_chunks)
+        nthreads = static_cast<int>(max_chunks);
+    if (nthreads < 1)
+        nthreads = 1;
+
+    std::vector<chunk> chunks(nthreads);
+    const char* cursor = data;
+    for (int i = 0; i < nthreads; i++) {
+        const char* stop = i == nthreads - 1 ? data + size : data + size * (i + 1) / nthreads;
+        if (stop < cursor) stop = cursor;
+        while (stop > data && stop < data + size && stop[-1] != '\n') stop++;
+        chunks[i].begin = cursor;
+        chunks[i].end = stop;
+        cursor = stop;
+    }
+
+    // Chunk 0 is parsed on the calling thread; a chunk whose thread cannot be started is
+    // parsed there too.
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<char> started(nthreads, 0);
+    for (int i = 1; i < nthreads; i++)
+        started[i] = pthread_create(&threads[i], NULL, parse_chunk_thread, &chunks[i]) == 0;
+    for (int i = 0; i < nthreads; i++) {
+        if (!started[i])
+            parse_chunk(chunks[i]);
+    }
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+    munmap(mapped, size);
+
+    // Stitch: chunk vertex bases resolve relative indices.
+    size_t vertex_count = 0, face_count = 0, index_count = 0, bad_lines = 0, short_faces = 0;
+    for (auto& c : chunks) {
+        vertex_count += c.positions.size();
+        face_count += c.face_sizes.size();
+        index_count += c.face_indices.size();
+        bad_lines += c.bad_lines;
+        short_faces += c.short_faces;
+    }
+    out.positions.reserve(vertex_count);
+    out.face_offsets.reserve(face_count + 1);
+    out.face_indices.reserve(index_count);
+    out.face_offsets.push_back(0);
+
+    for (auto& c : chunks) {
+        auto base = static_cast<int>(out.positions.size());
+        for (auto slot : c.relative)
+            c.face_indices[slot] += base;
+        out.positions.insert(out.positions.end(), c.positions.begin(), c.positions.end());
+        out.face_indices.insert(out.face_indices.end(), c.face_indices.begin(),
+                                c.face_indices.end());
+        for (auto n : c.face_sizes)
+            out.face_offsets.push_back(out.face_offsets.back() + n);
+    }
+
+    // Faces referring to a vertex that does not exist are dropped, compacting in place.
+    size_t out_of_range = 0, kept = 0, written = 0;
+    for (size_t f = 0; f < out.face_count(); f++) {
+        int begin = out.face_offsets[f], end = out.face_offsets[f + 1];
+        bool valid = true;
+        for (int i = begin; i < end && valid; i++)
+            valid = out.face_indices[i] >= 0
+                    && out.face_indices[i] < static_cast<int>(vertex_count);
+        if (!valid) {
+            out_of_range++;
+            continue;
+        }
+        for (int i = begin; i < end; i++)
+            out.face_indices[written++] = out.face_indices[i];
+        out.face_offsets[++kept] = static_cast<int>(written);
+    }
+    out.face_indices.resize(written);
+    out.face_offsets.resize(kept + 1);
+
+    if (bad_lines)
+        std::cerr << "WARNING: '" << filename << "': " << bad_lines
+                  << " malformed face indices.\n";
+    if (short_faces || out_of_range)
+        std::cerr << "WARNING: '" << filename << "': skipped " << short_faces
+                  << " faces with fewer than 3 vertices and " << out_of_range
+                  << " with out-of-range indices.\n";
+
+    if (kept == 0) {
+        out = obj_data();
+        std::cerr << "ERROR: OBJ file '" << filename << "' has no usable faces.\n";
+        return false;
+    }
+    return true;
+}
+
+
+#endif
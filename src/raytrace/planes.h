@@ -7,6 +7,7 @@
 #include "vertices.h"
 #include <vector>
 #include "bvh.h"
+#include "wide_bvh.h"
 
 class plane : public hittable{
     public: 
@@ -37,6 +38,11 @@ class plane : public hittable{
         }
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override {
             auto normal = unit_vector(cross(plane_edges[0], plane_edges[1]));
 
             if(fabs(dot(normal, unit_vector(r.direction()))) < 0.0001)
@@ -54,15 +60,20 @@ class plane : public hittable{
                     return false;
             }
 
+            h.t = t;
+            h.object = this;
+            return true;
+        }
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override {
             rec.u = 0.5;
             rec.v = 0.5;
-            rec.t = t;
-            auto outward_normal = normal;
+            rec.t = h.t;
+            auto outward_normal = unit_vector(cross(plane_edges[0], plane_edges[1]));
             rec.set_face_normal(r, outward_normal);
             rec.mat_ptr = mp;
-            rec.p = p;
-
-            return true;
+            rec.p = r.at(h.t);
         }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
@@ -94,13 +105,18 @@ class planes: public hittable{
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override {
+            return node->intersect(r, t_min, t_max, h);
+        }
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             return sides.bounding_box(time0, time1, output_box);
         }
 
     public:
         hittable_list sides;
-        shared_ptr<bvh_node> node;
+        shared_ptr<wide_bvh> node;
 
 };
 
@@ -113,9 +129,9 @@ planes::planes(std::list<std::vector<int>> planes_nodes_nums, vertices& _vertice
         _vertices.extract(plane_node_nums, vps);
         sides.add(make_shared<plane>(vps, ptr));
     }
-    std::cerr << "make bvh_node\n";
-    node = make_shared<bvh_node>(sides,0,1);
-    std::cerr << "after make bvh_node\n";
+    std::cerr << "make wide_bvh\n";
+    node = make_shared<wide_bvh>(sides,0,1);
+    std::cerr << "after make wide_bvh\n";
 
 }
 
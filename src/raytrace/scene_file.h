@@ -0,0 +1,619 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+//==============================================================================================
+// Text scene descriptions, so scenes can change without a rebuild.
+//
+// One statement per line, # to the end of the line is a comment. A statement is a keyword,
+// a name for declarations, and key=value settings; vectors are comma-separated numbers:
+//
+//   render width=800 aspect=16/9 spp=256 pass=16 stop=0.05 background=0,0,0 denoise=1
+//   camera from=540,200,-400 at=500,200,0 up=0,1,0 vfov=40 aperture=0 focus=10 time=0,1
+//
+//   texture night image=night.jpg               mip=0 samples the image without a pyramid
+//   texture gray color=.5,.5,.5
+//   texture marble noise=4
+//   material wall lambertian color=.73,.73,.73  or texture=name
+//   material chrome metal color=.8,.85,.88 fuzz=0
+//   material glass dielectric ior=1.5
+//   material lamp light color=15,15,15          or texture=name
+//   mesh statue file=xh.obj optimize=1
+//
+//   sphere center=300,200,300 radius=80 material=glass
+//   sphere center=100,80,300 center1=140,80,300 radius=40 material=wall
+//   xz_rect bounds=400,600,300,500 k=599 material=lamp flip=1 light=1
+//   box min=475,0,225 max=725,225,475 material=glass
+//   triangle a=550,250,350 b=630,250,410 c=530,250,430 material=glass
+//   instance statue material=chrome scale=15 rotate=0,240,0 translate=720,350,350
+//   instance statue material=wall translate=200,0,300 translate1=220,0,300 rotate1=0,20,0
+//
+// xy_rect, xz_rect and yz_rect take their bounds in the order of their names and k on the
+// third axis, like the classes. Any surface takes flip=1 to face the other way; spheres and
+// xz_rects take light=1 to be sampled as lights as well; in a scene without any, bounces
+// follow the materials' own distributions only. An instance places a mesh rotated about x,
+// then y, then z (degrees), scaled, then translated, as mesh's own placement does.
+//
+// Surfaces can move while the shutter is open, from the camera's first time to its second:
+// a sphere with center1 moves from center to center1, and an instance with any of translate1,
+// rotate1 and scale1 moves from its placement to the one those give, the keys left out
+// keeping their first values. Moving spheres cannot be lights.
+//
+// Relative paths are taken from the scene file's directory. Declarations can come anywhere in
+// the file and are only built when a surface refers to them, each once: textures, materials
+// and meshes nothing uses are never loaded. Meshes are loaded as the file is read; the images
+// surfaces use are decoded together, in parallel, by texture_manager::load_all() before the
+// render starts, not when first sampled. A mesh instanced once has its placement baked in
+// (and cached on disk, see mesh_cache.h); one instanced more often is loaded once, in object
+// space, and placed by instance transforms.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "affine.h"
+#include "box.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh.h"
+#include "moving_sphere.h"
+#include "sphere.h"
+#include "texture.h"
+#include "texture_manager.h"
+#include "triangle.h"
+
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+struct scene_settings {
+    int width = 800;
+    double aspect_ratio = 16.0 / 9.0;
+    int samples = 256;              // per pixel
+    int pass_samples = 16;
+    double prob_to_stop = 0.05;     // Russian roulette, per bounce
+    color background = color(0, 0, 0);
+    bool denoise = true;
+
+    point3 lookfrom = point3(0, 0, -1);
+    point3 lookat = point3(0, 0, 0);
+    vec3 vup = vec3(0, 1, 0);
+    double vfov = 40;
+    double aperture = 0;
+    double focus_dist = 10;
+    double time0 = 0, time1 = 1;
+};
+
+
+struct scene_description {
+    scene_settings settings;
+    hittable_list objects;
+    std::vector<shared_ptr<hittable>> lights;   // shapes to sample, without materials
+    int unused = 0;                             // declarations nothing referred to
+};
+
+
+namespace scene_detail {
+    struct statement {
+        int line;
+        std::string keyword;
+        std::vector<std::string> args;      // words before the settings
+        std::vector<std::pair<std::string, std::string>> values;
+    };
+
+    class parser {
+        public:
+            parser(const std::string& path, texture_manager& textures, scene_description& out)
+                : path(path), textures(textures), out(out) {
+                size_t slash = path.find_last_of('/');
+                dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+            }
+
+            bool read(std::string& error);
+            bool build(std::string& error);
+
+        private:
+            typedef std::initializer_list<const char*> keys;
+
+            bool fail(const statement& s, const std::string& message) {
+                error_message = path + ":" + std::to_string(s.line) + ": " + message;
+                return false;
+            }
+
+            const std::string* find(const statement& s, const char* key) const {
+                for (const auto& v : s.values) {
+                    if (v.first == key)
+                        return &v.second;
+                }
+                return NULL;
+            }
+
+            bool check(const statement& s, int nargs, keys allowed);
+            bool numbers(const statement& s, const char* key, double* out, int n);
+            bool number(const statement& s, const char* key, double& out) {
+                return numbers(s, key, &out, 1);
+            }
+            bool vector(const statement& s, const char* key, vec3& out) {
+                double v[3] = {out[0], out[1], out[2]};
+                if (!numbers(s, key, v, 3))
+                    return false;
+                out = vec3(v[0], v[1], v[2]);
+                return true;
+            }
+            bool flag(const statement& s, const char* key, bool& out);
+            bool asset(const statement& s, const char* key, std::string& resolved);
+
+            bool settings(const statement& s);
+            bool surface(const statement& s);
+            bool texture_named(const statement& s, const std::string& name,
+                               shared_ptr<texture>& tex);
+            bool material_named(const statement& s, const std::string& name,
+                                shared_ptr<material>& mat);
+            bool place_mesh(const statement& s, shared_ptr<hittable>& object);
+
+            static affine mesh_placement(double scale, const vec3& rotate, const vec3& offset) {
+                return affine::translation(offset) * affine::scaling(vec3(scale, scale, scale))
+                     * affine::rotation(2, rotate.z()) * affine::rotation(1, rotate.y())
+                     * affine::rotation(0, rotate.x());
+            }
+
+            std::string path, dir;
+            texture_manager& textures;
+            scene_description& out;
+            std::string error_message;
+
+            std::vector<statement> statements;
+            std::map<std::string, const statement*> declared[3];    // texture, material, mesh
+            std::map<std::string, shared_ptr<texture>> texture_cache;
+            std::map<std::string, shared_ptr<material>> material_cache;
+            std::map<std::string, shared_ptr<mesh>> mesh_cache;     // by mesh and material
+            std::map<std::string, int> instance_count;              // likewise
+    };
+}
+
+
+// Reads the scene at `path` into `scene`, whose settings keep their values where the file
+// sets none. Images are registered with `textures` for its load_all() to decode. Returns
+// false, with a "file:line: message" error, if the file cannot be read or a statement is
+// not valid.
+bool load_scene(const std::string& path, texture_manager& textures, scene_description& scene,
+                std::string& error) {
+    scene_detail::parser p(path, textures, scene);
+    return p.read(error) && p.build(error);
+}
+
+
+namespace scene_detail {
+    static const char* const declaration_keywords[3] = {"texture", "material", "mesh"};
+
+    bool parser::read(std::string& error) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::string text;
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof buffer, f)) > 0)
+            text.append(buffer, n);
+        fclose(f);
+
+        int line = 0;
+        for (size_t start = 0; start < text.size(); ) {
+            size_t end = text.find('\n', start);
+            if (end == std::string::npos)
+                end = text.size();
+            line++;
+            statement s;
+            s.line = line;
+            // Words are split at blanks, up to a comment.
+            size_t i = start;
+            while (true) {
+                while (i < end && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r'))
+                    i++;
+                if (i == end || text[i] == '#')
+                    break;
+                size_t word = i;
+                while (i < end && text[i] != ' ' && text[i] != '\t' && text[i] != '\r'
+                       && text[i] != '#')
+                    i++;
+                std::string token = text.substr(word, i - word);
+                size_t eq = token.find('=');
+                if (s.keyword.empty())
+                    s.keyword = token;
+                else if (eq != std::string::npos)
+                    s.values.emplace_back(token.substr(0, eq), token.substr(eq + 1));
+                else if (s.values.empty())
+                    s.args.push_back(token);
+                else {
+                    error = path + ":" + std::to_string(line) + ": expected key=value, got "
+                          + token;
+                    return false;
+                }
+            }
+            if (!s.keyword.empty())
+                statements.push_back(s);
+            start = end + 1;
+        }
+
+        for (const auto& s : statements) {
+            for (int kind = 0; kind < 3; kind++) {
+                if (s.keyword != declaration_keywords[kind])
+                    continue;
+                if (s.args.empty() || !declared[kind].insert({s.args[0], &s}).second) {
+                    fail(s, s.args.empty() ? "missing name"
+                                           : s.keyword + " " + s.args[0] + " declared twice");
+                    error = error_message;
+                    return false;
+                }
+            }
+            if (s.keyword == "instance" && !s.args.empty()) {
+                const std::string* mat = find(s, "material");
+                instance_count[s.args[0] + "\n" + (mat ? *mat : "")]++;
+            }
+        }
+        return true;
+    }
+
+    bool parser::build(std::string& error) {
+        // Settings first, so moving surfaces get the shutter times wherever the camera is.
+        for (const auto& s : statements) {
+            if ((s.keyword == "render" || s.keyword == "camera") && !settings(s)) {
+                error = error_message;
+                return false;
+            }
+        }
+        for (const auto& s : statements) {
+            if (s.keyword == "render" || s.keyword == "camera" || s.keyword == "texture"
+                || s.keyword == "material" || s.keyword == "mesh")
+                continue;
+            if (!surface(s)) {
+                error = error_message;
+                return false;
+            }
+        }
+        out.unused = static_cast<int>(declared[0].size() - texture_cache.size()
+                                      + declared[1].size() - material_cache.size());
+        for (const auto& m : declared[2]) {
+            bool used = false;
+            for (const auto& count : instance_count)
+                used = used || count.first.compare(0, m.first.size() + 1, m.first + "\n") == 0;
+            out.unused += !used;
+        }
+        return true;
+    }
+
+    bool parser::check(const statement& s, int nargs, keys allowed) {
+        if (static_cast<int>(s.args.size()) != nargs)
+            return fail(s, s.keyword + (nargs ? " takes a name" : " takes no name"));
+        for (const auto& v : s.values) {
+            bool known = false;
+            for (const char* key : allowed)
+                known = known || v.first == key;
+            if (!known)
+                return fail(s, "unknown key " + v.first + " for " + s.keyword);
+        }
+        return true;
+    }
+
+    // Leaves `out` alone if the key is absent.
+    bool parser::numbers(const statement& s, const char* key, double* out, int n) {
+        const std::string* value = find(s, key);
+        if (!value)
+            return true;
+        const char* p = value->c_str();
+        for (int i = 0; i < n; i++) {
+            char* end;
+            out[i] = strtod(p, &end);
+            if (end == p || *end != (i + 1 < n ? ',' : '\0'))
+                return fail(s, std::string("bad value for ") + key + ": " + *value);
+            p = end + 1;
+        }
+        return true;
+    }
+
+    bool parser::flag(const statement& s, const char* key, bool& out) {
+        const std::string* value = find(s, key);
+        if (value && *value != "0" && *value != "1")
+            return fail(s, std::string(key) + " must be 0 or 1");
+        if (value)
+            out = *value == "1";
+        return true;
+    }
+
+    bool parser::asset(const statement& s, const char* key, std::string& resolved) {
+        const std::string* value = find(s, key);
+        if (!value || value->empty())
+            return fail(s, std::string("missing ") + key);
+        resolved = (*value)[0] == '/' ? *value : dir + *value;
+        if (access(resolved.c_str(), R_OK) != 0)
+            return fail(s, "cannot read " + resolved);
+        return true;
+    }
+
+    bool parser::settings(const statement& s) {
+        auto& set = out.settings;
+        if (s.keyword == "render") {
+            if (!check(s, 0, {"width", "aspect", "spp", "pass", "stop", "background",
+                              "denoise"}))
+                return false;
+            double width = set.width, spp = set.samples, pass = set.pass_samples;
+            if (!number(s, "width", width) || !number(s, "spp", spp)
+                || !number(s, "pass", pass) || !number(s, "stop", set.prob_to_stop)
+                || !vector(s, "background", set.background) || !flag(s, "denoise", set.denoise))
+                return false;
+            set.width = static_cast<int>(width);
+            set.samples = static_cast<int>(spp);
+            set.pass_samples = static_cast<int>(pass);
+            if (const std::string* aspect = find(s, "aspect")) {
+                // A ratio like 16/9, or a plain number.
+                double w = 0, h = 1;
+                char extra;
+                if (sscanf(aspect->c_str(), "%lf/%lf%c", &w, &h, &extra) != 2
+                    && sscanf(aspect->c_str(), "%lf%c", &w, &extra) != 1)
+                    return fail(s, "bad value for aspect: " + *aspect);
+                set.aspect_ratio = w / h;
+            }
+            if (set.width < 16 || set.width > (1 << 16) || set.samples < 1 || set.pass_samples < 1
+                || !(set.aspect_ratio > 0) || set.prob_to_stop < 0 || set.prob_to_stop >= 1)
+                return fail(s, "render settings out of range");
+            return true;
+        }
+
+        double time[2] = {set.time0, set.time1};
+        if (!check(s, 0, {"from", "at", "up", "vfov", "aperture", "focus", "time"})
+            || !vector(s, "from", set.lookfrom) || !vector(s, "at", set.lookat)
+            || !vector(s, "up", set.vup) || !number(s, "vfov", set.vfov)
+            || !number(s, "aperture", set.aperture) || !number(s, "focus", set.focus_dist)
+            || !numbers(s, "time", time, 2))
+            return false;
+        set.time0 = time[0];
+        set.time1 = time[1];
+        return true;
+    }
+
+    bool parser::texture_named(const statement& user, const std::string& name,
+                               shared_ptr<texture>& tex) {
+        auto cached = texture_cache.find(name);
+        if (cached != texture_cache.end()) {
+            tex = cached->second;
+            return true;
+        }
+        auto decl = declared[0].find(name);
+        if (decl == declared[0].end())
+            return fail(user, "no texture " + name);
+        const statement& s = *decl->second;
+        if (!check(s, 1, {"image", "mip", "color", "noise"}))
+            return false;
+
+        if (find(s, "image")) {
+            std::string file;
+            bool mip = true;
+            if (!asset(s, "image", file) || !flag(s, "mip", mip))
+                return false;
+            if (mip)
+                tex = textures.get_mipmapped(file);
+            else
+                tex = textures.get(file);
+        } else if (find(s, "color")) {
+            color c;
+            if (!vector(s, "color", c))
+                return false;
+            tex = make_shared<solid_color>(c);
+        } else if (find(s, "noise")) {
+            double scale = 1;
+            if (!number(s, "noise", scale))
+                return false;
+            tex = make_shared<noise_texture>(scale);
+        } else {
+            return fail(s, "texture needs image, color or noise");
+        }
+        texture_cache[name] = tex;
+        return true;
+    }
+
+    bool parser::material_named(const statement& user, const std::string& name,
+                                shared_ptr<material>& mat) {
+        auto cached = material_cache.find(name);
+        if (cached != material_cache.end()) {
+            mat = cached->second;
+            return true;
+        }
+        auto decl = declared[1].find(name);
+        if (decl == declared[1].end())
+            return fail(user, "no material " + name);
+        const statement& s = *decl->second;
+        if (s.args.size() != 2)
+            return fail(s, "material needs a name and a type");
+        const std::string& type = s.args[1];
+
+        color c(1, 1, 1);
+        shared_ptr<texture> tex;
+        if (type == "lambertian" || type == "light") {
+            if (!check(s, 2, {"color", "texture"}) || !vector(s, "color", c))
+                return false;
+            if (const std::string* tex_name = find(s, "texture")) {
+                if (!texture_named(s, *tex_name, tex))
+                    return false;
+            } else {
+                tex = make_shared<solid_color>(c);
+            }
+            if (type == "light")
+                mat = make_shared<diffuse_light>(tex);
+            else
+                mat = make_shared<lambertian>(tex);
+        } else if (type == "metal") {
+            double fuzz = 0;
+            if (!check(s, 2, {"color", "fuzz"}) || !vector(s, "color", c)
+                || !number(s, "fuzz", fuzz))
+                return false;
+            mat = make_shared<metal>(c, fuzz);
+        } else if (type == "dielectric") {
+            double ior = 1.5;
+            if (!check(s, 2, {"ior"}) || !number(s, "ior", ior))
+                return false;
+            mat = make_shared<dielectric>(ior);
+        } else {
+            return fail(s, "unknown material type " + type);
+        }
+        material_cache[name] = mat;
+        return true;
+    }
+
+    bool parser::place_mesh(const statement& s, shared_ptr<hittable>& object) {
+        const std::string& name = s.args[0];
+        auto decl = declared[2].find(name);
+        if (decl == declared[2].end())
+            return fail(s, "no mesh " + name);
+        const statement& m = *decl->second;
+        std::string file;
+        bool optimize = false;
+        if (!check(m, 1, {"file", "optimize"}) || !asset(m, "file", file)
+            || !flag(m, "optimize", optimize))
+            return false;
+
+        const std::string* mat_name = find(s, "material");
+        shared_ptr<material> mat;
+        if (!mat_name)
+            return fail(s, "missing material");
+        if (!material_named(s, *mat_name, mat))
+            return false;
+
+        double scale = 1;
+        vec3 rotate(0, 0, 0), offset(0, 0, 0);
+        if (!number(s, "scale", scale) || !vector(s, "rotate", rotate)
+            || !vector(s, "translate", offset))
+            return false;
+        double scale1 = scale;
+        vec3 rotate1 = rotate, offset1 = offset;
+        if (!number(s, "scale1", scale1) || !vector(s, "rotate1", rotate1)
+            || !vector(s, "translate1", offset1))
+            return false;
+        bool moving = find(s, "scale1") || find(s, "rotate1") || find(s, "translate1");
+
+        std::string key = name + "\n" + *mat_name;
+        if (!moving && instance_count[key] == 1 && scale == std::floor(scale) && scale >= 1) {
+            object = make_shared<mesh>(file.c_str(), static_cast<int>(scale), offset, rotate,
+                                       mat, mesh_optimize_options(optimize));
+            return true;
+        }
+        auto& shared = mesh_cache[key];
+        if (!shared)
+            shared = make_shared<mesh>(file.c_str(), 1, vec3(0, 0, 0), vec3(0, 0, 0), mat,
+                                       mesh_optimize_options(optimize));
+        affine placement = mesh_placement(scale, rotate, offset);
+        if (moving)
+            object = make_shared<moving_instance>(
+                shared, placement, mesh_placement(scale1, rotate1, offset1),
+                out.settings.time0, out.settings.time1);
+        else
+            object = make_shared<instance>(shared, placement);
+        return true;
+    }
+
+    bool parser::surface(const statement& s) {
+        shared_ptr<hittable> object, sampled;
+        bool flip = false, light = false;
+        const std::string* mat_name = find(s, "material");
+        shared_ptr<material> mat;
+
+        if (s.keyword == "instance") {
+            if (!check(s, 1, {"material", "scale", "rotate", "translate", "scale1", "rotate1",
+                              "translate1", "flip"})
+                || !place_mesh(s, object))
+                return false;
+        } else {
+            if (s.keyword == "sphere") {
+                if (!check(s, 0, {"center", "center1", "radius", "material", "flip", "light"}))
+                    return false;
+            } else if (s.keyword == "xy_rect" || s.keyword == "yz_rect") {
+                if (!check(s, 0, {"bounds", "k", "material", "flip"}))
+                    return false;
+            } else if (s.keyword == "xz_rect") {
+                if (!check(s, 0, {"bounds", "k", "material", "flip", "light"}))
+                    return false;
+            } else if (s.keyword == "box") {
+                if (!check(s, 0, {"min", "max", "material", "flip"}))
+                    return false;
+            } else if (s.keyword == "triangle") {
+                if (!check(s, 0, {"a", "b", "c", "material", "flip"}))
+                    return false;
+            } else {
+                return fail(s, "unknown statement " + s.keyword);
+            }
+            if (!mat_name)
+                return fail(s, "missing material");
+            if (!material_named(s, *mat_name, mat) || !flag(s, "light", light))
+                return false;
+        }
+        if (!flag(s, "flip", flip))
+            return false;
+
+        if (s.keyword == "sphere") {
+            point3 center(0, 0, 0);
+            double radius = 1;
+            if (!vector(s, "center", center) || !number(s, "radius", radius))
+                return false;
+            if (find(s, "center1")) {
+                point3 center1 = center;
+                if (!vector(s, "center1", center1))
+                    return false;
+                if (light)
+                    return fail(s, "a moving sphere cannot be a light");
+                object = make_shared<moving_sphere>(center, center1, out.settings.time0,
+                                                    out.settings.time1, radius, mat);
+            } else {
+                object = make_shared<sphere>(center, radius, mat);
+            }
+            if (light)
+                sampled = make_shared<sphere>(center, radius, shared_ptr<material>());
+        } else if (s.keyword.size() == 7 && s.keyword.compare(2, 5, "_rect") == 0) {
+            double b[4] = {0, 1, 0, 1}, k = 0;
+            if (!find(s, "bounds"))
+                return fail(s, "missing bounds");
+            if (!numbers(s, "bounds", b, 4) || !number(s, "k", k))
+                return false;
+            if (s.keyword == "xy_rect") {
+                object = make_shared<xy_rect>(b[0], b[1], b[2], b[3], k, mat);
+            } else if (s.keyword == "yz_rect") {
+                object = make_shared<yz_rect>(b[0], b[1], b[2], b[3], k, mat);
+            } else {
+                object = make_shared<xz_rect>(b[0], b[1], b[2], b[3], k, mat);
+                if (light)
+                    sampled = make_shared<xz_rect>(b[0], b[1], b[2], b[3], k,
+                                                   shared_ptr<material>());
+            }
+        } else if (s.keyword == "box") {
+            point3 p0(0, 0, 0), p1(1, 1, 1);
+            if (!vector(s, "min", p0) || !vector(s, "max", p1))
+                return false;
+            object = make_shared<box>(p0, p1, mat);
+        } else if (s.keyword == "triangle") {
+            point3 v[3];
+            if (!find(s, "a") || !find(s, "b") || !find(s, "c"))
+                return fail(s, "triangle needs a, b and c");
+            if (!vector(s, "a", v[0]) || !vector(s, "b", v[1]) || !vector(s, "c", v[2]))
+                return false;
+            object = make_shared<triangle>(v[0], v[1], v[2], mat);
+        }
+
+        if (flip)
+            object = make_shared<flip_face>(object);
+        out.objects.add(object);
+        if (sampled)
+            out.lights.push_back(sampled);
+        return true;
+    }
+}
+
+
+#endif
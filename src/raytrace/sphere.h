@@ -15,6 +15,7 @@
 
 #include "hittable.h"
 #include "onb.h"
+#include "pdf.h"
 
 
 class sphere : public hittable {
@@ -27,7 +28,15 @@ class sphere : public hittable {
             };
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
         virtual double pdf_value(const point3& o, const vec3& v) const override;
@@ -38,10 +47,12 @@ class sphere : public hittable {
 
     public:
         point3 center;
-        double radius, _area;
+        real radius;
+        double _area;
         shared_ptr<material> mat_ptr;
+        int mat_slot = -1;      // see compiled_scene::add_materials()
 
-    private:
+    public:
         static void get_sphere_uv(const point3& p, double& u, double& v) {
             // p: a given point on the sphere of radius one, centered at the origin.
             // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -56,6 +67,14 @@ class sphere : public hittable {
             u = phi / (2*pi);
             v = theta / pi;
         }
+
+        // World-space size of a unit (u,v) step at unit-sphere point p on a sphere of the
+        // given radius: u spans 2*pi*r*sin(theta) there and v spans pi*r. Returns their
+        // geometric mean.
+        static double get_sphere_uv_extent(double radius, const point3& p) {
+            auto sin_theta = sqrt(fmax(1 - p.y()*p.y(), 1e-6));
+            return pi * fabs(radius) * sqrt(2 * sin_theta);
+        }
 };
 
 double sphere::pdf_value(const point3& o, const vec3& v) const {
@@ -86,7 +105,7 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -104,14 +123,22 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
             return false;
     }
 
-    rec.t = root;
+    h.t = root;
+    h.object = this;
+    return true;
+}
+
+
+void sphere::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
+    rec.t = h.t;
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.uv_extent = get_sphere_uv_extent(radius, outward_normal);
     rec.mat_ptr = mat_ptr;
-
-    return true;
+    rec.mat_slot = mat_slot;
 }
 
 
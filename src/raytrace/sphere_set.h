@@ -0,0 +1,199 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+//==============================================================================================
+// Many static spheres stored as one primitive.
+//
+// Centers and radii live in flat SoA arrays sorted into the leaf order of a wide BVH, so a
+// leaf of up to simd_block_width spheres is tested with a single SIMD kernel call instead of
+// one virtual hit() per sphere. Materials are shared through a small table and the hit record
+// (point, normal, uv, material) is only filled in for the closest sphere found.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "simd.h"
+#include "sphere.h"
+#include "wide_bvh.h"
+
+#include <vector>
+
+
+class sphere_set : public hittable {
+    public:
+        sphere_set() {}
+
+        // Takes the plain spheres out of `list`. Anything else is kept in a wide_bvh of its
+        // own and intersected after the spheres.
+        sphere_set(const hittable_list& list);
+
+        void add(point3 center, double r, shared_ptr<material> m);
+
+        // Must be called after the last add() and before rendering.
+        void build();
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+        size_t size() const { return material_ids.size(); }
+
+    public:
+        // One entry per sphere, in leaf order after build(), which also pads the coordinate
+        // arrays for the kernels' full-width loads.
+        std::vector<real> cx, cy, cz, radius;
+        std::vector<int> material_ids;
+        std::vector<shared_ptr<material>> materials;
+        std::vector<int> material_slots;    // per material, see compiled_scene::add_materials()
+        wide_bvh_tree tree;
+        shared_ptr<wide_bvh> others;
+};
+
+
+sphere_set::sphere_set(const hittable_list& list) {
+    std::vector<shared_ptr<hittable>> rest;
+    for (const auto& object : list.objects) {
+        auto s = std::dynamic_pointer_cast<sphere>(object);
+        if (s)
+            add(s->center, s->radius, s->mat_ptr);
+        else
+            rest.push_back(object);
+    }
+    if (!rest.empty())
+        others = make_shared<wide_bvh>(rest, 0, 1);
+    build();
+}
+
+
+void sphere_set::add(point3 center, double r, shared_ptr<material> m) {
+    int id = -1;
+    for (size_t i = 0; i < materials.size(); i++) {
+        if (materials[i] == m) {
+            id = static_cast<int>(i);
+            break;
+        }
+    }
+    if (id < 0) {
+        id = static_cast<int>(materials.size());
+        materials.push_back(m);
+        material_slots.push_back(-1);
+    }
+    // Drop the padding left by an earlier build().
+    cx.resize(size());
+    cy.resize(size());
+    cz.resize(size());
+    radius.resize(size());
+    cx.push_back(center.x());
+    cy.push_back(center.y());
+    cz.push_back(center.z());
+    radius.push_back(r);
+    material_ids.push_back(id);
+}
+
+
+void sphere_set::build() {
+    size_t n = size();
+    std::vector<aabb> boxes(n);
+    for (size_t i = 0; i < n; i++) {
+        vec3 extent(radius[i], radius[i], radius[i]);
+        point3 center(cx[i], cy[i], cz[i]);
+        boxes[i] = aabb(center - extent, center + extent);
+    }
+    tree.build(boxes, simd_block_width);
+
+    auto sorted = [&](std::vector<real>& v) {
+        std::vector<real> out(n + simd_block_width - 1);
+        for (size_t slot = 0; slot < n; slot++)
+            out[slot] = v[tree.order[slot]];
+        for (size_t slot = n; slot < out.size(); slot++)
+            out[slot] = n ? out[n - 1] : 0;
+        v.swap(out);
+    };
+    sorted(cx);
+    sorted(cy);
+    sorted(cz);
+    sorted(radius);
+
+    std::vector<int> ids(n);
+    for (size_t slot = 0; slot < n; slot++)
+        ids[slot] = material_ids[tree.order[slot]];
+    material_ids.swap(ids);
+}
+
+
+bool sphere_set::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
+    simd_ray sr(r);
+    sphere_arrays spheres = {cx.data(), cy.data(), cz.data(), radius.data()};
+    double closest = t_max;
+    int hit_slot = -1;
+    tree.traverse(r, t_min, closest, [&](int first, int count, double& t_far) {
+        // A leaf only holds more than simd_block_width spheres when the depth limit was hit.
+        bool hit_anything = false;
+        for (; count > 0; first += simd_block_width, count -= simd_block_width) {
+            int n = count < simd_block_width ? count : simd_block_width;
+            real t[simd_block_width];
+            unsigned mask = simd.spheres_hit(spheres, first, n, sr, t_min, t_far, t);
+            while (mask) {
+                int lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (t[lane] < t_far) {
+                    t_far = t[lane];
+                    hit_slot = first + lane;
+                    hit_anything = true;
+                }
+            }
+        }
+        return hit_anything;
+    });
+
+    if (others && others->intersect(r, t_min, closest, h))
+        return true;
+    if (hit_slot < 0)
+        return false;
+
+    h.t = closest;
+    h.object = this;
+    h.prim = hit_slot;
+    return true;
+}
+
+
+void sphere_set::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
+    int hit_slot = h.prim;
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+    point3 center(cx[hit_slot], cy[hit_slot], cz[hit_slot]);
+    vec3 outward_normal = (rec.p - center) / radius[hit_slot];
+    rec.set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.uv_extent = sphere::get_sphere_uv_extent(radius[hit_slot], outward_normal);
+    rec.mat_ptr = materials[material_ids[hit_slot]];
+    rec.mat_slot = material_slots[material_ids[hit_slot]];
+}
+
+
+bool sphere_set::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (tree.empty())
+        return others ? others->bounding_box(time0, time1, output_box) : false;
+    output_box = tree.bounds;
+    if (others) {
+        aabb rest;
+        if (others->bounding_box(time0, time1, rest))
+            output_box = surrounding_box(output_box, rest);
+    }
+    return true;
+}
+
+
+#endif
@@ -29,11 +29,21 @@ class triangle : public hittable {
             double a = (p1 - p2).length();
             double b = (p1 - p3).length();
             double c = (p2 - p3).length();
-            double p = a + b + c;
-            triangle_area = sqrt(p * (p - a) * (p - b) * (p - c));
+            // Heron's formula on the semi-perimeter; rounding can push the product of a
+            // degenerate triangle slightly below zero, which would otherwise give NaN.
+            double p = (a + b + c) / 2;
+            triangle_area = sqrt(fmax(0.0, p * (p - a) * (p - b) * (p - c)));
         };
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual void compute_surface_interaction(
+            const ray& r, const surface_hit& h, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -68,13 +78,14 @@ class triangle : public hittable {
 
     public:
         shared_ptr<material> mp;
+        int mat_slot = -1;      // see compiled_scene::add_materials()
         point3 p1, p2, p3;
         double triangle_area;
 };
 
 
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool triangle::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
     auto normal = unit_vector(cross(p1 - p2, p1 - p3));
 
     if(fabs(dot(normal, unit_vector(r.direction()))) < 0.0001)
@@ -98,15 +109,23 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     if(!(b1 > 0 && b2 > 0 && 1 - b1 - b2 > 0))
         return false;
 
+    h.t = t;
+    h.object = this;
+    h.b1 = b1;
+    h.b2 = b2;
+    return true;
+}
+
+void triangle::compute_surface_interaction(
+    const ray& r, const surface_hit& h, hit_record& rec) const {
     rec.u = 0.5;
     rec.v = 0.5;
-    rec.t = t;
-    auto outward_normal = normal;
+    rec.t = h.t;
+    auto outward_normal = unit_vector(cross(p1 - p2, p1 - p3));
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.mat_slot = mat_slot;
+    rec.p = r.at(h.t);
 }
 
 
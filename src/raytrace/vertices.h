@@ -8,7 +8,7 @@
 
 class vertices{
     public:
-        vertices(std::vector<point3>& _points){
+        vertices(const std::vector<point3>& _points){
             points = _points;
         }
 
@@ -74,7 +74,7 @@ class vertices{
 
         void extract(std::vector<int>& node_nums, std::vector<point3>& vps){
             for(auto p: node_nums){
-                if(0 <= p < points.size()){
+                if(0 <= p && p < static_cast<int>(points.size())){
                     vps.push_back(points[p]);
                 }
                 else{
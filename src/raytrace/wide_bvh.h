@@ -0,0 +1,387 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+//==============================================================================================
+// An 8-wide bounding volume hierarchy traversed with the SIMD box kernels.
+//
+// A binary tree is built first with binned SAH, then collapsed so that every node holds up
+// to simd_block_width children. The children's boxes sit in one SoA box_block, so a single
+// kernel call tests the ray against all of them and the hit children are visited nearest
+// first.
+//
+// wide_bvh_tree only knows about primitive boxes and indices; the primitive type is up to
+// the caller, which supplies a leaf callback to traverse(). wide_bvh wraps it for ordinary
+// hittables.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <vector>
+
+
+struct wide_bvh_node {
+    box_block bounds;
+    int child[simd_block_width];  // node index, or first primitive slot of a leaf
+    int count[simd_block_width];  // 0 for an interior child, primitive count for a leaf
+};
+
+
+// Traversal over a raw node array, so trees that live in a memory-mapped file can use it.
+template <typename Leaf>
+bool wide_bvh_traverse(
+    const wide_bvh_node* nodes, size_t node_count, const ray& r, double t_min, double& closest,
+    Leaf&& leaf);
+
+// Same, but the child boxes of node n are tested by boxes_hit(n, ray, t_min, t_max, t_entry)
+// instead of the box kernel on nodes[n].bounds, e.g. to move them to the ray's time.
+template <typename BoxesHit, typename Leaf>
+bool wide_bvh_traverse(
+    const wide_bvh_node* nodes, size_t node_count, const ray& r, double t_min, double& closest,
+    BoxesHit&& boxes_hit, Leaf&& leaf);
+
+
+class wide_bvh_tree {
+    public:
+        static const int max_depth = 64;
+        static const int stack_size = max_depth * (simd_block_width - 1) + 1;
+
+        wide_bvh_tree() {}
+
+        void build(const std::vector<aabb>& prim_boxes, int max_leaf_size);
+
+        // Calls leaf(first, count, closest) for every leaf the ray reaches, nearest first.
+        // `first` indexes order[]; the callback returns true when it shortened `closest`.
+        template <typename Leaf>
+        bool traverse(const ray& r, double t_min, double& closest, Leaf&& leaf) const {
+            return wide_bvh_traverse(nodes.data(), nodes.size(), r, t_min, closest, leaf);
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+    public:
+        std::vector<wide_bvh_node> nodes;
+        std::vector<int> order;  // leaf slot -> original primitive index
+        aabb bounds;
+
+    private:
+        struct build_node {
+            aabb box;
+            int left, right;
+            int first, count;
+        };
+
+        int build_binary(
+            std::vector<build_node>& out, const std::vector<aabb>& boxes,
+            const std::vector<point3>& centroids, int first, int count, int depth,
+            int max_leaf_size);
+
+        int collapse(const std::vector<build_node>& bin, int root);
+};
+
+
+void wide_bvh_tree::build(const std::vector<aabb>& prim_boxes, int max_leaf_size) {
+    nodes.clear();
+    order.resize(prim_boxes.size());
+    if (prim_boxes.empty())
+        return;
+
+    std::vector<point3> centroids(prim_boxes.size());
+    for (size_t i = 0; i < prim_boxes.size(); i++) {
+        order[i] = static_cast<int>(i);
+        centroids[i] = 0.5 * (prim_boxes[i].min() + prim_boxes[i].max());
+    }
+
+    std::vector<build_node> bin;
+    bin.reserve(2 * prim_boxes.size());
+    auto root = build_binary(
+        bin, prim_boxes, centroids, 0, static_cast<int>(prim_boxes.size()), 0, max_leaf_size);
+    bounds = bin[root].box;
+
+    if (bin[root].count > 0) {
+        // Too few primitives to split: a single node with one leaf lane.
+        wide_bvh_node node;
+        node.bounds.clear();
+        node.bounds.set(0, bin[root].box);
+        node.child[0] = bin[root].first;
+        node.count[0] = bin[root].count;
+        for (int i = 1; i < simd_block_width; i++)
+            node.child[i] = node.count[i] = 0;
+        nodes.push_back(node);
+    } else {
+        collapse(bin, root);
+    }
+}
+
+
+int wide_bvh_tree::build_binary(
+    std::vector<build_node>& out, const std::vector<aabb>& boxes,
+    const std::vector<point3>& centroids, int first, int count, int depth, int max_leaf_size
+) {
+    build_node node;
+    node.box = boxes[order[first]];
+    aabb cbox(centroids[order[first]], centroids[order[first]]);
+    for (int i = first + 1; i < first + count; i++) {
+        node.box = surrounding_box(node.box, boxes[order[i]]);
+        cbox = surrounding_box(cbox, aabb(centroids[order[i]], centroids[order[i]]));
+    }
+    node.left = node.right = -1;
+    node.first = first;
+    node.count = count;
+
+    auto index = static_cast<int>(out.size());
+    out.push_back(node);
+
+    if (count <= max_leaf_size || depth >= max_depth - 1)
+        return index;
+
+    // Binned SAH along the longest centroid axis.
+    const int bins = 16;
+    int axis = cbox.longest_axis();
+    real lo = cbox.min()[axis];
+    real extent = cbox.max()[axis] - lo;
+
+    int mid = first + count / 2;
+    if (extent > 0) {
+        int bin_count[bins] = {0};
+        aabb bin_box[bins];
+        auto bin_of = [&](int prim) {
+            int b = static_cast<int>(bins * (centroids[prim][axis] - lo) / extent);
+            return b < 0 ? 0 : (b >= bins ? bins - 1 : b);
+        };
+        for (int i = first; i < first + count; i++) {
+            int b = bin_of(order[i]);
+            bin_box[b] = bin_count[b]++ ? surrounding_box(bin_box[b], boxes[order[i]])
+                                        : boxes[order[i]];
+        }
+
+        // Sweep from the right to get the cost of every split plane.
+        double right_area[bins];
+        int right_count[bins];
+        aabb acc;
+        int n = 0;
+        for (int b = bins - 1; b > 0; b--) {
+            if (bin_count[b])
+                acc = n ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            n += bin_count[b];
+            right_area[b] = n ? acc.area() : 0;
+            right_count[b] = n;
+        }
+
+        double best_cost = infinity;
+        int best_split = -1;
+        n = 0;
+        for (int b = 0; b < bins - 1; b++) {
+            if (bin_count[b])
+                acc = n ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0)
+                continue;
+            double cost = acc.area() * n + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+
+        if (best_split >= 0) {
+            auto it = std::partition(
+                order.begin() + first, order.begin() + first + count,
+                [&](int prim) { return bin_of(prim) <= best_split; });
+            mid = static_cast<int>(it - order.begin());
+        }
+    }
+    if (mid == first || mid == first + count)
+        mid = first + count / 2;
+
+    auto left = build_binary(out, boxes, centroids, first, mid - first, depth + 1,
+                             max_leaf_size);
+    auto right = build_binary(out, boxes, centroids, mid, first + count - mid, depth + 1,
+                              max_leaf_size);
+    out[index].left = left;
+    out[index].right = right;
+    out[index].count = 0;
+    return index;
+}
+
+
+int wide_bvh_tree::collapse(const std::vector<build_node>& bin, int root) {
+    // Open the largest interior child until the node is full or only leaves remain.
+    std::vector<int> children;
+    children.push_back(bin[root].left);
+    children.push_back(bin[root].right);
+    while (static_cast<int>(children.size()) < simd_block_width) {
+        int largest = -1;
+        double largest_area = -1;
+        for (size_t i = 0; i < children.size(); i++) {
+            const auto& c = bin[children[i]];
+            if (c.count == 0 && c.box.area() > largest_area) {
+                largest = static_cast<int>(i);
+                largest_area = c.box.area();
+            }
+        }
+        if (largest < 0)
+            break;
+        auto opened = children[largest];
+        children[largest] = bin[opened].left;
+        children.push_back(bin[opened].right);
+    }
+
+    auto index = static_cast<int>(nodes.size());
+    nodes.push_back(wide_bvh_node());
+    nodes[index].bounds.clear();
+    for (int i = 0; i < simd_block_width; i++)
+        nodes[index].child[i] = nodes[index].count[i] = 0;
+
+    for (size_t i = 0; i < children.size(); i++) {
+        const auto& c = bin[children[i]];
+        int child = c.count > 0 ? c.first : collapse(bin, children[i]);
+        nodes[index].bounds.set(static_cast<int>(i), c.box);
+        nodes[index].child[i] = child;
+        nodes[index].count[i] = c.count;
+    }
+    return index;
+}
+
+
+template <typename Leaf>
+bool wide_bvh_traverse(
+    const wide_bvh_node* nodes, size_t node_count, const ray& r, double t_min, double& closest,
+    Leaf&& leaf
+) {
+    return wide_bvh_traverse(
+        nodes, node_count, r, t_min, closest,
+        [nodes](int n, const simd_ray& sr, real lo, real hi, real* t_entry) {
+            return simd.boxes_hit(nodes[n].bounds, sr, lo, hi, t_entry);
+        },
+        leaf);
+}
+
+
+template <typename BoxesHit, typename Leaf>
+bool wide_bvh_traverse(
+    const wide_bvh_node* nodes, size_t node_count, const ray& r, double t_min, double& closest,
+    BoxesHit&& boxes_hit, Leaf&& leaf
+) {
+    if (node_count == 0)
+        return false;
+
+    struct entry {
+        int node;
+        real t;
+    };
+    entry stack[wide_bvh_tree::stack_size];
+    int sp = 0;
+    stack[sp].node = 0;
+    stack[sp].t = t_min;
+    sp++;
+
+    simd_ray sr(r);
+    bool hit_anything = false;
+
+    while (sp > 0) {
+        auto e = stack[--sp];
+        if (e.t > closest)
+            continue;
+
+        const auto& node = nodes[e.node];
+        real t_entry[simd_block_width];
+        unsigned mask = boxes_hit(e.node, sr, t_min, closest, t_entry);
+
+        // Leaves are intersected right away; interior children are pushed far to near.
+        int pending[simd_block_width];
+        int n = 0;
+        while (mask) {
+            int lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (node.count[lane] > 0) {
+                if (t_entry[lane] <= closest &&
+                    leaf(node.child[lane], node.count[lane], closest))
+                    hit_anything = true;
+            } else {
+                int j = n++;
+                while (j > 0 && t_entry[pending[j - 1]] < t_entry[lane]) {
+                    pending[j] = pending[j - 1];
+                    j--;
+                }
+                pending[j] = lane;
+            }
+        }
+        // Only a malformed tree can fill the stack (mesh_geometry::valid() rejects those on
+        // disk); its farthest children are then dropped rather than overrun it.
+        int skip = std::max(0, sp + n - wide_bvh_tree::stack_size);
+        for (int i = skip; i < n; i++) {
+            stack[sp].node = node.child[pending[i]];
+            stack[sp].t = t_entry[pending[i]];
+            sp++;
+        }
+    }
+
+    return hit_anything;
+}
+
+
+class wide_bvh : public hittable {
+    public:
+        wide_bvh() {}
+
+        wide_bvh(const hittable_list& list, double time0, double time1)
+            : wide_bvh(list.objects, time0, time1) {}
+
+        wide_bvh(const std::vector<shared_ptr<hittable>>& src_objects,
+                 double time0, double time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit_deferred(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(
+            const ray& r, double t_min, double t_max, surface_hit& h) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = tree.bounds;
+            return !tree.empty();
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;  // in leaf order
+        wide_bvh_tree tree;
+};
+
+
+wide_bvh::wide_bvh(
+    const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1
+) {
+    std::vector<aabb> boxes(src_objects.size());
+    for (size_t i = 0; i < src_objects.size(); i++) {
+        if (!src_objects[i]->bounding_box(time0, time1, boxes[i]))
+            std::cerr << "No bounding box in wide_bvh constructor.\n";
+    }
+
+    tree.build(boxes, 2);
+
+    objects.reserve(src_objects.size());
+    for (auto i : tree.order)
+        objects.push_back(src_objects[i]);
+}
+
+
+bool wide_bvh::intersect(const ray& r, double t_min, double t_max, surface_hit& h) const {
+    return tree.traverse(r, t_min, t_max, [&](int first, int count, double& closest) {
+        bool hit_anything = false;
+        for (int i = first; i < first + count; i++) {
+            if (objects[i]->intersect(r, t_min, closest, h)) {
+                hit_anything = true;
+                closest = h.t;
+            }
+        }
+        return hit_anything;
+    });
+}
+
+
+#endif